@@ -418,6 +418,8 @@ class BPMF:
        free energy perturbation
     redo does not do anything now; it is an option for debugging
     """
+    from estimators import EXP
+
     # Initialize variables as empty lists or by loading data
     f_L_FN = os.path.join(self.args.dir['BC'], 'f_L.pkl.gz')
     dat = load_pkl_gz(f_L_FN)
@@ -540,7 +542,7 @@ class BPMF:
         du_F = (u_L[:, -1] - u_sampled)
         min_du_F = min(du_F)
         w_L = np.exp(-du_F + min_du_F)
-        f_L_solv = -np.log(np.mean(w_L)) + min_du_F
+        f_L_solv = EXP(du_F)
         mean_u_phase = np.sum(u_L[:, -1] * w_L) / np.sum(w_L)
 
         self.f_L[phase + '_solv'].append(f_L_solv)
@@ -588,6 +590,8 @@ class BPMF:
     Calculates the binding potential of mean force
     redo recalculates f_RL and B except grid_MBAR
     """
+    from estimators import EXP
+
     if self.data['CD'].protocol == []:
       return  # Initial CD is incomplete
 
@@ -810,7 +814,7 @@ class BPMF:
         weights = weights / sum(weights)
 
         # Exponential average
-        f_RL_solv = -np.log(np.exp(-du + min_du).mean()) + min_du - f_R_solv
+        f_RL_solv = EXP(du) - f_R_solv
 
         # Interaction energies
         Psi = np.concatenate([self.stats_RL['Psi_'+phase][c] \
@@ -1310,11 +1314,8 @@ class BPMF:
 
     protocol = self.data[process].protocol
     Es_repX = [[copy.deepcopy(self.data[process].Es[k][-1])] for k in range(len(protocol))]
-    (u_kln, N_k) = self._u_kln(Es_repX, protocol)
-
-    # This is a more direct way to get the weights
-    from pymbar.utils import kln_to_kn
-    u_kn = kln_to_kn(u_kln, N_k=N_k)
+    from AlGDock import reduced_energies
+    (u_kn, N_k) = reduced_energies.u_kn(Es_repX, protocol)
 
     from pymbar.utils import logsumexp
     log_denominator_n = logsumexp(f_k - u_kn.T, b=N_k, axis=1)
@@ -1354,18 +1355,11 @@ class BPMF:
     # For sampling importance resampling,
     # prepare an augmented matrix for pymbar calculations
     # with a new thermodynamic state
-    (u_kln_s, N_k) = self._u_kln(self.data['CD'].Es, self.data['CD'].protocol)
-    (K, L, N) = u_kln_s.shape
-
-    u_kln_n = self._u_kln(self.data['CD'].Es, [params_n])[0]
-    L += 1
+    (u_kln, N_k) = self._u_kln(self.data['CD'].Es, \
+      self.data['CD'].protocol + [params_n])
+    (K, L, N) = u_kln.shape
     N_k = np.append(N_k, [0])
 
-    u_kln = np.zeros([K, L, N])
-    u_kln[:, :-1, :] = u_kln_s
-    for k in range(K):
-      u_kln[k, -1, :] = u_kln_n[k, 0, :]
-
     # Determine SIR weights
     weights = self.run_MBAR(u_kln, N_k, augmented=True)[1][:, -1]
     weights = weights / sum(weights)
@@ -1684,21 +1678,17 @@ class BPMF:
     Estimates the free energy of a transition using BAR and MBAR
     """
     import pymbar
+    from estimators import EXP, BAR
     K = len(N_k) - 1 if augmented else len(N_k)
     f_k_FEPF = np.zeros(K)
     f_k_BAR = np.zeros(K)
     W_nl = None
     for k in range(K - 1):
       w_F = u_kln[k, k + 1, :N_k[k]] - u_kln[k, k, :N_k[k]]
-      min_w_F = min(w_F)
       w_R = u_kln[k + 1, k, :N_k[k + 1]] - u_kln[k + 1, k + 1, :N_k[k + 1]]
-      min_w_R = min(w_R)
-      f_k_FEPF[k + 1] = -np.log(np.mean(np.exp(-w_F + min_w_F))) + min_w_F
+      f_k_FEPF[k + 1] = EXP(w_F)
       try:
-        f_k_BAR[k+1] = pymbar.BAR(w_F, w_R, \
-                       relative_tolerance=1.0E-5, \
-                       verbose=False, \
-                       compute_uncertainty=False)
+        f_k_BAR[k + 1] = BAR(w_F, w_R, tol=1.0E-5)
       except:
         f_k_BAR[k + 1] = f_k_FEPF[k + 1]
         print 'Error with BAR. Using FEP.'
@@ -1727,106 +1717,10 @@ class BPMF:
     """
     Computes a reduced potential energy matrix.  k is the sampled state.  l is the state for which energies are evaluated.
 
-    Input:
-    eT is a
-      -dictionary (of mapped energy terms) of numpy arrays (over states)
-      -list (over states) of dictionaries (of mapped energy terms) of numpy arrays (over configurations), or a
-      -list (over states) of lists (over cycles) of dictionaries (of mapped energy terms) of numpy arrays (over configurations)
-    protocol is a list of thermodynamic states
-    noBeta means that the energy will not be divided by RT
-
-    Output: u_kln or (u_kln, N_k)
-    u_kln is the matrix (as a numpy array)
-    N_k is an array of sample sizes
+    See AlGDock.reduced_energies.u_kln
     """
-    L = len(protocol)
-
-    addMM = ('MM' in protocol[0].keys()) and (protocol[0]['MM'])
-    addSite = ('site' in protocol[0].keys()) and (protocol[0]['site'])
-    probe_keys = ['MM','k_angular_ext','k_spatial_ext','k_angular_int'] + \
-      scalables
-    probe_key = [key for key in protocol[0].keys() if key in probe_keys][0]
-
-    if isinstance(eTs, dict):
-      # There is one configuration per state
-      K = len(eTs[probe_key])
-      N_k = np.ones(K, dtype=int)
-      u_kln = []
-      E_base = np.zeros(K)
-      if addMM:
-        E_base += eTs['MM']
-      if addSite:
-        E_base += eTs['site']
-      for l in range(L):
-        E = 1. * E_base
-        for scalable in scalables:
-          if scalable in protocol[l].keys():
-            E += protocol[l][scalable] * eTs[scalable]
-        for key in ['k_angular_ext', 'k_spatial_ext', 'k_angular_int']:
-          if key in protocol[l].keys():
-            E += protocol[l][key] * eTs[key]
-        if noBeta:
-          u_kln.append(E)
-        else:
-          u_kln.append(E / (R * protocol[l]['T']))
-    elif isinstance(eTs[0], dict):
-      K = len(eTs)
-      N_k = np.array([len(eTs[k][probe_key]) for k in range(K)])
-      u_kln = np.zeros([K, L, N_k.max()], np.float)
-
-      for k in range(K):
-        E_base = 0.0
-        if addMM:
-          E_base += eTs[k]['MM']
-        if addSite:
-          E_base += eTs[k]['site']
-        for l in range(L):
-          E = 1. * E_base
-          for scalable in scalables:
-            if scalable in protocol[l].keys():
-              E += protocol[l][scalable] * eTs[k][scalable]
-          for key in ['k_angular_ext', 'k_spatial_ext', 'k_angular_int']:
-            if key in protocol[l].keys():
-              E += protocol[l][key] * eTs[k][key]
-          if noBeta:
-            u_kln[k, l, :N_k[k]] = E
-          else:
-            u_kln[k, l, :N_k[k]] = E / (R * protocol[l]['T'])
-    elif isinstance(eTs[0], list):
-      K = len(eTs)
-      N_k = np.zeros(K, dtype=int)
-
-      for k in range(K):
-        for c in range(len(eTs[k])):
-          N_k[k] += len(eTs[k][c][probe_key])
-      u_kln = np.zeros([K, L, N_k.max()], np.float)
-
-      for k in range(K):
-        E_base = 0.0
-        C = len(eTs[k])
-        if addMM:
-          E_base += np.concatenate([eTs[k][c]['MM'] for c in range(C)])
-        if addSite:
-          E_base += np.concatenate([eTs[k][c]['site'] for c in range(C)])
-        for l in range(L):
-          E = 1. * E_base
-          for scalable in scalables:
-            if scalable in protocol[l].keys():
-              E += protocol[l][scalable]*np.concatenate([eTs[k][c][scalable] \
-                for c in range(C)])
-          for key in ['k_angular_ext', 'k_spatial_ext', 'k_angular_int']:
-            if key in protocol[l].keys():
-              E += protocol[l][key]*np.concatenate([eTs[k][c][key] \
-                for c in range(C)])
-          if noBeta:
-            u_kln[k, l, :N_k[k]] = E
-          else:
-            u_kln[k, l, :N_k[k]] = E / (R * protocol[l]['T'])
-
-    if (K == 1) and (L == 1):
-      return u_kln.ravel()
-    else:
-      return (u_kln, N_k)
+    from AlGDock.reduced_energies import u_kln
+    return u_kln(eTs, protocol, noBeta)
 
   def _clear_f_RL(self):
     # stats_RL will include internal energies, interaction energies,
@@ -97,6 +97,65 @@ class InterpolationForceField(ForceField):
   def set_strength(self, strength):
     self.params['strength'] = strength
 
+  def scaling_factors(self, universe):
+    # Collect the scaling_factor into an array
+    scaling_factor = ParticleScalar(universe)
+    for o in universe:
+      for a in o.atomList():
+        scaling_factor[a] = o.getAtomProperty(a, self.params['scaling_property'])
+    scaling_factor.scaleBy(self.params['scaling_prefactor'])
+    return scaling_factor
+
+  def batch_energies(self, confs, scaling_factor):
+    """
+    Returns the energies of a batch of configurations.
+    This is a vectorized version of the trilinear grid terms
+    that does not calculate gradients.
+
+    @confs: an array of coordinates with shape (nconfs, natoms, 3)
+    @scaling_factor: an array of atomic scaling factors,
+      e.g. from scaling_factors(universe).array
+    """
+    if self.params['interpolation_type']!='Trilinear' or \
+        self.params['energy_thresh']>0:
+      raise NotImplementedError
+
+    spacing = self.grid_data['spacing']
+    counts = self.grid_data['counts']
+    vals = self.grid_data['vals']
+    hCorner = spacing*(counts-1)
+    nyz = counts[1]*counts[2]
+
+    # Only atoms with nonzero scaling factors contribute
+    atoms = np.nonzero(scaling_factor)[0]
+    x = np.asarray(confs)[:,atoms,:]
+    scaling_factor = scaling_factor[atoms]
+
+    # Index and fraction within the grid
+    inside = np.logical_and(x>0, x<hCorner).all(-1)
+    ixyz = np.clip(np.floor(x/spacing).astype(int), 0, counts-2)
+    f = x/spacing - ixyz
+    a = 1. - f
+    i = ixyz[...,0]*nyz + ixyz[...,1]*counts[2] + ixyz[...,2]
+
+    # Trilinear interpolation
+    vm = a[...,1]*(a[...,2]*vals[i] + f[...,2]*vals[i+1]) + \
+      f[...,1]*(a[...,2]*vals[i+counts[2]] + f[...,2]*vals[i+counts[2]+1])
+    i += nyz
+    vp = a[...,1]*(a[...,2]*vals[i] + f[...,2]*vals[i+1]) + \
+      f[...,1]*(a[...,2]*vals[i+counts[2]] + f[...,2]*vals[i+counts[2]+1])
+    interpolated = a[...,0]*vm + f[...,0]*vp
+    if self.params['inv_power'] is not None:
+      interpolated = interpolated**self.params['inv_power']
+
+    # Harmonic restraint to keep atoms within the grid
+    k = 10000. # kJ/mol nm**2
+    dev = np.minimum(x, 0.) + np.maximum(x - hCorner, 0.)
+    outside = k*np.sum(np.square(dev),-1)/2.
+
+    return self.params['strength']*np.sum(np.where(inside, \
+      scaling_factor*interpolated, outside), -1)
+
   # The following method is called by the energy evaluation engine
   # to inquire if this force field term has all the parameters it
   # requires. This is necessary for interdependent force field
@@ -119,12 +178,7 @@ class InterpolationForceField(ForceField):
     # an empty list of energy terms.
     if subset1 is not None or subset2 is not None:
       return []
-    # Collect the scaling_factor into an array
-    scaling_factor = ParticleScalar(universe)
-    for o in universe:
-      for a in o.atomList():
-        scaling_factor[a] = o.getAtomProperty(a, self.params['scaling_property'])
-    scaling_factor.scaleBy(self.params['scaling_prefactor'])
+    scaling_factor = self.scaling_factors(universe)
 
     # Here we pass all the parameters to
     # the energy term code that handles energy calculations.
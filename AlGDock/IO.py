@@ -58,9 +58,66 @@ class Grid:
       data['spacing'] = multiplier * data['spacing']
     return data
 
-  def _read_dx(self, FN):
+  def _read_dx(self, FN, box=None, chunk_size=2**20):
     """
     Reads a grid in dx format
+
+    If box is a tuple of (min_ijk, counts), only the points in the box
+    are kept, so the full grid is never held in memory.
+    The file is read and parsed in chunks of chunk_size bytes.
+    """
+    from grid_dx import parse_dx_vals, crop_vals
+
+    (F, header) = self._open_dx_for_reading(FN)
+    origin = header['origin']
+    spacing = header['spacing']
+    counts = header['counts']
+
+    # Read the data
+    if box is None:
+      vals = np.ndarray(shape=header['npts'], dtype=float)
+      chunk_vals = vals
+    else:
+      (min_ijk, box_counts) = box
+      min_ijk = np.array(min_ijk, dtype=int)
+      box_counts = np.array(box_counts, dtype=int)
+      vals = np.zeros(shape=np.prod(box_counts), dtype=float)
+      chunk_vals = np.ndarray(shape=min(header['npts'], chunk_size / 2), \
+        dtype=float)
+    index = 0
+    text = ''
+    final = False
+    while index < header['npts']:
+      if not final:
+        new_text = F.read(chunk_size)
+        final = (new_text == '')
+        text = text + new_text
+      if box is None:
+        (index, consumed) = parse_dx_vals(text, vals, index, final)
+      else:
+        (n, consumed) = parse_dx_vals(text, \
+          chunk_vals[:min(len(chunk_vals), header['npts'] - index)], \
+          0, final)
+        crop_vals(chunk_vals[:n], index, counts, min_ijk, box_counts, vals)
+        index += n
+      text = text[consumed:]
+      if final and consumed == 0:
+        break
+    F.close()
+    if index < header['npts']:
+      raise Exception('%s has %d of %d values' % (FN, index, header['npts']))
+
+    if box is not None:
+      origin = origin + min_ijk * spacing
+      counts = box_counts
+
+    data = {'origin':origin, 'spacing':spacing, 'counts':counts, 'vals':vals}
+    return data
+
+  def _open_dx_for_reading(self, FN):
+    """
+    Opens a dx file and reads the header.
+    Returns the file, positioned at the start of the values, and the header.
     """
     if FN.endswith('.dx'):
       F = open(FN, 'r')
@@ -68,7 +125,6 @@ class Grid:
       import gzip
       F = gzip.open(FN, 'r')
 
-    # Read the header
     line = F.readline()
     while line.find('object') == -1:
       line = F.readline()
@@ -90,22 +146,11 @@ class Grid:
             and header['d2'][2] > 0):
       raise Exception('Trilinear grid must have positive coordinates')
 
-    # Read the data
-    vals = np.ndarray(shape=header['npts'], dtype=float)
-    index = 0
-    while index < header['npts']:
-      line = F.readline()[:-1]
-      items = [float(item) for item in line.split()]
-      vals[index:index + len(items)] = items
-      index = index + len(items)
-    F.close()
-
-    data = {
-      'origin':np.array(header['origin']), \
-      'spacing':np.array([header['d0'][0],header['d1'][1],header['d2'][2]]), \
-      'counts':np.array(header['counts']), \
-      'vals':vals}
-    return data
+    header['origin'] = np.array(header['origin'])
+    header['spacing'] = np.array(\
+      [header['d0'][0], header['d1'][1], header['d2'][2]])
+    header['counts'] = np.array(header['counts'], dtype=int)
+    return (F, header)
 
   def _read_nc(self, FN):
     """
@@ -145,6 +190,14 @@ class Grid:
     """
     Writes a grid in dx format
     """
+    F = self._open_dx_for_writing(FN, data)
+    self._write_dx_vals(F, data['vals'])
+    self._close_dx(F)
+
+  def _open_dx_for_writing(self, FN, data):
+    """
+    Opens a dx file and writes the header
+    """
     n_points = data['counts'][0] * data['counts'][1] * data['counts'][2]
     if FN.endswith('.dx'):
       F = open(FN, 'w')
@@ -160,11 +213,23 @@ delta 0.0 0.0 {2[2]}
 object 2 class gridconnections counts {0[0]} {0[1]} {0[2]}
 object 3 class array type double rank 0 items {3} data follows
 """.format(data['counts'], data['origin'], data['spacing'], n_points))
+    return F
 
-    for start_n in range(0, len(data['vals']), 3):
-      F.write(' '.join(['%6e' % c
-                        for c in data['vals'][start_n:start_n + 3]]) + '\n')
+  def _write_dx_vals(self, F, vals, chunk_size=3 * 2**16):
+    """
+    Writes values to a dx file, three per line.
+    Unless it is the last block, the number of values should be
+    a multiple of three.
+    """
+    from grid_dx import format_dx_vals
+    vals = np.ascontiguousarray(vals, dtype=float)
+    for start_n in range(0, len(vals), chunk_size):
+      F.write(format_dx_vals(vals[start_n:start_n + chunk_size]))
 
+  def _close_dx(self, F):
+    """
+    Writes the footer of a dx file and closes it
+    """
     F.write('object 4 class field\n')
     F.write('component "positions" value 1\n')
     F.write('component "connections" value 2\n')
@@ -175,6 +240,14 @@ object 3 class array type double rank 0 items {3} data follows
     """
     Writes a grid in netcdf format
     """
+    grid_nc = self._open_nc_for_writing(FN, data)
+    grid_nc.variables['vals'][:] = data['vals']
+    grid_nc.close()
+
+  def _open_nc_for_writing(self, FN, data):
+    """
+    Creates a netcdf grid file and writes everything except the values
+    """
     n_points = data['counts'][0] * data['counts'][1] * data['counts'][2]
     from netCDF4 import Dataset
     grid_nc = Dataset(FN, 'w', format='NETCDF4')
@@ -185,9 +258,9 @@ object 3 class array type double rank 0 items {3} data follows
     grid_nc.createVariable('counts', 'i8', ('one', 'n_cartesian'))
     grid_nc.createVariable('spacing', 'f8', ('one', 'n_cartesian'))
     grid_nc.createVariable('vals', 'f8', ('one', 'n_points'), zlib=True)
-    for key in data.keys():
+    for key in ['origin', 'counts', 'spacing']:
       grid_nc.variables[key][:] = data[key]
-    grid_nc.close()
+    return grid_nc
 
   def truncate(self, in_FN, out_FN, counts, multiplier=None):
     """
@@ -196,31 +269,85 @@ object 3 class array type double rank 0 items {3} data follows
 
     multiplier is for the values, not the grid scaling
     """
-    data_o = self.read(in_FN)
-    nyz_o = data_o['counts'][1] * data_o['counts'][2]
-    nz_o = data_o['counts'][2]
+    counts = np.array(counts, dtype=int)
+    if in_FN.endswith('.dx') or in_FN.endswith('.dx.gz'):
+      # Read the header to find the box, then crop while reading the values
+      (F, header) = self._open_dx_for_reading(in_FN)
+      F.close()
+      min_ijk = np.array(-header['origin'] / header['spacing'], dtype=int)
+      data_n = self._read_dx(in_FN, box=(min_ijk, counts))
+    else:
+      data_o = self.read(in_FN)
+      min_ijk = np.array(-data_o['origin'] / data_o['spacing'], dtype=int)
+      vals = data_o['vals'].reshape(tuple(data_o['counts']))[ \
+        min_ijk[0]:min_ijk[0] + counts[0], \
+        min_ijk[1]:min_ijk[1] + counts[1], \
+        min_ijk[2]:min_ijk[2] + counts[2]]
+      data_n = {'spacing':data_o['spacing'], 'vals':vals.flatten()}
+      del data_o
 
-    min_i = int(-data_o['origin'][0] / data_o['spacing'][0])
-    min_j = int(-data_o['origin'][1] / data_o['spacing'][1])
-    min_k = int(-data_o['origin'][2] / data_o['spacing'][2])
+    if multiplier is not None:
+      data_n['vals'] *= multiplier
 
-    #    vals = np.ndarray(shape=tuple(counts), dtype=float)
-    #    for i in range(counts[0]):
-    #      for j in range(counts[1]):
-    #        for k in range(counts[2]):
-    #          vals[i,j,k] = data_o['vals'][(i+min_i)*nyz_o + (j+min_j)*nz_o + (k+min_k)]
+    data_n['origin'] = np.array([0., 0., 0.])
+    data_n['counts'] = counts
+    self.write(out_FN, data_n)
 
-    vals = np.array([[[
-      data_o['vals'][(i + min_i) * nyz_o + (j + min_j) * nz_o + (k + min_k)]
-      for k in range(counts[2])
-    ] for j in range(counts[1])] for i in range(counts[0])])
+  def resample(self, in_FNs, out_FN, counts, spacing, origin=None, \
+      multiplier=None, order=1, chunk_size=3 * 2**16):
+    """
+    Resamples one or more grids onto a new grid and writes it.
 
-    if multiplier is not None:
-      vals = vals * multiplier
+    in_FNs is a list of grids from the finest to the coarsest,
+      e.g. focusing levels from APBS.
+    Each point takes the value from the finest grid that contains it.
+    order is 1 for trilinear and 3 for Catmull-Rom interpolation.
+    The new grid is interpolated and written in chunks,
+      so only one full copy of each input grid is kept in memory.
 
-    data_n = {'origin':np.array([0., 0., 0.]), \
-      'counts':counts, 'spacing':data_o['spacing'], 'vals':vals.flatten()}
-    self.write(out_FN, data_n)
+    multiplier is for the values, not the grid scaling
+    """
+    from grid_resample import resample
+
+    if origin is None:
+      origin = np.array([0., 0., 0.])
+    data_n = {'origin':np.array(origin, dtype=float), \
+      'counts':np.array(counts, dtype=int), \
+      'spacing':np.array(spacing, dtype=float)}
+
+    levels = []
+    for FN in in_FNs:
+      data_o = self.read(FN)
+      levels.append((data_o['vals'].reshape(tuple(data_o['counts'])), \
+        data_o['origin'], data_o['spacing']))
+      del data_o
+
+    n_points = np.prod(data_n['counts'])
+    if out_FN.endswith('.nc'):
+      F = self._open_nc_for_writing(out_FN, data_n)
+    elif out_FN.endswith('.dx') or out_FN.endswith('.dx.gz'):
+      F = self._open_dx_for_writing(out_FN, data_n)
+    else:
+      raise Exception('File type not supported')
+
+    # The chunk size is a multiple of three so that dx lines are complete
+    chunk_size = max(3 * (chunk_size / 3), 3)
+    chunk = np.zeros(chunk_size, dtype=float)
+    for n_start in range(0, n_points, chunk_size):
+      vals = resample(levels, data_n['origin'], data_n['spacing'], \
+        data_n['counts'], n_start, \
+        chunk[:min(chunk_size, n_points - n_start)], order)
+      if multiplier is not None:
+        vals *= multiplier
+      if out_FN.endswith('.nc'):
+        F.variables['vals'][0, n_start:n_start + len(vals)] = vals
+      else:
+        self._write_dx_vals(F, vals)
+
+    if out_FN.endswith('.nc'):
+      F.close()
+    else:
+      self._close_dx(F)
 
 
 class crd:
@@ -1,9 +1,11 @@
 # This module implements am External Monte Carlo move "integrator"
 
-from MMTK import Configuration, Dynamics, Environment, Features, Trajectory, Units
+from MMTK import Dynamics, Environment, Features, Trajectory, Units
 import MMTK_dynamics
 import numpy as np
 
+from AlGDock.coordinates import set_coordinates, energy
+
 import random
 
 R = 8.3144621*Units.J/Units.mol/Units.K
@@ -32,6 +34,34 @@ def random_rotate():
                      q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3]]])
   return rotMat
 
+def random_rotations(n):
+  """
+  Return an array of n random rotation matrices
+  """
+  u = np.random.uniform(size=(3,n))
+
+  # Random quaternions
+  q = np.array([np.sqrt(1-u[0])*np.sin(2*np.pi*u[1]),
+               np.sqrt(1-u[0])*np.cos(2*np.pi*u[1]),
+               np.sqrt(u[0])*np.sin(2*np.pi*u[2]),
+               np.sqrt(u[0])*np.cos(2*np.pi*u[2])])
+
+  # Convert the quaternions into rotation matrices
+  rotMat = np.array([[q[0]*q[0] + q[1]*q[1] - q[2]*q[2] - q[3]*q[3],
+                     2*q[1]*q[2] - 2*q[0]*q[3],
+                     2*q[1]*q[3] + 2*q[0]*q[2]],
+                    [2*q[1]*q[2] + 2*q[0]*q[3],
+                     q[0]*q[0] - q[1]*q[1] + q[2]*q[2] - q[3]*q[3],
+                     2*q[2]*q[3] - 2*q[0]*q[1]],
+                    [2*q[1]*q[3] - 2*q[0]*q[2],
+                     2*q[2]*q[3] + 2*q[0]*q[1],
+                     q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3]]])
+  return np.transpose(rotMat, (2,0,1))
+
+def log_sum_exp(a):
+  a_max = np.max(a)
+  return a_max + np.log(np.sum(np.exp(a - a_max)))
+
 #
 # External Monte Carlo move integrator
 #
@@ -39,8 +69,9 @@ class ExternalMCIntegrator(Dynamics.Integrator):
   def __init__(self, universe, molecule, step_size, sampling_universe=None, \
       **options):
     """
-    confs - configurations to dart to
-    extended - whether or not to use external coordinates
+    molecule - the ligand
+    step_size - standard deviation of random translations
+    sampling_universe - universe used to evaluate the sampling Hamiltonian
     """
     Dynamics.Integrator.__init__(self, universe, options)
     # Supported features: none for the moment, to keep it simple
@@ -49,17 +80,66 @@ class ExternalMCIntegrator(Dynamics.Integrator):
     self.molecule = molecule
     self.step_size = step_size
     self.sampling_universe = sampling_universe
+    self._scaling_factors = {}
+
+  def _propose(self, x, com, rotate, ntries):
+    """
+    Returns ntries rigid body moves of x and their centers of mass.
+    The moves are symmetric, which is required for multiple-try Metropolis.
+    """
+    steps = np.random.randn(ntries,3)*self.step_size
+    if rotate:
+      # Random translation and full rotation
+      xs = np.einsum('ij,njk->nik', x - com, random_rotations(ntries))
+    else:
+      # Random translation
+      xs = np.repeat(np.expand_dims(x - com, 0), ntries, axis=0)
+    return (xs + (com + steps)[:,np.newaxis,:], com + steps)
+
+  def _screen(self, confs, screen):
+    """
+    Returns the energies of a batch of configurations
+    on the grids used for prescreening
+    """
+    E = np.zeros(len(confs))
+    for ff in screen:
+      name = ff.params['name']
+      if not name in self._scaling_factors.keys():
+        self._scaling_factors[name] = \
+          ff.scaling_factors(self.universe).array
+      E += ff.batch_energies(confs, self._scaling_factors[name])
+    return E
 
   def __call__(self, **options):
+    """
+    Performs rigid body Monte Carlo moves.
+
+    With the 'screen' option, a list of grid force fields,
+    each trial generates 'ntries' candidates.
+    One candidate is chosen with a probability proportional to
+    its Boltzmann factor on the screening grids.
+    Only the chosen candidate has its full energy evaluated.
+    Multiple-try Metropolis with importance weights [Pandolfi et al. 2010]
+    keeps the sampling exact.
+    """
     # Process the keyword arguments
     self.setCallOptions(options)
     # Check if the universe has features not supported by the integrator
     Features.checkFeatures(self, self.universe)
-  
+
     RT = R*self.getOption('T')
     ntrials = self.getOption('ntrials')
     natoms = self.universe.numberOfAtoms()
 
+    if 'screen' in self.call_options.keys():
+      screen = self.getOption('screen')
+    else:
+      screen = []
+    if ('ntries' in self.call_options.keys()) and len(screen)>0:
+      ntries = self.getOption('ntries')
+    else:
+      ntries = 1
+
     acc = 0
     xo = np.copy(self.universe.configuration().array)
     com = self.universe.centerOfMass().array
@@ -68,27 +148,50 @@ class ExternalMCIntegrator(Dynamics.Integrator):
     else:
       self.sampling_universe.configuration().array[-natoms:,:] = xo
       eo = self.sampling_universe.energy() # <- Using sampling Hamiltonian
-    
+    if ntries>1:
+      log_w_o = -self._screen(xo[np.newaxis], screen)[0]/RT
+
     for c in range(ntrials):
-      step = np.random.randn(3)*self.step_size
-      if c%2==0:
-        # Random translation and full rotation
-        xn = np.dot((xo - com), random_rotate()) + com + step
+      # Alternate between a random translation and full rotation
+      # and a random translation
+      rotate = (c%2==0)
+      (xns, coms) = self._propose(xo, com, rotate, ntries)
+      if ntries>1:
+        # Choose a candidate based on the screening grids
+        log_w = -self._screen(xns, screen)/RT
+        log_w[np.isnan(log_w)] = -np.inf
+        if not np.isfinite(np.max(log_w)):
+          continue
+        p = np.exp(log_w - np.max(log_w))
+        n = np.random.choice(ntries, p=p/np.sum(p))
       else:
-        # Random translation
-        xn = xo + step
+        n = 0
+      xn = xns[n]
+
       if self.sampling_universe is None:
-        self.universe.setConfiguration(Configuration(self.universe,xn))
-        en = self.universe.energy()
+        en = energy(self.universe, xn)
       else:
         self.sampling_universe.configuration().array[-natoms:,:] = xn
         en = self.sampling_universe.energy() # <- Using sampling Hamiltonian
-      if ((en<eo) or (np.random.random()<np.exp(-(en-eo)/RT))):
+      if np.isnan(en):
+        continue
+
+      log_acc = -(en-eo)/RT
+      if ntries>1:
+        # Reference set, drawn from the chosen candidate,
+        # includes the current configuration
+        (xrefs, comrefs) = self._propose(xn, coms[n], rotate, ntries-1)
+        log_w_ref = np.append(-self._screen(xrefs, screen)/RT, log_w_o)
+        log_w_ref[np.isnan(log_w_ref)] = -np.inf
+        log_acc += log_w_o - log_w[n] + \
+          log_sum_exp(log_w) - log_sum_exp(log_w_ref)
+      if (log_acc>0) or (np.random.random()<np.exp(log_acc)):
         acc += 1
         xo = xn
         eo = en
-        com += step
-      else:
-        self.universe.setConfiguration(Configuration(self.universe,xo))
+        com = coms[n]
+        if ntries>1:
+          log_w_o = log_w[n]
 
-    return ([np.copy(xo)], [en], acc, ntrials, 0.0)
+    set_coordinates(self.universe, xo)
+    return ([np.copy(xo)], [eo], acc, ntrials, 0.0)
@@ -0,0 +1,331 @@
+# This module implements a Hamiltonian Monte Carlo "integrator"
+# The velocity verlet trajectories, velocity assignment,
+# and Metropolis acceptance criterion are all in Cython.
+# It requires the option 'T' in addition to velocity verlet options.
+#
+
+import numpy as np
+cimport numpy as np
+import cython
+
+from libc.math cimport exp, fabs
+
+cimport MMTK_trajectory_generator
+from MMTK import Units
+from MMTK import Features
+
+import MMTK_trajectory
+import MMTK_forcefield
+
+cdef extern from "stdlib.h":
+
+    ctypedef long size_t
+    cdef void *malloc(size_t size)
+    cdef void free(void *ptr)
+
+from MMTK.ParticleProperties import Configuration, ParticleVector
+
+include "MMTK/python.pxi"
+include "MMTK/numeric.pxi"
+include "MMTK/core.pxi"
+include "MMTK/universe.pxi"
+include "MMTK/trajectory.pxi"
+include "MMTK/forcefield.pxi"
+
+R = 8.3144621*Units.J/Units.mol/Units.K
+
+#
+# Hamiltonian Monte Carlo integrator
+#
+cdef class HamiltonianMonteCarloIntegrator(\
+    MMTK_trajectory_generator.EnergyBasedTrajectoryGenerator):
+
+  """
+  Hamiltonian Monte Carlo integrator
+  The integration is started by calling the integrator object.
+  All the keyword options (see documnentation of __init__) can be
+  specified either when creating the integrator or when calling it.
+  The following data categories and variables are available for
+  output:
+   - category "time": time
+   - category "configuration": configuration and box size (for
+     periodic universes)
+   - category "velocities": atomic velocities
+   - category "gradients": energy gradients for each atom
+   - category "energy": potential and kinetic energy
+  """
+
+  cdef np.ndarray x, v, g
+  cdef energy_data energy
+
+  def __init__(self, universe, **options):
+    """
+    @param universe: the universe on which the integrator acts
+    @type universe: L{MMTK.Universe}
+    @keyword steps: the number of integration steps (default is 100)
+    @type steps: C{int}
+    @keyword steps_per_trial: the number of integration steps
+                              in each trial (default is steps)
+    @type steps_per_trial: C{int}
+    @keyword delta_t: the time step (default is 1 fs)
+    @type delta_t: C{double}
+    @keyword T: the temperature
+    @type T: C{double}
+    @keyword normalize: if True, the position and orientation of the
+                        final configuration are normalized (default: False)
+    @type normalize: C{bool}
+    @keyword random_seed: the seed for the random number generator
+    @type random_seed: C{int}
+    @keyword actions: a list of actions to be executed periodically
+                      (default is none)
+    @type actions: C{list}
+    @keyword threads: the number of threads to use in energy evaluation
+                      (default set by MMTK_ENERGY_THREADS)
+    @type threads: C{int}
+    @keyword background: if True, the integration is executed as a
+                         separate thread (default: False)
+    @type background: C{bool}
+    """
+    MMTK_trajectory_generator.EnergyBasedTrajectoryGenerator.__init__(
+        self, universe, options, "Hamiltonian Monte Carlo integrator")
+    # Supported features: none for the moment, to keep it simple
+    self.features = []
+
+  default_options = {'first_step': 0, 'steps': 100, 'delta_t': 1.*Units.fs,
+                     'background': False, 'threads': None,
+                     'actions': []}
+
+  available_data = ['configuration', 'velocities', 'gradients',
+                    'energy', 'time']
+
+  restart_data = ['configuration', 'velocities', 'energy']
+
+  def __call__(self, **options):
+    self.setCallOptions(options)
+#    try:
+#        self.actions = self.getOption('actions')
+#    except ValueError:
+    self.actions = []
+    try:
+        if self.getOption('background'):
+            import MMTK_state_accessor
+            self.state_accessor = MMTK_state_accessor.StateAccessor()
+            self.actions.append(self.state_accessor)
+    except ValueError:
+        pass
+    Features.checkFeatures(self, self.universe)
+    if self.tvars != NULL:
+        free(self.tvars)
+        self.tvars = NULL
+#    configuration = self.universe.configuration()
+#    self.conf_array = configuration.array
+#    self.declareTrajectoryVariable_array(self.conf_array,
+#                                         "configuration",
+#                                         "Configuration:\n",
+#                                         length_unit_name,
+#                                         PyTrajectory_Configuration)
+    self.universe_spec = <PyUniverseSpecObject *>self.universe._spec
+    if self.universe_spec.geometry_data_length > 0:
+        self.declareTrajectoryVariable_box(
+            self.universe_spec.geometry_data,
+            self.universe_spec.geometry_data_length)
+#    masses = self.universe.masses()
+#    self.declareTrajectoryVariable_array(masses.array,
+#                                         "masses",
+#                                         "Masses:\n",
+#                                         mass_unit_name,
+#                                         PyTrajectory_Internal)
+#    self.natoms = self.universe.numberOfAtoms()
+    self.df = self.universe.degreesOfFreedom()
+    self.declareTrajectoryVariable_int(&self.df,
+                                       "degrees_of_freedom",
+                                       "Degrees of freedom: %d\n",
+                                       "", PyTrajectory_Internal)
+    if self.getOption('background'):
+        from MMTK import ThreadManager
+        return ThreadManager.TrajectoryGeneratorThread(
+            self.universe, self.start_py, (), self.state_accessor)
+    else:
+        # This is the main change from the original __call__ function
+        # in MMTK_trajectory_generator.pyx
+        return self.start()
+
+  # Cython compiler directives set for efficiency:
+  # - No bound checks on index operations
+  # - No support for negative indices
+  # - Division uses C semantics
+  @cython.boundscheck(False)
+  @cython.wraparound(False)
+  @cython.cdivision(True)
+  cdef start(self):
+
+    cdef double time, delta_t, ke, RT
+    cdef double pe_o, pe_n, eo, en
+    cdef int natoms, ntrials, steps_per_trial, t, step, a, d, acc
+
+    cdef double[:,::1] x, v, g, xo, go
+    cdef double[:,:,::1] z
+    cdef double[::1] u, inv_m, sigma
+    cdef np.uint8_t[::1] moving
+
+    # Gather state variables and parameters
+    configuration = self.universe.configuration()
+    gradients = ParticleVector(self.universe)
+    masses = self.universe.masses()
+    fixed = self.universe.getAtomBooleanArray('fixed')
+    delta_t = self.getOption('delta_t')
+    natoms = self.universe.numberOfAtoms()
+
+    RT = R*self.getOption('T')
+
+    if 'steps_per_trial' in self.call_options.keys():
+      steps_per_trial = self.getOption('steps_per_trial')
+      ntrials = self.getOption('steps')/steps_per_trial
+    else:
+      steps_per_trial = self.getOption('steps')
+      ntrials = 1
+
+    if 'normalize' in self.call_options.keys():
+      normalize = self.getOption('normalize')
+    else:
+      normalize = False
+
+    # Seed the random number generator
+    if 'random_seed' in self.call_options.keys():
+      np.random.seed(self.getOption('random_seed'))
+
+    # For efficiency, the Cython code works at the array
+    # level rather than at the ParticleProperty level.
+    # The arrays are allocated once and updated in place.
+    self.x = np.ascontiguousarray(configuration.array, dtype=float)
+    self.v = np.zeros((natoms,3))
+    self.g = np.ascontiguousarray(gradients.array, dtype=float)
+    x = self.x
+    v = self.v
+    g = self.g
+    xo = np.copy(self.x)
+    go = np.zeros((natoms,3))
+    inv_m = 1./np.array(masses.array, dtype=float)
+    # Fixed atoms are not moved
+    moving = np.array(np.logical_not(fixed.array), dtype=np.uint8)
+    # Standard deviation of the Maxwell-Boltzmann distribution
+    sigma = np.sqrt((self.getOption('T')*Units.k_B)*np.asarray(inv_m))
+
+    # All the random numbers are drawn at once
+    z = np.random.randn(ntrials, natoms, 3)
+    u = np.random.random(ntrials)
+
+    # Ask for energy gradients to be calculated and stored in
+    # the array g. Force constants are not requested.
+    self.energy.gradients = <void *>self.g
+    self.energy.gradient_fn = NULL
+    self.energy.force_constants = NULL
+    self.energy.fc_fn = NULL
+
+    # Declare the variables accessible to trajectory actions.
+    self.declareTrajectoryVariable_double(
+        &time, "time", "Time: %lf\n", time_unit_name, PyTrajectory_Time)
+    self.declareTrajectoryVariable_array(
+        self.v, "velocities", "Velocities:\n", velocity_unit_name,
+        PyTrajectory_Velocities)
+    self.declareTrajectoryVariable_array(
+        self.g, "gradients", "Energy gradients:\n", energy_gradient_unit_name,
+        PyTrajectory_Gradients)
+    self.declareTrajectoryVariable_double(
+        &self.energy.energy,"potential_energy", "Potential energy: %lf\n",
+        energy_unit_name, PyTrajectory_Energy)
+    self.declareTrajectoryVariable_double(
+        &ke, "kinetic_energy", "Kinetic energy: %lf\n",
+        energy_unit_name, PyTrajectory_Energy)
+    self.initializeTrajectoryActions()
+
+    # Acquire the write lock of the universe. This is necessary to
+    # make sure that the integrator's modifications to positions
+    # and velocities are synchronized with other threads that
+    # attempt to use or modify these same values.
+    #
+    # Note that the write lock will be released temporarily
+    # for trajectory actions. It will also be converted to
+    # a read lock temporarily for energy evaluation. This
+    # is taken care of automatically by the respective methods
+    # of class EnergyBasedTrajectoryGenerator.
+    self.acquireWriteLock()
+
+    # Store initial configuration, gradients, and potential energy.
+    # The gradients are kept with the configuration so that
+    # they do not need to be recalculated at the start of each trial.
+    self.calculateEnergies(self.x, &self.energy, 0)
+    pe_o = self.energy.energy
+    go[:,:] = g
+
+    xs = []
+    energies = []
+
+    acc = 0
+    time = 0.
+    for t in range(ntrials):
+      # Initialize the velocity
+      ke = 0.
+      for a in range(natoms):
+        for d in range(3):
+          v[a,d] = sigma[a]*z[t,a,d]*moving[a]
+          ke += v[a,d]*v[a,d]/inv_m[a]
+      ke = 0.5*ke
+
+      # Store total energy
+      eo = pe_o + ke
+
+      # Velocity verlet integration
+      for step in range(steps_per_trial):
+        for a in range(natoms):
+          if moving[a]:
+            for d in range(3):
+              v[a,d] -= 0.5*delta_t*g[a,d]*inv_m[a]
+              x[a,d] += delta_t*v[a,d]
+        self.foldCoordinatesIntoBox()
+        self.calculateEnergies(self.x, &self.energy, 1)
+        for a in range(natoms):
+          if moving[a]:
+            for d in range(3):
+              v[a,d] -= 0.5*delta_t*g[a,d]*inv_m[a]
+        time += delta_t
+
+      # Decide whether to accept the move
+      pe_n = self.energy.energy
+      ke = 0.
+      for a in range(natoms):
+        for d in range(3):
+          ke += v[a,d]*v[a,d]/inv_m[a]
+      ke = 0.5*ke
+      en = pe_n + ke
+
+      if ((en<eo) or (u[t]<exp(-(en-eo)/RT))) and \
+         ((fabs(pe_o-pe_n)/RT<250.) or (fabs(eo-en)/RT<250.)):
+        xo[:,:] = x
+        go[:,:] = g
+        pe_o = pe_n
+        acc += 1
+      else:
+        x[:,:] = xo
+        g[:,:] = go
+
+      xs.append(np.copy(self.x))
+      energies.append(pe_o)
+      self.trajectoryActions(t)
+
+    self.universe.setConfiguration(Configuration(self.universe, \
+      np.copy(self.x)), block=False)
+    if normalize:
+      # The energy is independent of the position and orientation
+      # of the system, so only the final configuration is normalized
+      self.universe.normalizePosition()
+      if ntrials > 0:
+        xs[-1] = np.copy(self.universe.configuration().array)
+
+    # Release the write lock.
+    self.releaseWriteLock()
+
+    # Finalize all trajectory actions (close files etc.)
+    self.finalizeTrajectoryActions(ntrials)
+
+    return (xs, energies, acc, ntrials, delta_t)
@@ -0,0 +1,164 @@
+# This module implements a multiple chain Hamiltonian Monte Carlo "integrator"
+# Several chains, each with its own thermodynamic state, are advanced
+# in lockstep within a single universe.
+# Coordinates, velocities, and gradients are stored in (K, natoms, 3) arrays,
+# so that the leapfrog updates and Metropolis tests are vectorized over chains.
+# Energies and gradients are evaluated by switching the coordinates and
+# energy evaluator of the universe, which shares the force fields
+# (including grids) between chains.
+# Each chain has its own temperature, time step, and steps per trial.
+
+from MMTK import Units
+from MMTK.ParticleProperties import ParticleVector
+
+import numpy as np
+
+R = 8.3144621*Units.J/Units.mol/Units.K
+
+#
+# Multiple chain Hamiltonian Monte Carlo integrator
+#
+class MultiChainHMCIntegrator:
+
+    def __init__(self, universe):
+        self.universe = universe
+
+    def _energiesAndGradients(self, X, evaluators, G):
+        # Evaluates the energy and gradients of each chain,
+        # storing the gradients in G
+        x = self.universe.configuration().array
+        E = np.zeros(len(X))
+        for k in range(len(X)):
+          x[:] = X[k]
+          E[k] = evaluators[k](gradients=self._g)[0]
+          G[k] = self._g.array
+        return E
+
+    def __call__(self, confs, evaluators, T, delta_t, steps, \
+        steps_per_trial=None, normalize=False, random_seed=None):
+        """
+        Advances K chains
+
+        Parameters
+        ----------
+        confs : list of np.array
+          The starting configuration of each chain
+        evaluators : list of MMTK.ForceField.EnergyEvaluator
+          The energy evaluator of each chain
+        T : list of float
+          The temperature of each chain
+        delta_t : list of float
+          The time step of each chain
+        steps : int
+          The number of leapfrog steps, which is the same for every chain
+        steps_per_trial : list of int
+          The number of leapfrog steps between Metropolis tests for each chain.
+          Steps after the last complete trial are discarded.
+        normalize : bool
+          Whether to normalize the position and orientation of final configurations
+        random_seed : int
+          Seed for the random number generator
+
+        Returns
+        -------
+        xs : list of np.array
+          The final configuration of each chain
+        energies : np.array
+          The final potential energy of each chain
+        acc : np.array
+          The number of accepted trials in each chain
+        ntrials : np.array
+          The number of trials in each chain
+        delta_t : np.array
+          The time step of each chain
+        """
+        K = len(confs)
+        T = np.array(T, dtype=float)
+        RT = R*T
+        delta_t = np.array(delta_t, dtype=float)
+        dt = delta_t[:,np.newaxis,np.newaxis]
+        if steps_per_trial is None:
+          steps_per_trial = np.ones(K, dtype=int)*steps
+        else:
+          steps_per_trial = np.array(steps_per_trial, dtype=int)
+
+        if random_seed is not None:
+          np.random.seed(random_seed)
+
+        # Get the universe variables needed by the integrator
+        masses = self.universe.masses()
+        moving = np.logical_not(\
+          self.universe.getAtomBooleanArray('fixed').array)
+        natoms = self.universe.numberOfAtoms()
+
+        # Inverse masses, which are zero for fixed atoms
+        inv_m3 = np.repeat(np.expand_dims(moving/masses.array,1),3,axis=1)
+        m3 = np.repeat(np.expand_dims(masses.array,1),3,axis=1)
+        # Velocity scale for each chain
+        sigma_MB = np.sqrt((T*Units.k_B)[:,np.newaxis,np.newaxis]*inv_m3)
+
+        def kinetic(V):
+          return 0.5*np.sum(np.sum(m3*np.square(V),2),1)
+
+        # Store initial configurations, potential energies, and gradients
+        self._g = ParticleVector(self.universe)
+        X = np.array(confs, dtype=float)
+        G = np.zeros((K,natoms,3))
+        pe = self._energiesAndGradients(X, evaluators, G)
+        Xo = np.copy(X)
+        Go = np.copy(G)
+        pe_o = np.copy(pe)
+
+        # Initialize the velocities and store total energies
+        V = sigma_MB*np.random.randn(K,natoms,3)
+        eo = pe_o + kinetic(V)
+
+        acc = np.zeros(K, dtype=int)
+        ntrials = np.zeros(K, dtype=int)
+        step_in_trial = np.zeros(K, dtype=int)
+        for step in range(steps):
+          # Run the leapfrog integrator for all chains
+          V -= 0.5*dt*G*inv_m3
+          X += dt*V
+          pe = self._energiesAndGradients(X, evaluators, G)
+          V -= 0.5*dt*G*inv_m3
+          step_in_trial += 1
+
+          # Decide whether to accept the moves of chains that completed a trial
+          done = np.nonzero(step_in_trial==steps_per_trial)[0]
+          if len(done)==0:
+            continue
+          en = pe[done] + kinetic(V[done])
+          with np.errstate(over='ignore', invalid='ignore'):
+            accept = np.logical_not(np.isnan(en)) & \
+              ((en<eo[done]) | \
+               (np.random.random(len(done))<np.exp(-(en-eo[done])/RT[done]))) & \
+              ((np.abs(pe_o[done]-pe[done])/RT[done]<250.) | \
+               (np.abs(eo[done]-en)/RT[done]<250.))
+          a = done[accept]
+          r = done[np.logical_not(accept)]
+          Xo[a] = X[a]
+          Go[a] = G[a]
+          pe_o[a] = pe[a]
+          X[r] = Xo[r]
+          G[r] = Go[r]
+          pe[r] = pe_o[r]
+          acc[a] += 1
+          ntrials[done] += 1
+          step_in_trial[done] = 0
+
+          # Start new trials
+          V[done] = sigma_MB[done]*np.random.randn(len(done),natoms,3)
+          eo[done] = pe_o[done] + kinetic(V[done])
+
+        xs = [np.copy(Xo[k]) for k in range(K)]
+
+        # Normalizing changes the gradients, so it is only done at the end
+        if normalize:
+          x = self.universe.configuration().array
+          for k in range(K):
+            x[:] = xs[k]
+            self.universe.normalizePosition()
+            xs[k] = np.copy(x)
+
+        return (xs, pe_o, acc, ntrials, delta_t)
@@ -7,6 +7,9 @@ import numpy as np
 cimport numpy as np
 import cython
 
+from libc.math cimport exp, fabs, log, log1p
+from libc.string cimport memcpy
+
 cimport MMTK_trajectory_generator
 from MMTK import Units
 from MMTK import Features
@@ -31,6 +34,69 @@ include "MMTK/forcefield.pxi"
 
 R = 8.3144621*Units.J/Units.mol/Units.K
 
+# Copies one (natoms,3) buffer into another
+cdef inline void copy_state(double[:,::1] dst, double[:,::1] src):
+  memcpy(&dst[0,0], &src[0,0], src.shape[0]*3*sizeof(double))
+
+# log(exp(a) + exp(b))
+cdef inline double log_add_exp(double a, double b):
+  if a > b:
+    return a + log1p(exp(b - a))
+  else:
+    return b + log1p(exp(a - b))
+
+# The generalized U-turn criterion for a trajectory with
+# velocities vminus and vplus at its ends and a sum of momenta rho.
+# With a general metric the velocity is the inverse metric times the momentum.
+# Returns True if the trajectory should continue.
+@cython.boundscheck(False)
+@cython.wraparound(False)
+cdef bint no_u_turn(double[:,::1] vminus, double[:,::1] vplus, \
+    double[:,::1] rho):
+  cdef int a, d
+  cdef double dot_minus = 0., dot_plus = 0.
+  for a in range(rho.shape[0]):
+    for d in range(3):
+      dot_minus += vminus[a,d]*rho[a,d]
+      dot_plus += vplus[a,d]*rho[a,d]
+  return (dot_minus>0) and (dot_plus>0)
+
+def estimate_inv_metric(samples, inv_metric, dense):
+  """Estimates an inverse metric from samples
+
+  The estimate is shrunk towards the current inverse metric.
+  It is rescaled so that the geometric mean of its diagonal is the same
+  as for the current inverse metric, which keeps the time step on the
+  same scale. The time step itself is not adjusted here.
+
+  Parameters
+  ----------
+  samples : list of np.array
+    Flattened configurations
+  inv_metric : np.array
+    The current inverse metric, (3*natoms,3*natoms) if dense
+    and (natoms,3) otherwise
+  dense : bool
+    Whether to estimate a dense inverse metric
+  """
+  samples = np.array(samples)
+  (n, dim) = samples.shape
+  if dense:
+    cov = np.cov(samples, rowvar=0)
+    var = np.diag(cov)
+    current_var = np.diag(inv_metric)
+    w = n/(n + 5. + dim)
+  else:
+    var = np.var(samples, axis=0, ddof=1)
+    current_var = np.ravel(inv_metric)
+    w = n/(n + 5.)
+  var = np.maximum(var, 1E-12)
+  scale = np.exp(np.mean(np.log(current_var)) - np.mean(np.log(var)))
+  if dense:
+    return w*scale*cov + (1-w)*inv_metric
+  else:
+    return w*scale*var + (1-w)*current_var
+
 #
 # NUTS integrator
 #
@@ -54,10 +120,27 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
      are used
   """
 
-  cdef np.ndarray x, v, g, m
+  cdef np.ndarray x, v, p, g, m
   cdef energy_data energy
   cdef double RT
 
+  # Typed views of x, v, p, and g
+  cdef double[:,::1] x_view, v_view, p_view, g_view
+  # The inverse metric, either diagonal with shape (natoms,3)
+  # or dense with shape (3*natoms,3*natoms)
+  cdef double[:,::1] inv_metric_view
+  cdef bint dense
+  # Sample and sum of momenta from the most recent subtree
+  cdef double[:,::1] x_sample, g_sample, rho
+  # Completed subtrees that are waiting for their sibling, by level.
+  # The velocity of the first state in the subtree
+  # (in the direction of integration) is needed for the U-turn criterion.
+  cdef double[:,:,::1] v_first, rho_level, x_level_sample, g_level_sample
+  cdef double[::1] e_level_sample, log_w_level, alpha_level
+  cdef int[::1] nalpha_level, pending
+  # Transformations of standard normal variates into velocities and momenta
+  cdef object sample_v, sample_p
+
   def __init__(self, universe, **options):
     """
     @param universe: the universe on which the integrator acts
@@ -75,6 +158,14 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
     @keyword background: if True, the integration is executed as a
                          separate thread (default: False)
     @type background: C{bool}
+    @keyword metric: 'mass' for atomic masses, 'diagonal', or 'dense'.
+                     Diagonal and dense metrics are adapted if adapt is True.
+                     (default: 'mass')
+    @type metric: C{str}
+    @keyword inv_metric: an inverse metric from a previous call
+                         (default: None, in which case the atomic masses
+                          are used)
+    @type inv_metric: C{numpy.ndarray}
     """
     MMTK_trajectory_generator.EnergyBasedTrajectoryGenerator.__init__(
         self, universe, options, "NUTS integrator")
@@ -150,15 +241,17 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
   cdef start(self):
 
     cdef double time, delta_t, ke
-    cdef int natoms, nsteps, elapsed_steps
+    cdef int natoms, nsteps, elapsed_steps, max_depth, a, d
 
-    cdef double joint, logu, e_m
-    cdef np.ndarray[double, ndim=2] xminus, xplus, vminus, vplus, x_m
-    cdef int j, n, steps_m
+    cdef double joint, e_m, e_minus, e_plus, eprime, log_w, log_w_sub
+    cdef double[:,::1] x_m, g_m, xminus, xplus, vminus, vplus, \
+      pminus, pplus, gminus, gplus, rho_tree
+    cdef int j, steps_m
+    cdef bint s, sprime
         
     # For dual averaging
     cdef double alpha, delta, gamma, kappa, mu, delta_t_bar, Hbar, eta
-    cdef int nalpha, t0, m
+    cdef int nalpha, t0, m, m_adapt
 
     # Initialize the velocity
     if self.universe.velocities() is None:
@@ -190,15 +283,23 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
     else:
       adapt = False
 
+    if 'metric' in self.call_options.keys():
+      metric = self.getOption('metric')
+    else:
+      metric = 'mass'
+    if not metric in ['mass', 'diagonal', 'dense']:
+      raise Exception('Unrecognized metric ' + metric)
+    self.dense = (metric == 'dense')
+
     # Parameters for the dual averaging algorithm.
+    gamma = 0.05
+    t0 = 10
+    kappa = 0.75
+    mu = np.log(10*delta_t)
+    Hbar = 0.
     if adapt:
-      gamma = 0.05
-      t0 = 10
-      kappa = 0.75
-      mu = np.log(10*delta_t)
       # Initialize dual averaging algorithm.
       delta_t_bar = 1.
-      Hbar = 0.
     else:
       delta_t_bar = delta_t
 
@@ -210,14 +311,71 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
 
     # For efficiency, the Cython code works at the array
     # level rather than at the ParticleProperty level.
-    self.x = configuration.array
-    self.v = velocities.array
-    self.g = gradients.array
+    # The arrays are allocated once and updated in place.
+    self.x = np.ascontiguousarray(configuration.array, dtype=float)
+    self.v = np.ascontiguousarray(velocities.array, dtype=float)
+    self.p = np.zeros((natoms,3))
+    self.g = np.ascontiguousarray(gradients.array, dtype=float)
     self.m = np.repeat(np.expand_dims(masses.array,1),3,axis=1)
+    self.x_view = self.x
+    self.v_view = self.v
+    self.p_view = self.p
+    self.g_view = self.g
+
+    # The inverse metric.
+    # The default is the inverse of the atomic masses.
+    inv_m = 1./self.m
+    inv_metric = None
+    if (metric != 'mass') and \
+        ('inv_metric' in self.call_options.keys()):
+      inv_metric = self.getOption('inv_metric')
+    if inv_metric is not None:
+      inv_metric = np.array(inv_metric, dtype=float)
+      if self.dense and (inv_metric.shape != (3*natoms,3*natoms)):
+        inv_metric = None
+      elif (not self.dense) and (inv_metric.size != 3*natoms):
+        inv_metric = None
+    if inv_metric is None:
+      inv_metric = np.diag(inv_m.ravel()) if self.dense else inv_m
+    self.set_inv_metric(inv_metric)
+
+    # Windows for metric adaptation, as fractions of the steps.
+    # The metric is estimated from samples in each slow window.
+    # As in Stan, slow windows double in length
+    # and are preceded and followed by fast windows
+    # in which only the time step is adapted.
+    adapt_metric = adapt and (metric != 'mass')
+    windows = [int(f*nsteps) for f in [0.15, 0.25, 0.45, 0.85]]
+    window = 0
+    window_samples = []
+
+    # Buffers for the tree.
+    # A trajectory with nsteps steps has a depth of at most log2(nsteps+2).
+    max_depth = int(np.log2(nsteps+2))+2
+    x_m = np.zeros((natoms,3))
+    g_m = np.zeros((natoms,3))
+    xminus = np.zeros((natoms,3))
+    xplus = np.zeros((natoms,3))
+    vminus = np.zeros((natoms,3))
+    vplus = np.zeros((natoms,3))
+    pminus = np.zeros((natoms,3))
+    pplus = np.zeros((natoms,3))
+    gminus = np.zeros((natoms,3))
+    gplus = np.zeros((natoms,3))
+    rho_tree = np.zeros((natoms,3))
+    self.x_sample = np.zeros((natoms,3))
+    self.g_sample = np.zeros((natoms,3))
+    self.rho = np.zeros((natoms,3))
+    self.v_first = np.zeros((max_depth,natoms,3))
+    self.rho_level = np.zeros((max_depth,natoms,3))
+    self.x_level_sample = np.zeros((max_depth,natoms,3))
+    self.g_level_sample = np.zeros((max_depth,natoms,3))
+    self.e_level_sample = np.zeros(max_depth)
+    self.log_w_level = np.zeros(max_depth)
+    self.alpha_level = np.zeros(max_depth)
+    self.nalpha_level = np.zeros(max_depth, dtype=np.intc)
+    self.pending = np.zeros(max_depth, dtype=np.intc)
 
-    # Weight matrix for velocity assignment
-    sigma_MB = np.sqrt((self.getOption('T')*Units.k_B)/self.m)
-    
     # Ask for energy gradients to be calculated and stored in
     # the array g. Force constants are not requested.
     self.energy.gradients = <void *>self.g
@@ -262,93 +420,140 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
     
     # Initialize the next sample.
     # If all else fails, the next sample is the previous sample.
-    x_m = np.copy(self.x)
+    # The gradient is kept with the sample so that
+    # the energy does not need to be recalculated.
+    copy_state(x_m, self.x_view)
+    copy_state(g_m, self.g_view)
     e_m = 1.*self.energy.energy
 
     # Main integration loop
     elapsed_steps = 0
     m = 1
+    m_adapt = 1
     while elapsed_steps < nsteps:
-      # Resample velocities
-      self.v = np.multiply(sigma_MB,np.random.randn(natoms,3))
-      ke = 0.5*np.sum(np.multiply(self.m,np.square(self.v)))
+      # Resample momenta, p ~ N(0, RT*M), and the velocities v = M^{-1} p
+      self.sample_momenta(np.random.randn(natoms,3))
+      ke = self.kinetic_energy()
 
-      # Joint log-probabiity of positions and velocities
+      # Joint log-probabiity of positions and momenta
       joint = -(e_m + ke)/self.RT
 
-      # Resample u ~ uniform([0, np.exp(joint)]).
-      # Equivalent to (log(u) - joint) ~ exponential(1).
-      logu = joint - np.random.exponential(1)
-      
       # Initialize tree.
-      xminus = np.copy(x_m)
-      xplus = np.copy(x_m)
-      vminus = np.copy(self.v)
-      vplus = np.copy(self.v)
+      copy_state(xminus, x_m)
+      copy_state(xplus, x_m)
+      copy_state(vminus, self.v_view)
+      copy_state(vplus, self.v_view)
+      copy_state(pminus, self.p_view)
+      copy_state(pplus, self.p_view)
+      copy_state(gminus, g_m)
+      copy_state(gplus, g_m)
+      copy_state(rho_tree, self.p_view)
+      e_minus = e_m
+      e_plus = e_m
 
       # Initial height j = 0.
       j = 0
-      # Initially the only valid point is the initial point.
-      n = 1
+      # Initially the only point is the initial point.
+      # Its weight is exp(joint - joint) = 1.
+      log_w = 0.
       # Initially there have been no integrator steps
       steps_m = 0
 
       # Main loop
       s = True
-      while (s==1):
-        # Double the size of the tree
+      while s:
+        if j >= max_depth:
+          raise Exception('NUTS tree exceeded the maximum depth')
+        # Double the size of the tree,
+        # starting from the state at the edge of the trajectory
         if np.random.rand()<0.5:
           # Backwards
-          self.x = xminus
-          self.v = vminus
-          self.calculateEnergies(self.x, &self.energy, 0)
-          (xminus, vminus, NA0, NA1, 
-           xprime, eprime, nprime, sprime, steps_m,
-           alpha, nalpha) = \
-            self.build_tree(logu, j, -1*delta_t, steps_m, joint)
+          copy_state(self.x_view, xminus)
+          copy_state(self.v_view, vminus)
+          copy_state(self.p_view, pminus)
+          copy_state(self.g_view, gminus)
+          self.energy.energy = e_minus
+          sprime = self.build_tree(j, -1*delta_t, joint, \
+            &steps_m, &eprime, &log_w_sub, &alpha, &nalpha)
+          copy_state(xminus, self.x_view)
+          copy_state(vminus, self.v_view)
+          copy_state(pminus, self.p_view)
+          copy_state(gminus, self.g_view)
+          e_minus = self.energy.energy
         else:
           # Forward
-          self.x = xplus
-          self.v = vplus
-          self.calculateEnergies(self.x, &self.energy, 0)
-          (NA0, NA1, xplus, vplus, 
-           xprime, eprime, nprime, sprime, steps_m,
-           alpha, nalpha) = \
-            self.build_tree(logu, j, delta_t, steps_m, joint)
-        # Use Metropolis-Hastings to decide whether or not to move to a
-        # point from the half-tree we just generated
-        if (sprime and (np.random.rand() < float(nprime)/n)):
-          x_m = xprime
-          e_m = eprime
-        # Update number of valid points we've seen.
-        n += nprime
+          copy_state(self.x_view, xplus)
+          copy_state(self.v_view, vplus)
+          copy_state(self.p_view, pplus)
+          copy_state(self.g_view, gplus)
+          self.energy.energy = e_plus
+          sprime = self.build_tree(j, delta_t, joint, \
+            &steps_m, &eprime, &log_w_sub, &alpha, &nalpha)
+          copy_state(xplus, self.x_view)
+          copy_state(vplus, self.v_view)
+          copy_state(pplus, self.p_view)
+          copy_state(gplus, self.g_view)
+          e_plus = self.energy.energy
         # Increment depth
         j += 1
+        if not sprime:
+          # The new subtree diverged or made a U-turn,
+          # so none of its points are used
+          break
+        # Biased progressive sampling, which favors the new subtree
+        if (log_w_sub > log_w) or \
+           (np.random.rand() < exp(log_w_sub - log_w)):
+          copy_state(x_m, self.x_sample)
+          copy_state(g_m, self.g_sample)
+          e_m = eprime
+        log_w = log_add_exp(log_w, log_w_sub)
+        # Update the sum of momenta over the trajectory
+        for a in range(natoms):
+          for d in range(3):
+            rho_tree[a,d] += self.rho[a,d]
         # Decide if it's time to stop
-        s = sprime and \
-            self.stop_criterion(xminus, xplus, vminus, vplus) and \
+        s = no_u_turn(vminus, vplus, rho_tree) and \
             ((elapsed_steps + steps_m*2) < nsteps)
 
       # Keep track of acceptance statistics
-      eta = 1./(m+t0)
+      eta = 1./(m_adapt+t0)
       Hbar = (1-eta)*Hbar + eta*(delta-alpha/nalpha)
 
       # Adapt the time step
       if adapt:
-        delta_t = np.exp(mu - np.sqrt(m)/gamma*Hbar)
-        eta = m**-kappa
+        delta_t = np.exp(mu - np.sqrt(m_adapt)/gamma*Hbar)
+        eta = m_adapt**-kappa
         delta_t_bar = np.exp((1-eta)*np.log(delta_t_bar) + eta*np.log(delta_t))
 
-      xs.append(np.copy(x_m))
+      xs.append(np.array(x_m))
       energies.append(1.*e_m)
             
       time += steps_m*delta_t
       self.trajectoryActions(m)
       
       m += 1
+      m_adapt += 1
       elapsed_steps += steps_m
+
+      # Adapt the metric
+      if adapt_metric and (window < len(windows)-1):
+        if elapsed_steps > windows[window]:
+          window_samples.append(np.array(x_m).ravel())
+        if elapsed_steps >= windows[window+1]:
+          if len(window_samples) > 4:
+            inv_metric = estimate_inv_metric(window_samples, \
+              inv_metric, self.dense)
+            self.set_inv_metric(inv_metric)
+            # Restart time step adaptation with the new metric
+            mu = np.log(10*delta_t)
+            Hbar = 0.
+            delta_t_bar = 1.
+            m_adapt = 1
+          window_samples = []
+          window += 1
     
-    self.universe.setConfiguration(Configuration(self.universe, x_m), block=False)
+    self.universe.setConfiguration(Configuration(self.universe, \
+      np.array(x_m)), block=False)
     if normalize:
       self.universe.normalizePosition()
 
@@ -358,9 +563,77 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
     # Finalize all trajectory actions (close files etc.)
     self.finalizeTrajectoryActions(nsteps)
     
-    return (xs, energies, Hbar*nsteps, nsteps, delta_t_bar)
+    return (xs, energies, Hbar*nsteps, nsteps, delta_t_bar, \
+      np.array(inv_metric))
+
+  def set_inv_metric(NUTSIntegrator self, inv_metric):
+    if self.dense:
+      self.inv_metric_view = np.ascontiguousarray(inv_metric, dtype=float)
+      # With the Cholesky decomposition inv_metric = L L^T,
+      # v = sqrt(RT) L z and p = sqrt(RT) L^{-T} z for z ~ N(0, I)
+      L = np.linalg.cholesky(inv_metric)
+      self.sample_v = L
+      self.sample_p = np.linalg.inv(L).T
+    else:
+      self.inv_metric_view = np.ascontiguousarray(\
+        np.reshape(inv_metric, (-1,3)), dtype=float)
+      self.sample_v = np.sqrt(np.asarray(self.inv_metric_view))
+      self.sample_p = 1./self.sample_v
+
+  def sample_momenta(NUTSIntegrator self, z):
+    sigma = np.sqrt(self.RT)
+    if self.dense:
+      self.v[:] = np.reshape(sigma*np.dot(self.sample_v, np.ravel(z)), (-1,3))
+      self.p[:] = np.reshape(sigma*np.dot(self.sample_p, np.ravel(z)), (-1,3))
+    else:
+      self.v[:] = sigma*self.sample_v*z
+      self.p[:] = sigma*self.sample_p*z
+
+  # Sets the velocities from the momenta, v = M^{-1} p
+  @cython.boundscheck(False)
+  @cython.wraparound(False)
+  cdef void update_velocities(NUTSIntegrator self):
+    cdef int natoms = self.x_view.shape[0]
+    cdef int a, d, b
+    cdef double* p = &self.p_view[0,0]
+    cdef double* v = &self.v_view[0,0]
+    cdef double* row
+    cdef double sum
+    if self.dense:
+      for a in range(3*natoms):
+        row = &self.inv_metric_view[a,0]
+        sum = 0.
+        for b in range(3*natoms):
+          sum += row[b]*p[b]
+        v[a] = sum
+    else:
+      for a in range(natoms):
+        for d in range(3):
+          self.v_view[a,d] = self.inv_metric_view[a,d]*self.p_view[a,d]
 
-  # The main recursion
+  # The kinetic energy, p^T M^{-1} p / 2
+  @cython.boundscheck(False)
+  @cython.wraparound(False)
+  cdef double kinetic_energy(NUTSIntegrator self):
+    cdef int a, d
+    cdef double ke = 0.
+    for a in range(self.x_view.shape[0]):
+      for d in range(3):
+        ke += self.p_view[a,d]*self.v_view[a,d]
+    return 0.5*ke
+
+  # Builds a subtree with 2**j leapfrog steps from the current state.
+  #
+  # The subtree is built iteratively, one leaf at a time. A subtree that
+  # is complete but whose sibling is not is kept in the buffers for its
+  # level. When its sibling is complete, the two are merged and a sample
+  # is chosen in proportion to the total weight of each. If a subtree
+  # diverges or makes a U-turn, the remaining siblings are not built.
+  #
+  # On return, the current state (x, v, p, g, and energy) is the last state
+  # in the subtree, the sample is in x_sample and g_sample, the sum of
+  # momenta is in rho, log_w is the log of the total weight relative to
+  # exp(joint_o), and the return value is whether the subtree is valid.
   # Cython compiler directives set for efficiency:
   # - No bound checks on index operations
   # - No support for negative indices
@@ -368,79 +641,96 @@ cdef class NUTSIntegrator(MMTK_trajectory_generator.EnergyBasedTrajectoryGenerat
   @cython.boundscheck(False)
   @cython.wraparound(False)
   @cython.cdivision(True)
-  cdef build_tree(NUTSIntegrator self, double logu, int j, double delta_t, int steps, double joint_o):
-    cdef double ke, joint, e_o, eprime, eprime2
-    cdef np.ndarray[double, ndim=2] xminus, xplus, vminus, vplus, xprime, xprime2, NA0, NA1
-    
-    cdef double alphaprime, alphaprime2
-    cdef int nalphaprime, nalphaprime2
-
-    if (j==0):
-      # Base case: Take a single leapfrog step
+  cdef bint build_tree(NUTSIntegrator self, int j, double delta_t, \
+      double joint_o, int* steps, double* eprime, double* log_w, \
+      double* alphaprime, int* nalphaprime):
+    cdef int natoms = self.x_view.shape[0]
+    cdef int leaf, nleaves, npending, level, first, l, a, d
+    cdef double ke, joint, e_o, log_w_merged
+    cdef bint sprime
+
+    nleaves = 1 << j
+    npending = 0
+    for leaf in range(nleaves):
+      # Take a single leapfrog step
       # First half-step
-      e_o = 1.*self.energy.energy      
-      self.v += -0.5*delta_t*np.divide(self.g,self.m)
-      self.x += delta_t*self.v      
+      e_o = self.energy.energy
+      for a in range(natoms):
+        for d in range(3):
+          self.p_view[a,d] += -0.5*delta_t*self.g_view[a,d]
+      self.update_velocities()
+      for a in range(natoms):
+        for d in range(3):
+          self.x_view[a,d] += delta_t*self.v_view[a,d]
       # Mid-step energy calculation
       self.foldCoordinatesIntoBox()
       self.calculateEnergies(self.x, &self.energy, 1)
       # Second half-step
-      self.v += -0.5*delta_t*np.divide(self.g,self.m)
-      ke = 0.5*np.sum(np.multiply(self.m,np.square(self.v)))
-      steps += 1
-
-      eprime = 1.*self.energy.energy
-      joint = -(eprime+ke)/self.RT
-      # Is the new point in the slice?
-      nprime = (logu < joint)
+      for a in range(natoms):
+        for d in range(3):
+          self.p_view[a,d] += -0.5*delta_t*self.g_view[a,d]
+      self.update_velocities()
+      ke = self.kinetic_energy()
+      steps[0] += 1
+
+      eprime[0] = self.energy.energy
+      joint = -(eprime[0]+ke)/self.RT
+      # The weight of the point
+      log_w[0] = joint - joint_o
       # Is the simulation wildly inaccurate
-      sprime = (np.abs(joint_o - joint) < 200.) and (np.abs((e_o - eprime)/self.RT) < 200.)
+      sprime = (fabs(joint_o - joint) < 200.) and \
+               (fabs((e_o - eprime[0])/self.RT) < 200.)
       # Compute the acceptance probability
-      alphaprime = min(1, np.exp(joint - joint_o)) if sprime else 0.
-      # Set the return values---minus=plus for all things here, since the
-      # "tree" is of depth 0.
-      return (np.copy(self.x), np.copy(self.v),
-              np.copy(self.x), np.copy(self.v), 
-              np.copy(self.x),
-              eprime, nprime, sprime, steps,
-              alphaprime, 1)
-    else:
-      (xminus, vminus, xplus, vplus, 
-       xprime, eprime, nprime, sprime, steps,
-       alphaprime, nalphaprime) = \
-        self.build_tree(logu, j-1, delta_t, steps, joint_o)
-      # No need to keep going if the stopping criteria were met in the first
-      # subtree.
-      if sprime:
-        if (delta_t < 0):
-          (xminus, vminus, NA0, NA1, 
-           xprime2, eprime2, nprime2, sprime2, steps,
-           alphaprime2, nalphaprime2) = \
-              self.build_tree(logu, j-1, delta_t, steps, joint_o)
-        else:
-          (NA0, NA1, xplus, vplus, 
-           xprime2, eprime2, nprime2, sprime2, steps,
-           alphaprime2, nalphaprime2) = \
-              self.build_tree(logu, j-1, delta_t, steps, joint_o)
-        # Choose which subtree to propagate a sample up from.
-        if ((nprime + nprime2) > 0) and \
-           (np.random.rand() < float(nprime2) / (nprime + nprime2)):
-            xprime = xprime2
-            eprime = eprime2
-        # Update the number of valid points.
-        nprime = nprime + nprime2
-        # Update the stopping criterion.
-        sprime = sprime and sprime2 and \
-          self.stop_criterion(xminus, xplus, vminus, vplus)
+      alphaprime[0] = min(1., exp(joint - joint_o)) if sprime else 0.
+      nalphaprime[0] = 1
+      copy_state(self.x_sample, self.x_view)
+      copy_state(self.g_sample, self.g_view)
+      copy_state(self.rho, self.p_view)
+
+      # Merge with completed subtrees at the same level.
+      # If the subtree failed, the pending subtrees only contribute
+      # to the acceptance statistics, as their siblings will not be built.
+      level = 0
+      first = -1 # The first state of a leaf is the current state
+      while (npending > 0) and \
+            ((self.pending[npending-1]==level) or (not sprime)):
+        npending -= 1
+        l = self.pending[npending]
         # Update the acceptance probability statistics
-        alphaprime = alphaprime + alphaprime2
-        nalphaprime = nalphaprime + nalphaprime2
-      return (xminus, vminus, xplus, vplus, xprime,
-              eprime, nprime, sprime, steps,
-              alphaprime, nalphaprime)
-
-  def stop_criterion(NUTSIntegrator self, xminus, xplus, vminus, vplus):
-    cdef np.ndarray[double] thetavec
-    thetavec = np.ravel(xplus-xminus)
-    return (np.dot(thetavec,np.ravel(vminus))>0) and \
-           (np.dot(thetavec,np.ravel(vplus))>0)
\ No newline at end of file
+        alphaprime[0] += self.alpha_level[l]
+        nalphaprime[0] += self.nalpha_level[l]
+        if not sprime:
+          continue
+        # Choose a sample in proportion to the weight of each subtree
+        log_w_merged = log_add_exp(self.log_w_level[l], log_w[0])
+        if np.random.rand() >= exp(log_w[0] - log_w_merged):
+          copy_state(self.x_sample, self.x_level_sample[l])
+          copy_state(self.g_sample, self.g_level_sample[l])
+          eprime[0] = self.e_level_sample[l]
+        log_w[0] = log_w_merged
+        # Update the sum of momenta and the stopping criterion.
+        for a in range(natoms):
+          for d in range(3):
+            self.rho[a,d] += self.rho_level[l,a,d]
+        sprime = no_u_turn(self.v_first[l], self.v_view, self.rho)
+        first = l
+        level = l + 1
+
+      if (not sprime) or (level==j):
+        return sprime
+
+      # Keep the subtree until its sibling is complete
+      if first==-1:
+        copy_state(self.v_first[level], self.v_view)
+      else:
+        copy_state(self.v_first[level], self.v_first[first])
+      copy_state(self.rho_level[level], self.rho)
+      copy_state(self.x_level_sample[level], self.x_sample)
+      copy_state(self.g_level_sample[level], self.g_sample)
+      self.e_level_sample[level] = eprime[0]
+      self.log_w_level[level] = log_w[0]
+      self.alpha_level[level] = alphaprime[0]
+      self.nalpha_level[level] = nalphaprime[0]
+      self.pending[npending] = level
+      npending += 1
+    return sprime
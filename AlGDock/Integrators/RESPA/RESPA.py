@@ -0,0 +1,142 @@
+# This module implements a multiple time step Hamiltonian Monte Carlo "integrator"
+# It is based on the reversible reference system propagator algorithm (RESPA).
+# The force field is split into a fast group,
+# the intramolecular force field, which is integrated with inner time steps,
+# and a slow group, e.g. the binding site, grids, and OBC,
+# which is integrated with outer time steps of length delta_t.
+# Because RESPA is symplectic and time-reversible,
+# a Metropolis acceptance criterion on the total energy
+# leads to exact sampling.
+# It requires the options 'T' and 'evaluators' in addition to
+# velocity verlet options. 'evaluators' is a tuple of the fast and slow
+# energy evaluators, as returned by AlGDock.system.System.groupEvaluators.
+
+from MMTK import Dynamics, Features, Units
+from MMTK.ParticleProperties import ParticleVector
+
+import numpy as np
+
+R = 8.3144621*Units.J/Units.mol/Units.K
+
+def energyAndGradients(evaluator, g):
+  # Evaluates the energy of a group, storing the gradients in g
+  if evaluator is None:
+    g.array[:] = 0.
+    return 0.
+  return evaluator(gradients=g)[0]
+
+#
+# Multiple time step Hamiltonian Monte Carlo integrator
+#
+class RESPAIntegrator(Dynamics.Integrator):
+
+    def __init__(self, universe, **options):
+        Dynamics.Integrator.__init__(self, universe, options)
+        # Supported features: none for the moment, to keep it simple
+        self.features = []
+
+    def __call__(self, **options):
+        # Process the keyword arguments
+        self.setCallOptions(options)
+        # Check if the universe has features not supported by the integrator
+        Features.checkFeatures(self, self.universe)
+
+        RT = R*self.getOption('T')
+        delta_t = self.getOption('delta_t')
+        (fast, slow) = self.getOption('evaluators')
+
+        if 'inner_steps' in self.call_options.keys():
+          inner_steps = max(int(self.getOption('inner_steps')), 1)
+        else:
+          inner_steps = 4
+        delta_t_inner = delta_t/inner_steps
+
+        if 'steps_per_trial' in self.call_options.keys():
+          steps_per_trial = self.getOption('steps_per_trial')
+          ntrials = self.getOption('steps')/steps_per_trial
+        else:
+          steps_per_trial = self.getOption('steps')
+          ntrials = 1
+
+        if 'normalize' in self.call_options.keys():
+          normalize = self.getOption('normalize')
+        else:
+          normalize = False
+
+        # Seed the random number generator
+        if 'random_seed' in self.call_options.keys():
+          np.random.seed(self.getOption('random_seed'))
+
+        # Get the universe variables needed by the integrator
+        masses = self.universe.masses()
+        moving = np.logical_not(\
+          self.universe.getAtomBooleanArray('fixed').array)
+        natoms = self.universe.numberOfAtoms()
+
+        # Inverse masses, which are zero for fixed atoms
+        inv_m3 = np.repeat(np.expand_dims(\
+          moving/masses.array,1),3,axis=1)
+        m3 = np.repeat(np.expand_dims(masses.array,1),3,axis=1)
+        sigma_MB = np.sqrt((self.getOption('T')*Units.k_B)*inv_m3)
+
+        # The positions are updated in place
+        x = self.universe.configuration().array
+        g_fast = ParticleVector(self.universe)
+        g_slow = ParticleVector(self.universe)
+
+        xs = []
+        energies = []
+
+        # Store initial configuration, potential energy, and gradients
+        xo = np.copy(x)
+        e_fast = energyAndGradients(fast, g_fast)
+        e_slow = energyAndGradients(slow, g_slow)
+        pe_o = e_fast + e_slow
+        go_fast = np.copy(g_fast.array)
+        go_slow = np.copy(g_slow.array)
+
+        acc = 0
+        for t in range(ntrials):
+          # Initialize the velocity
+          v = np.multiply(sigma_MB,np.random.randn(natoms,3))
+
+          # Store total energy
+          eo = pe_o + 0.5*np.sum(np.multiply(m3,np.square(v)))
+
+          # Run the RESPA integrator
+          for step in range(steps_per_trial):
+            v -= (0.5*delta_t)*np.multiply(inv_m3,g_slow.array)
+            for inner_step in range(inner_steps):
+              v -= (0.5*delta_t_inner)*np.multiply(inv_m3,g_fast.array)
+              x += delta_t_inner*v
+              e_fast = energyAndGradients(fast, g_fast)
+              v -= (0.5*delta_t_inner)*np.multiply(inv_m3,g_fast.array)
+            e_slow = energyAndGradients(slow, g_slow)
+            v -= (0.5*delta_t)*np.multiply(inv_m3,g_slow.array)
+
+          # Decide whether to accept the move
+          pe_n = e_fast + e_slow
+          en = pe_n + 0.5*np.sum(np.multiply(m3,np.square(v)))
+
+          if (not np.isnan(en)) and \
+             ((en<eo) or (np.random.random()<np.exp(-(en-eo)/RT))) and \
+             ((abs(pe_o-pe_n)/RT<250.) or (abs(eo-en)/RT<250.)):
+            xo = np.copy(x)
+            pe_o = pe_n
+            go_fast = np.copy(g_fast.array)
+            go_slow = np.copy(g_slow.array)
+            acc += 1
+          else:
+            x[:] = xo
+            g_fast.array[:] = go_fast
+            g_slow.array[:] = go_slow
+
+          xs.append(np.copy(x))
+          energies.append(pe_o)
+
+        # Normalizing changes the gradients, so it is only done at the end
+        if normalize:
+          self.universe.normalizePosition()
+          xs[-1] = np.copy(self.universe.configuration().array)
+
+        return (xs, energies, acc, ntrials, delta_t)
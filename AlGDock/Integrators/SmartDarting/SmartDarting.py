@@ -1,12 +1,74 @@
 # This module implements a Smart Darting "integrator"
 
-from MMTK import Configuration, Dynamics, Environment, Features, Trajectory, Units
+from MMTK import Dynamics, Environment, Features, Trajectory, Units
 import MMTK_dynamics
 import numpy as np
 
+from AlGDock.coordinates import set_coordinates, energy
+
 R = 8.3144621*Units.J/Units.mol/Units.K
 twoPi = 2*np.pi
 
+# Minimum number of dart targets to search with a KD-tree
+KDTREE_MIN_TARGETS = 64
+
+#
+# Index of unique configurations
+#
+class UniqueIndex:
+  """
+  Incrementally builds a set of unique points.
+
+  A point is a duplicate if it is within threshold of a point in the set.
+  Without periodicity, the distance is Euclidean.
+  With periodicity, points are period fractions between 0 and 1 and
+  the distance is the largest wrapped difference in any dimension.
+
+  Most points are stored in a KD-tree.
+  Recently inserted points are compared by brute force.
+  The tree is rebuilt when the recent points outnumber
+  the square root of the points in the tree,
+  so each insertion costs less than linear time.
+  """
+  def __init__(self, threshold, periodic=False):
+    self.threshold = threshold
+    self.periodic = periodic
+    self._tree = None
+    self._tree_points = []
+    self._recent = []
+
+  def _is_duplicate(self, x):
+    if self._tree is not None:
+      if self.periodic:
+        neighbors = self._tree.query_ball_point(x, self.threshold, p=np.inf)
+      else:
+        neighbors = self._tree.query_ball_point(x, self.threshold)
+      if len(neighbors) > 0:
+        return True
+    if len(self._recent) > 0:
+      diffs = np.abs(np.array(self._recent) - x)
+      if self.periodic:
+        diffs = np.minimum(diffs, 1-diffs)
+        return (np.max(diffs,1) <= self.threshold).any()
+      else:
+        return (np.sum(np.square(diffs),1) <= self.threshold**2).any()
+    return False
+
+  def insert(self, x):
+    """
+    Adds x to the set if it is unique. Returns whether it was added.
+    """
+    if self._is_duplicate(x):
+      return False
+    self._recent.append(np.copy(x))
+    if len(self._recent) > max(32, np.sqrt(len(self._tree_points))):
+      from scipy.spatial import cKDTree
+      self._tree_points += self._recent
+      self._recent = []
+      self._tree = cKDTree(np.array(self._tree_points), \
+        boxsize=1. if self.periodic else None)
+    return True
+
 #
 # Smart Darting integrator
 #
@@ -47,11 +109,11 @@ class SmartDartingIntegrator(Dynamics.Integrator):
     start_time = time.time()
 
     nconfs_attempted = len(confs)
+    # Existing targets have already been minimized
     if append and (self.confs is not None):
-      nconfs_o = len(self.confs)
-      confs = confs + self.confs
+      confs_o = self.confs
     else:
-      nconfs_o = 0
+      confs_o = []
 
     # Minimize configurations
     from MMTK.Minimization import SteepestDescentMinimizer # @UnresolvedImport
@@ -60,16 +122,15 @@ class SmartDartingIntegrator(Dynamics.Integrator):
     minimized_confs = []
     minimized_energies = []
     for conf in confs:
-      self.universe.setConfiguration(Configuration(self.universe, conf))
-      x_o = np.copy(self.universe.configuration().array)
-      e_o = self.universe.energy()
+      x_o = np.copy(conf)
+      e_o = energy(self.universe, x_o)
       for rep in range(50):
         minimizer(steps = 25)
         x_n = np.copy(self.universe.configuration().array)
         e_n = self.universe.energy()
         diff = abs(e_o-e_n)
         if np.isnan(e_n) or diff<0.05 or diff>1000.:
-          self.universe.setConfiguration(Configuration(self.universe, x_o))
+          set_coordinates(self.universe, x_o)
           break
         else:
           x_o = x_n
@@ -77,6 +138,11 @@ class SmartDartingIntegrator(Dynamics.Integrator):
       if not np.isnan(e_o):
         minimized_confs.append(x_o)
         minimized_energies.append(e_o)
+    for conf in confs_o:
+      e_o = energy(self.universe, conf)
+      if not np.isnan(e_o):
+        minimized_confs.append(conf)
+        minimized_energies.append(e_o)
     confs = minimized_confs
     energies = minimized_energies
     
@@ -91,31 +157,21 @@ class SmartDartingIntegrator(Dynamics.Integrator):
 
     if self.extended:
       # Keep only unique configurations, using rmsd as a threshold
-      inds_to_keep = [0]
-      for j in range(1,len(confs)):
-        min_rmsd = np.min([np.sqrt(np.sum(np.square(\
-          confs[j][self.molecule.heavy_atoms,:] - \
-          confs[k][self.molecule.heavy_atoms,:]))/self.molecule.nhatoms) \
-          for k in inds_to_keep])
-        if min_rmsd>rmsd_threshold:
-          inds_to_keep.append(j)
+      unique = UniqueIndex(rmsd_threshold*np.sqrt(self.molecule.nhatoms))
+      inds_to_keep = [j for j in range(len(confs)) \
+        if unique.insert(confs[j][self.molecule.heavy_atoms,:].ravel())]
       confs = [confs[i] for i in inds_to_keep]
       energies = [energies[i] for i in inds_to_keep]
 
-    confs_BAT = [self._BAT_util.BAT(confs[n], extended=self.extended) \
-      for n in range(len(confs))]
+    confs_BAT = list(self._BAT_util.BAT_many(confs, self.extended))
     confs_BAT_tp = [confs_BAT[c][self._BAT_to_perturb] \
       for c in range(len(confs_BAT))]
 
     if not self.extended:
       # Keep only unique configurations based on period fraction threshold
-      inds_to_keep = [0]
-      for j in range(1,len(confs)):
-        period_fracs = np.array([np.abs(confs_BAT_tp[j] - confs_BAT_tp[k]) \
-          for k in inds_to_keep])/twoPi
-        period_fracs = np.min([period_fracs,1-period_fracs],0)
-        if (np.max(period_fracs,1)>period_frac_threshold).all():
-          inds_to_keep.append(j)
+      unique = UniqueIndex(period_frac_threshold, periodic=True)
+      inds_to_keep = [j for j in range(len(confs)) \
+        if unique.insert(self._period_fracs(confs_BAT_tp[j]))]
       confs = [confs[i] for i in inds_to_keep]
       confs_BAT = [confs_BAT[i] for i in inds_to_keep]
       confs_BAT_tp = [confs_BAT_tp[i] for i in inds_to_keep]
@@ -124,6 +180,12 @@ class SmartDartingIntegrator(Dynamics.Integrator):
     confs_ha = [confs[c][self.molecule.heavy_atoms,:] \
       for c in range(len(confs))]
 
+    self.confs = confs
+    self.confs_ha = np.array(confs_ha)
+    self.confs_BAT = confs_BAT
+    self.confs_BAT_tp = np.array(confs_BAT_tp)
+    self._index_targets()
+
     if len(confs)>1:
       # Probabilty of jumping to a conformation k
       # is proportional to exp(-E/(R*600.)).
@@ -131,38 +193,20 @@ class SmartDartingIntegrator(Dynamics.Integrator):
       weights = np.exp(-logweight+min(logweight))
       self.weights = weights/sum(weights)
 
-      # self.darts[j][k] will jump from conformation j to conformation k
-      self.darts = [[confs_BAT[j][self._BAT_to_perturb] - \
-        confs_BAT[k][self._BAT_to_perturb] \
-        for j in range(len(confs))] for k in range(len(confs))]
-
       # Finds the minimum distance between target conformations.
       # This is the maximum allowed distance to permit a dart.
       if self.extended:
-        ssd = np.concatenate([[np.sum(np.square(confs_ha[j] - confs_ha[k]))
-                for j in range(k+1,len(confs))] \
-                  for k in range(len(confs))])
         # Uses the minimum distance or rmsd of 0.25 A
-        self.epsilon = min(np.min(ssd)*3/4., confs_ha[0].shape[0]*0.025*0.025)
+        self.epsilon = min(np.min(self._target_distances())*3/4., \
+          confs_ha[0].shape[0]*0.025*0.025)
       else:
-        period_fracs = [[np.abs(self.darts[j][k])/twoPi \
-          for j in range(len(confs))] for k in range(len(confs))]
-        period_fracs = [[np.min([period_fracs[j][k], 1-period_fracs[j][k]],0) \
-          for j in range(len(confs))] for k in range(len(confs))]
-        spf = np.concatenate([[\
-          np.sum(period_fracs[j][k]) \
-          for j in range(k+1,len(confs))] for k in range(len(confs))])
-        self.epsilon = np.min(spf)*3/4.
+        self.epsilon = np.min(self._target_distances())*3/4.
     else:
       self.epsilon = 0.
 
     # Set the universe to the lowest-energy configuration
-    self.universe.setConfiguration(Configuration(self.universe,np.copy(confs[0])))
+    set_coordinates(self.universe, confs[0])
 
-    self.confs = confs
-    self.confs_ha = confs_ha
-    self.confs_BAT = confs_BAT
-    self.confs_BAT_tp = confs_BAT_tp
     self.period_frac_threshold = period_frac_threshold
 
     from AlGDock.BindingPMF import HMStime
@@ -180,7 +224,7 @@ class SmartDartingIntegrator(Dynamics.Integrator):
       if self.extended:
         confs = self.confs
       else:
-        confs = [self._BAT_util.Cartesian(bat) for bat in self.confs_BAT]
+        confs = list(self._BAT_util.Cartesian_many(self.confs_BAT))
     import AlGDock.IO
     IO_dcd = AlGDock.IO.dcd(self.molecule)
     IO_dcd.write('confs.dcd', confs)
@@ -188,23 +232,75 @@ class SmartDartingIntegrator(Dynamics.Integrator):
     import os
     os.remove('confs.dcd')
 
+  def _index_targets(self):
+    """
+    Packs the dart targets into a contiguous array.
+    With extended coordinates, targets are heavy atom coordinates.
+    Otherwise, they are torsion angles in units of periods, between 0 and 1.
+    For many targets, the closest pose is found with a KD-tree.
+    """
+    nconfs = len(self.confs)
+    if self.extended:
+      self._targets = self.confs_ha.reshape((nconfs,-1))
+    else:
+      self._targets = self._period_fracs(self.confs_BAT_tp)
+    if nconfs >= KDTREE_MIN_TARGETS:
+      from scipy.spatial import cKDTree
+      if self.extended:
+        self._tree = cKDTree(self._targets)
+      else:
+        # Sums of period fractions are L1 distances on a periodic unit box
+        self._tree = cKDTree(self._targets, boxsize=1.)
+    else:
+      self._tree = None
+
+  def _period_fracs(self, angles):
+    fracs = np.mod(angles, twoPi)/twoPi
+    # Rounding may map small negative angles onto the upper bound
+    fracs[fracs>=1.] = 0.
+    return fracs
+
+  def _distances(self, target):
+    # Distances between a packed target and all dart targets
+    if self.extended:
+      # Sum of square distances between heavy atom coordinates
+      return np.square(self._targets - target).sum(1)
+    else:
+      # Sum of period fractions between torsion angles, wrapped around the period
+      period_fracs = np.abs(self._targets - target)
+      return np.minimum(period_fracs, 1-period_fracs).sum(1)
+
+  def _closest_target(self, target):
+    if self._tree is not None:
+      if self.extended:
+        (distance, closest_pose_index) = self._tree.query(target)
+        return (closest_pose_index, distance*distance)
+      return self._tree.query(target, p=1)[::-1]
+    distances = self._distances(target)
+    closest_pose_index = np.argmin(distances)
+    return (closest_pose_index, distances[closest_pose_index])
+
+  def _target_distances(self):
+    # Distance from each dart target to the closest other target
+    if self._tree is not None:
+      (distances, inds) = self._tree.query(self._targets, k=2, \
+        p=2 if self.extended else 1)
+      distances = distances[:,1]
+      return np.square(distances) if self.extended else distances
+    distances = np.zeros(len(self._targets))
+    for c in range(len(self._targets)):
+      distances_c = self._distances(self._targets[c])
+      distances_c[c] = np.inf
+      distances[c] = np.min(distances_c)
+    return distances
+
   def _closest_pose_Cartesian(self, conf_ha):
     # Closest pose has smallest sum of square distances between heavy atom coordinates
-    ssd = np.array([(np.square(self.confs_ha[c] - conf_ha)).sum() \
-      for c in range(len(self.confs_ha))])
-    closest_pose_index = np.argmin(ssd)
-    return (closest_pose_index, ssd[closest_pose_index])
+    return self._closest_target(conf_ha.ravel())
 
   def _closest_pose_BAT(self, conf_BAT_tp):
     # Closest pose has smallest sum of period fractions between torsion angles
-    # For only torsion angles, differences in units of periods (between 0 and 1)
-    period_fracs = (np.abs(np.array([self.confs_BAT_tp[c] - conf_BAT_tp \
-      for c in range(len(self.confs_BAT_tp))]))%twoPi)/twoPi
-    # Wraps around the period
-    period_fracs = np.min([period_fracs,1-period_fracs],0)
-    spf = np.sum(period_fracs,1)
-    closest_pose_index = np.argmin(spf)
-    return (closest_pose_index, spf[closest_pose_index])
+    return self._closest_target(self._period_fracs(conf_BAT_tp))
 
   def _p_attempt(self, dart_from, dart_to):
     return self.weights[dart_to]/(1.-self.weights[dart_from])
@@ -251,16 +347,19 @@ class SmartDartingIntegrator(Dynamics.Integrator):
 #    report = ''
     for t in range(ntrials):
       # Choose a pose to dart towards
-      dart_towards = closest_pose_o
-      while dart_towards==closest_pose_o:
-        dart_towards = np.random.choice(len(self.weights), p=self.weights)
-      # Generate a trial move
+      p_towards = np.copy(self.weights)
+      p_towards[closest_pose_o] = 0.
+      dart_towards = np.random.choice(len(self.weights), \
+        p=p_towards/np.sum(p_towards))
+      # Generate a trial move, which jumps by the difference between poses
       xn_BAT = np.copy(xo_BAT)
-      xn_BAT[self._BAT_to_perturb] = xo_BAT[self._BAT_to_perturb] + self.darts[closest_pose_o][dart_towards]
+      xn_BAT[self._BAT_to_perturb] = xo_BAT[self._BAT_to_perturb] + \
+        self.confs_BAT_tp[dart_towards] - self.confs_BAT_tp[closest_pose_o]
 
       # Check that the trial move is closest to dart_towards
       if self.extended:
-        xn_Cartesian = self._BAT_util.Cartesian(xn_BAT)
+        xn_Cartesian = self._BAT_util.Cartesian_update(\
+          xo_Cartesian, xn_BAT, self._BAT_to_perturb)
         (closest_pose_n, distance_n) = self._closest_pose_Cartesian(\
           xn_Cartesian[self.molecule.heavy_atoms,:])
         if (closest_pose_n!=dart_towards):
@@ -276,11 +375,11 @@ class SmartDartingIntegrator(Dynamics.Integrator):
             closest_pose_o,distance_o,dart_towards) + \
             ' landed near pose %d (%f)!'%(closest_pose_n, distance_n)
           continue
-        xn_Cartesian = self._BAT_util.Cartesian(xn_BAT)
+        xn_Cartesian = self._BAT_util.Cartesian_update(\
+          xo_Cartesian, xn_BAT, self._BAT_to_perturb)
 
       # Determine energy of new state
-      self.universe.setConfiguration(Configuration(self.universe, xn_Cartesian))
-      en = self.universe.energy()
+      en = energy(self.universe, xn_Cartesian)
 #      report += 'Attempting move from near pose %d with energy %f to pose %d with energy %f. '%(closest_pose_o,eo,closest_pose_n,en)
 
       # Accept or reject the trial move
@@ -299,5 +398,5 @@ class SmartDartingIntegrator(Dynamics.Integrator):
 #        report += 'Rejected.\n'
 #
 #    print report
-    self.universe.setConfiguration(Configuration(self.universe, xo_Cartesian))
+    set_coordinates(self.universe, xo_Cartesian)
     return ([np.copy(xo_Cartesian)], [eo], acc, ntrials, 0.0)
\ No newline at end of file
@@ -0,0 +1,235 @@
+# This module implements a torsional Hamiltonian Monte Carlo "integrator"
+# Bond lengths, bond angles, and torsions within rings are held fixed.
+# The molecule moves as a rigid body (translation and rotation)
+# and by rotating about each rotatable bond.
+#
+# Configurations are described by
+#   the position of a central atom,
+#   the orientation of the rigid core that contains the central atom, and
+#   the torsion angle about each rotatable bond.
+# With fixed bonds and angles,
+# the Jacobian of the bond-angle-torsion transformation is constant.
+# The external coordinates are the translation group and the
+# rotation group with its invariant (Haar) measure,
+# so the target density in these coordinates is simply exp(-U/RT).
+#
+# Generalized forces are obtained analytically from the Cartesian forces:
+#   translation - the sum of forces,
+#   rotation - the torque about the central atom, and
+#   torsions - the torque about each bond axis on the atoms it moves.
+# All the drifts commute and preserve volume,
+# so the leapfrog integrator is reversible and
+# a Metropolis acceptance criterion leads to exact sampling.
+# Masses and moments of inertia are computed once, when the integrator is
+# created, so the kinetic energy uses the same metric in every call.
+# It requires the option 'T' in addition to velocity verlet options.
+
+from MMTK import Dynamics, Features, Units
+
+import numpy as np
+
+R = 8.3144621*Units.J/Units.mol/Units.K
+
+def rotate(x, point, axis, angle):
+  """
+  Rotates the coordinates x about the line through point along the unit axis
+  """
+  d = x - point
+  c = np.cos(angle)
+  s = np.sin(angle)
+  return point + c*d + s*np.cross(axis, d) + \
+    (1.-c)*np.outer(np.dot(d, axis), axis)
+
+#
+# Torsional Hamiltonian Monte Carlo integrator
+#
+class TorsionalHMCIntegrator(Dynamics.Integrator):
+
+    def __init__(self, universe, molecule, **options):
+        Dynamics.Integrator.__init__(self, universe, options)
+        # Supported features: none for the moment, to keep it simple
+        self.features = []
+
+        self.molecule = molecule
+        self._find_rotatable_bonds()
+
+    def _find_rotatable_bonds(self):
+        """
+        Finds bonds that are not in rings and not to terminal atoms.
+        For each bond, the atoms on the side without the central atom
+        are rotated. Also computes the mass of each degree of freedom.
+        """
+        masses = self.universe.masses().array
+        x = self.universe.configuration().array
+        neighbors = {}
+        for a in self.molecule.atoms:
+          neighbors[a.index] = [b.index for b in a.bondedTo()]
+
+        # The central atom is the non-terminal atom closest to the center of mass
+        com = np.sum(masses[:,np.newaxis]*x,0)/np.sum(masses)
+        candidates = [ind for ind in neighbors.keys() \
+          if len(neighbors[ind])>1]
+        self._center = min(candidates, \
+          key=lambda ind:np.sum(np.square(x[ind]-com)))
+
+        def side(start, other):
+          # Atoms connected to start without the bond between start and other
+          visited = set([start])
+          to_visit = [start]
+          while len(to_visit)>0:
+            a = to_visit.pop()
+            for b in neighbors[a]:
+              if (a==start) and (b==other):
+                continue
+              if b not in visited:
+                visited.add(b)
+                to_visit.append(b)
+          return visited
+
+        self._bonds = []
+        for a2 in sorted(neighbors.keys()):
+          for a3 in neighbors[a2]:
+            if (a3<a2) or (len(neighbors[a2])==1) or (len(neighbors[a3])==1):
+              continue
+            moving = side(a2, a3)
+            if a3 in moving:
+              continue # The bond is in a ring
+            if self._center in moving:
+              (a2, a3) = (a3, a2)
+              moving = side(a2, a3)
+            moving.discard(a2)
+            moving = np.array(sorted(moving))
+            # Skip bonds where all the moving atoms are on the axis
+            axis = x[a2] - x[a3]
+            axis /= np.sqrt(np.sum(np.square(axis)))
+            d = x[moving] - x[a2]
+            d_perp = d - np.outer(np.dot(d, axis), axis)
+            if np.max(np.sum(np.square(d_perp),1)) < 1E-6:
+              continue
+            self._bonds.append((a2, a3, moving))
+
+        # Masses and moments of inertia for each degree of freedom,
+        # based on the configuration when the integrator is created
+        self._m_t = np.sum(masses)
+        self._m_r = 2./3.*np.sum(masses*\
+          np.sum(np.square(x - x[self._center]),1))
+        self._m_tors = np.zeros(len(self._bonds))
+        for k in range(len(self._bonds)):
+          (a2, a3, moving) = self._bonds[k]
+          axis = x[a2] - x[a3]
+          axis /= np.sqrt(np.sum(np.square(axis)))
+          d = x[moving] - x[a2]
+          d_perp = d - np.outer(np.dot(d, axis), axis)
+          self._m_tors[k] = np.sum(masses[moving]*np.sum(np.square(d_perp),1))
+
+    def _generalized_gradients(self, x, g):
+        # Derivatives of the energy with respect to
+        # translation, rotation about the central atom, and torsions
+        g_t = np.sum(g,0)
+        g_r = np.sum(np.cross(x - x[self._center], g),0)
+        g_tors = np.zeros(len(self._bonds))
+        for k in range(len(self._bonds)):
+          (a2, a3, moving) = self._bonds[k]
+          axis = x[a2] - x[a3]
+          axis /= np.sqrt(np.sum(np.square(axis)))
+          g_tors[k] = np.dot(axis, \
+            np.sum(np.cross(x[moving] - x[a2], g[moving]),0))
+        return (g_t, g_r, g_tors)
+
+    def _drift(self, x, d_t, d_r, d_tors):
+        # Rotates about each bond, then rotates and translates the molecule
+        for k in range(len(self._bonds)):
+          (a2, a3, moving) = self._bonds[k]
+          axis = x[a2] - x[a3]
+          axis /= np.sqrt(np.sum(np.square(axis)))
+          x[moving] = rotate(x[moving], x[a2], axis, d_tors[k])
+        angle = np.sqrt(np.sum(np.square(d_r)))
+        if angle>0:
+          x[:] = rotate(x, np.copy(x[self._center]), d_r/angle, angle)
+        x += d_t
+
+    def __call__(self, **options):
+        # Process the keyword arguments
+        self.setCallOptions(options)
+        # Check if the universe has features not supported by the integrator
+        Features.checkFeatures(self, self.universe)
+
+        RT = R*self.getOption('T')
+        delta_t = self.getOption('delta_t')
+
+        if 'steps_per_trial' in self.call_options.keys():
+          steps_per_trial = self.getOption('steps_per_trial')
+          ntrials = self.getOption('steps')/steps_per_trial
+        else:
+          steps_per_trial = self.getOption('steps')
+          ntrials = 1
+
+        if 'normalize' in self.call_options.keys():
+          normalize = self.getOption('normalize')
+        else:
+          normalize = False
+
+        # Seed the random number generator
+        if 'random_seed' in self.call_options.keys():
+          np.random.seed(self.getOption('random_seed'))
+
+        # The positions are updated in place
+        x = self.universe.configuration().array
+
+        (m_t, m_r, m_tors) = (self._m_t, self._m_r, self._m_tors)
+
+        xs = []
+        energies = []
+
+        # Store initial configuration, potential energy, and gradients
+        xo = np.copy(x)
+        (pe_o, g) = self.universe.energyAndGradients()
+        go = self._generalized_gradients(x, g.array)
+
+        acc = 0
+        for t in range(ntrials):
+          # Initialize the momenta
+          p_t = np.sqrt(m_t*RT)*np.random.randn(3)
+          p_r = np.sqrt(m_r*RT)*np.random.randn(3)
+          p_tors = np.sqrt(m_tors*RT)*np.random.randn(len(self._bonds))
+
+          # Store total energy
+          eo = pe_o + 0.5*(np.sum(np.square(p_t))/m_t + \
+            np.sum(np.square(p_r))/m_r + np.sum(np.square(p_tors)/m_tors))
+
+          # Run the leapfrog integrator
+          (g_t, g_r, g_tors) = go
+          for step in range(steps_per_trial):
+            p_t -= 0.5*delta_t*g_t
+            p_r -= 0.5*delta_t*g_r
+            p_tors -= 0.5*delta_t*g_tors
+            self._drift(x, delta_t*p_t/m_t, delta_t*p_r/m_r, \
+              delta_t*p_tors/m_tors)
+            (pe_n, g) = self.universe.energyAndGradients()
+            (g_t, g_r, g_tors) = self._generalized_gradients(x, g.array)
+            p_t -= 0.5*delta_t*g_t
+            p_r -= 0.5*delta_t*g_r
+            p_tors -= 0.5*delta_t*g_tors
+
+          # Decide whether to accept the move
+          en = pe_n + 0.5*(np.sum(np.square(p_t))/m_t + \
+            np.sum(np.square(p_r))/m_r + np.sum(np.square(p_tors)/m_tors))
+
+          if (not np.isnan(en)) and \
+             ((en<eo) or (np.random.random()<np.exp(-(en-eo)/RT))) and \
+             ((abs(pe_o-pe_n)/RT<250.) or (abs(eo-en)/RT<250.)):
+            xo = np.copy(x)
+            pe_o = pe_n
+            go = (g_t, g_r, g_tors)
+            acc += 1
+          else:
+            x[:] = xo
+
+          xs.append(np.copy(x))
+          energies.append(pe_o)
+
+        if normalize:
+          self.universe.normalizePosition()
+          xs[-1] = np.copy(self.universe.configuration().array)
+
+        return (xs, energies, acc, ntrials, delta_t)
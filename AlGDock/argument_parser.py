@@ -329,9 +329,11 @@ class SimulationArguments:
       ('protocol', 'Adaptive'), ('therm_speed', 30.0), ('T_HIGH', 600.),
       ('T_SIMMIN', 300.), ('T_TARGET', 300.),
       ('H_mass', 4.0), ('delta_t', 4.0), ('sampler', 'NUTS'),
+      ('metric', 'mass'), ('inner_steps', 4),
       ('steps_per_seed', 1000), ('seeds_per_state', 50), ('darts_per_seed', 0),
       ('repX_cycles', 20), ('min_repX_acc', 0.4), ('sweeps_per_cycle', 1000),
       ('snaps_per_cycle', 50), ('attempts_per_sweep', 25),
+      ('swap_scheme', 'neighbors'),
       ('steps_per_sweep', 50), ('darts_per_sweep', 0),
       ('phases', ['NAMD_Gas', 'NAMD_OBC']),
       ('sampling_importance_resampling', False), ('solvation', 'Desolvated'),
@@ -94,8 +94,16 @@ args = {
     'therm_speed':{'type':float,
     'help':'Thermodynamic speed during adaptive simulation'},
     'sampler':{
-    'choices':['MixedHMC','HMC','NUTS','VV'],
+    'choices':['MixedHMC','HMC','NUTS','VV','RESPA','TorsionalHMC'],
     'help':'Sampling method'},
+    'metric':{
+    'choices':['mass','diagonal','dense'],
+    'help':'Metric (mass matrix) for the NUTS sampler. ' + \
+      'Diagonal and dense metrics are adapted during initialization ' + \
+      'and stored for each thermodynamic state.'},
+    'inner_steps':{'type':int,
+    'help':'For the RESPA sampler, the number of inner time steps ' + \
+      '(intramolecular forces) per outer time step (grid, OBC, and site forces)'},
     'MCMC_moves':{'type':int,
     'help':'Types of MCMC moves to use'},
     'delta_t':{'type':float, 'default':3.5, \
@@ -122,6 +130,10 @@ args = {
     'help':'Number of replica exchange sweeps per cycle'},
     'attempts_per_sweep':{'type':int,
     'help':'Number of replica exchange attempts per sweep'},
+    'swap_scheme':{'choices':['neighbors','infinite'],
+    'help':'Replica exchange swaps between nearby pairs of states ' + \
+      '(neighbors) or heat bath swaps between all pairs of states (infinite), ' + \
+      'with attempts_per_sweep sweeps over all pairs'},
     'steps_per_sweep':{'type':int,
     'help':'Number of MD steps per replica exchange sweep'},
     'darts_per_sweep':{'type':int,
@@ -176,9 +188,11 @@ args = {
 import copy
 for process in ['BC', 'CD']:
   for key in [
-      'protocol', 'therm_speed', 'sampler', 'seeds_per_state',
+      'protocol', 'therm_speed', 'sampler', 'metric', 'inner_steps',
+      'seeds_per_state',
       'steps_per_seed', 'darts_per_seed', 'sweeps_per_cycle',
-      'attempts_per_sweep', 'steps_per_sweep', 'darts_per_sweep',
+      'attempts_per_sweep', 'swap_scheme', 'steps_per_sweep',
+      'darts_per_sweep',
       'snaps_per_cycle', 'keep_intermediate'
   ]:
     args[process + '_' + key] = copy.deepcopy(args[key])
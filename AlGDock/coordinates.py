@@ -0,0 +1,42 @@
+# In-place coordinate updates for MMTK universes
+#
+# Universe.setConfiguration requires a Configuration object,
+# which allocates and validates a new coordinate array.
+# In sampler loops, coordinates are instead copied into
+# the array of the current configuration, which MMTK
+# energy evaluators read directly.
+# This is only appropriate for universes without periodic boundaries,
+# where the configuration has no cell parameters.
+
+import numpy as np
+
+
+def set_coordinates(universe, x):
+  """Copies coordinates into the current configuration of a universe
+
+  Parameters
+  ----------
+  universe : MMTK.Universe
+    The universe
+  x : np.array
+    Coordinates, with shape (natoms, 3), in nm
+  """
+  universe.configuration().array[:] = x
+
+
+def energy(universe, x):
+  """Returns the potential energy of the universe at the coordinates x
+
+  The universe is left in the configuration x.
+  """
+  universe.configuration().array[:] = x
+  return universe.energy()
+
+
+def energy_terms(universe, x):
+  """Returns a dictionary of energy terms of the universe at the coordinates x
+
+  The universe is left in the configuration x.
+  """
+  universe.configuration().array[:] = x
+  return universe.energyTerms()
@@ -0,0 +1,122 @@
+# Content-addressed cache of receptor grids
+
+import os
+import hashlib
+import numpy as np
+
+
+class GridCache:
+  """
+  Class to store and retrieve grids that have already been calculated.
+
+  Grids are keyed by a hash of
+    the receptor coordinates,
+    the contents of the parameter files (e.g. prmtop and pqr),
+    the grid geometry, and
+    the generator, its version, and its options.
+  Screening many ligands against the same receptor
+  then only calculates each grid once.
+
+  Values are stored in .npy files, which can be memory mapped.
+  The origin, spacing, and counts are stored in a separate .npz file.
+  """
+  def __init__(self, cache_dir):
+    self.dir = os.path.abspath(os.path.expanduser(cache_dir))
+    if not os.path.isdir(self.dir):
+      os.makedirs(self.dir)
+
+  def key(self, generator, version, crd, parameter_FNs, \
+      spacing, counts, origin=None, **options):
+    """
+    Returns the key for a grid.
+
+    generator is a name for the code that calculates the grid.
+    version should be incremented whenever the generator output changes.
+    options are any other settings that affect the grid.
+    """
+    if origin is None:
+      origin = np.array([0., 0., 0.])
+    h = hashlib.sha1()
+    h.update('%s %d\n' % (generator, version))
+    h.update(np.ascontiguousarray(crd, dtype=float).tostring())
+    for FN in parameter_FNs:
+      if FN is not None:
+        h.update(self._file_digest(FN))
+    for val in [origin, spacing]:
+      h.update(np.ascontiguousarray(val, dtype=float).tostring())
+    h.update(np.ascontiguousarray(counts, dtype=int).tostring())
+    for name in sorted(options.keys()):
+      h.update('%s=%r\n' % (name, options[name]))
+    return h.hexdigest()
+
+  def _file_digest(self, FN):
+    h = hashlib.sha1()
+    F = open(FN, 'rb')
+    chunk = F.read(2**20)
+    while chunk != '':
+      h.update(chunk)
+      chunk = F.read(2**20)
+    F.close()
+    return h.digest()
+
+  def _FNs(self, key):
+    return (os.path.join(self.dir, key + '.header.npz'), \
+            os.path.join(self.dir, key + '.vals.npy'))
+
+  def has(self, key):
+    return np.array([os.path.isfile(FN) for FN in self._FNs(key)]).all()
+
+  def load(self, key, mmap_mode='r'):
+    """
+    Returns a grid dictionary, or None if the grid is not in the cache.
+    By default the values are memory mapped read-only.
+    """
+    if not self.has(key):
+      return None
+    (header_FN, vals_FN) = self._FNs(key)
+    header = np.load(header_FN)
+    data = {
+      'origin': np.array(header['origin']),
+      'spacing': np.array(header['spacing']),
+      'counts': np.array(header['counts']),
+      'vals': np.load(vals_FN, mmap_mode=mmap_mode)
+    }
+    header.close()
+    return data
+
+  def store(self, key, data):
+    """
+    Adds a grid dictionary to the cache.
+    Files are written under temporary names and then renamed,
+    so that concurrent jobs never see an incomplete grid.
+    """
+    (header_FN, vals_FN) = self._FNs(key)
+    suffix = '.%d.tmp' % os.getpid()
+    F = open(vals_FN + suffix, 'wb')
+    np.save(F, np.ascontiguousarray(data['vals'], dtype=float).ravel())
+    F.close()
+    F = open(header_FN + suffix, 'wb')
+    np.savez(F, origin=data['origin'], spacing=data['spacing'], \
+      counts=data['counts'])
+    F.close()
+    os.rename(vals_FN + suffix, vals_FN)
+    os.rename(header_FN + suffix, header_FN)
+
+  def fetch(self, key, out_FN):
+    """
+    Writes a cached grid to out_FN.
+    Returns True if the grid was in the cache.
+    """
+    data = self.load(key)
+    if data is None:
+      return False
+    import AlGDock.IO
+    AlGDock.IO.Grid().write(out_FN, data)
+    return True
+
+  def store_file(self, key, FN):
+    """
+    Adds a grid file (dx or netcdf) to the cache
+    """
+    import AlGDock.IO
+    self.store(key, AlGDock.IO.Grid().read(FN))
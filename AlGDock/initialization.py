@@ -10,6 +10,8 @@ import MMTK.Units
 from MMTK.ParticleProperties import Configuration
 
 from AlGDock.BindingPMF import R
+from AlGDock.BindingPMF import scalables
+from AlGDock.coordinates import energy
 
 class Initialization():
   """Establishes the initial protocol of thermodynamic states
@@ -100,9 +102,7 @@ class Initialization():
       # Get initial potential energy
       Es_o = []
       for seed in seeds:
-        self.top.universe.setConfiguration(
-          Configuration(self.top.universe, seed))
-        Es_o.append(self.top.universe.energy())
+        Es_o.append(energy(self.top.universe, seed))
       Es_o = np.array(Es_o)
 
       # Perform simulation
@@ -147,7 +147,8 @@ class Initialization():
         delta_t = delta_t[0]
 
       # Adjust the time step
-      if self.args.params[process]['sampler'] == 'HMC':
+      if self.args.params[process]['sampler'] in \
+          ['HMC', 'RESPA', 'TorsionalHMC']:
         # Adjust the time step for Hamiltonian Monte Carlo
         acc_rate = float(np.sum([r['acc_Sampler'] for r in results]))/\
           np.sum([r['att_Sampler'] for r in results])
@@ -175,6 +176,11 @@ class Initialization():
 
       params_k['delta_t'] = delta_t
 
+      # Average the adapted metric over the seeds
+      if np.array(['inv_metric' in r.keys() for r in results]).all():
+        params_k['inv_metric'] = np.mean(\
+          [r['inv_metric'] for r in results], axis=0)
+
     sampler_metrics = ''
     for s in ['ExternalMC', 'SmartDarting', 'Sampler']:
       if np.array(['acc_' + s in r.keys() for r in results]).any():
@@ -187,8 +193,16 @@ class Initialization():
     return (seeds, Es_n - Es_o, delta_t, sampler_metrics)
 
 
-  def _tL_tensor(self, E, params_c, process='CD'):
+  def _tL_tensor(self, E, params_c, process='CD', weights=None):
     # Metric tensor for the thermodynamic length
+    # If configurations are importance sampled, the standard deviations
+    # of energies are weighted
+    def std(u):
+      if weights is None:
+        return u.std()
+      mean = np.average(u, weights=weights)
+      return np.sqrt(np.average((u - mean)**2, weights=weights))
+
     T = params_c['T']
     deltaT = np.abs(self.args.params['BC']['T_HIGH'] - self.args.params['BC']['T_TARGET'])
     if process == 'CD':
@@ -240,9 +254,9 @@ class Initialization():
             'k_spatial_ext':params_c['k_spatial_ext'], \
             'k_angular_int':params_c['k_angular_int'], \
             'sLJr':alpha_g, 'sLJa':alpha_g, 'ELE':alpha_g}], noBeta=True)
-        return np.abs(da_r_da)*U_r.std()/(R*T) + \
-               np.abs(da_g_da)*Psi_g.std()/(R*T) + \
-               deltaT*U_RL_g.std()/(R*T*T)
+        return np.abs(da_r_da)*std(U_r)/(R*T) + \
+               np.abs(da_g_da)*std(Psi_g)/(R*T) + \
+               deltaT*std(U_RL_g)/(R*T*T)
       else:  # BPMF
         alpha_sg = 1. - 4. * (alpha - 0.5)**2
         da_sg_da = -8 * (alpha - 0.5)
@@ -259,9 +273,9 @@ class Initialization():
             [{'MM':True, 'OBC':OBC, 'site':True, 'T':T,\
             'sLJr':alpha_sg, 'sELE':alpha_sg, \
             'LJr':alpha_g, 'LJa':alpha_g, 'ELE':alpha_g}], noBeta=True)
-        return np.abs(da_sg_da)*Psi_sg.std()/(R*T) + \
-               np.abs(da_g_da)*Psi_g.std()/(R*T) + \
-               deltaT*U_RL_g.std()/(R*T*T)
+        return np.abs(da_sg_da)*std(Psi_sg)/(R*T) + \
+               np.abs(da_g_da)*std(Psi_g)/(R*T) + \
+               deltaT*std(U_RL_g)/(R*T*T)
     elif process == 'BC':
       if self.args.params['BC']['solvation'] == 'Full':
         # OBC is always on
@@ -490,6 +504,8 @@ class Initialization():
 
   def _initialize_CD(self, seeds):
     self.log.recordStart('initial_CD')
+    # Importance weights of the configurations in E, if any
+    E_weights = None
     self.log.recordStart('CDsave')
 
     if self.data['CD'].protocol == []:
@@ -548,7 +564,7 @@ class Initialization():
         confs_HT = confs_HT[:self.args.params['CD']['seeds_per_state']]
 
         if (self.args.params['CD']['pose'] == -1):
-          (confs, E) = self._random_CD()
+          (confs, E, E_weights) = self._random_CD()
           self.log.tee("  random CD complete in " +
                        HMStime(self.log.timeSince('initial_CD')))
           if randomOnly:
@@ -587,7 +603,7 @@ class Initialization():
     while (not self.data['CD'].protocol[-1]['crossed']):
       # Determine next value of the protocol
       params_n = self._next_CD_state(E = E, params_o = params_o, \
-          pow = rejectStage, decoupling = decoupling)
+          pow = rejectStage, decoupling = decoupling, weights = E_weights)
       self.data['CD'].protocol.append(params_n)
       if len(self.data['CD'].protocol) > 1000:
         self._clear('CD')
@@ -605,6 +621,8 @@ class Initialization():
       u_n = self._u_kln([E], [params_n])
       du = u_n - u_o
       weights = np.exp(-du + min(du))
+      if E_weights is not None:
+        weights *= E_weights
       seedIndicies = np.random.choice(len(u_o), \
         size = self.args.params['CD']['seeds_per_state'], \
         p=weights/sum(weights))
@@ -616,9 +634,9 @@ class Initialization():
         # in the first CD state for replica exchange
         ind = np.argmin(u_n)
         (c,i_rot,i_trans) = np.unravel_index(ind, \
-          (self.args.params['CD']['seeds_per_state'], self._n_rot, self.data['CD']._n_trans))
-        repX_conf = np.add(np.dot(confs[c], self._random_rotT[i_rot,:,:]),\
-                           self.data['CD']._random_trans[i_trans].array)
+          (self.args.params['CD']['seeds_per_state'], \
+           self.data['CD']._n_rot, self.data['CD']._n_trans))
+        repX_conf = self._random_CD_pose(confs[c], i_rot, i_trans)
         self.data['CD'].confs['replicas'] = [repX_conf]
         self.data['CD'].confs['samples'] = [[repX_conf]]
         self.data['CD'].Es = [[dict([(key,np.array([val[ind]])) \
@@ -626,14 +644,15 @@ class Initialization():
         seeds = []
         for ind in seedIndicies:
           (c,i_rot,i_trans) = np.unravel_index(ind, \
-            (self.args.params['CD']['seeds_per_state'], self._n_rot, self._n_trans))
-          seeds.append(np.add(np.dot(confs[c], self._random_rotT[i_rot,:,:]), \
-            self.data['CD']._random_trans[i_trans].array))
+            (self.args.params['CD']['seeds_per_state'], \
+             self.data['CD']._n_rot, self.data['CD']._n_trans))
+          seeds.append(self._random_CD_pose(confs[c], i_rot, i_trans))
         confs = None
         E = {}
       else:  # Seeds from last state
         seeds = [np.copy(confs[ind]) for ind in seedIndicies]
       self.data['CD'].confs['seeds'] = seeds
+      E_weights = None
 
       # Store old data
       confs_o = confs
@@ -770,6 +789,8 @@ class Initialization():
 
       The first state of CD is sampled by randomly placing configurations
       from the high temperature ligand simulation into the binding site.
+      Translations are importance sampled away from occupied regions of
+      the binding site, so the energies are returned with weights.
     """
     # Select samples from the high T unbound state
     E_MM = []
@@ -795,76 +816,131 @@ class Initialization():
     self.data['CD'].protocol = [params_o]
 
     # Set up the force field with full interaction grids
-    self.system.setParams(self.system.paramsFromAlpha(1.0, 'CD'))
+    params_full = self.system.paramsFromAlpha(1.0, 'CD')
+    self.system.setParams(params_full)
 
     # Either loads or generates the random translations and rotations for the first state of CD
-    if not (hasattr(self, '_random_trans') and hasattr(self, '_random_rotT')):
+    if not (hasattr(self.data['CD'], '_random_trans') and \
+            hasattr(self.data['CD'], '_random_rotT')):
       self.data['CD']._max_n_trans = 10000
       # Default density of points is 50 per nm**3
       self.data['CD']._n_trans = max(
         min(
           np.int(
-            np.ceil(self._forceFields['site'].volume *
+            np.ceil(self.system._forceFields['site'].volume *
                     self.args.params['CD']['site_density'])),
           self.data['CD']._max_n_trans), 5)
-      self.data['CD']._random_trans = np.ndarray(
-        (self.data['CD']._max_n_trans), dtype=Vector)
-      for ind in range(self.data['CD']._max_n_trans):
-        self.data['CD']._random_trans[ind] = Vector(
-          self._forceFields['site'].randomPoint())
+      self.data['CD']._random_trans = np.array([ \
+        self.system._forceFields['site'].randomPoint() \
+          for ind in range(self.data['CD']._max_n_trans)], dtype=float)
       self.data['CD']._max_n_rot = 100
-      self._n_rot = 100
-      self._random_rotT = np.ndarray((self.data['CD']._max_n_rot, 3, 3))
+      self.data['CD']._n_rot = 100
+      self.data['CD']._random_rotT = \
+        np.ndarray((self.data['CD']._max_n_rot, 3, 3))
       from AlGDock.Integrators.ExternalMC.ExternalMC import random_rotate
       for ind in range(self.data['CD']._max_n_rot):
-        self._random_rotT[ind, :, :] = np.transpose(random_rotate())
+        self.data['CD']._random_rotT[ind, :, :] = \
+          np.transpose(random_rotate())
     else:
       self.data['CD']._max_n_trans = self.data['CD']._random_trans.shape[0]
-      self._n_rot = self._random_rotT.shape[0]
+      self.data['CD']._n_rot = self.data['CD']._random_rotT.shape[0]
+    # Translations may have been saved as MMTK Vectors
+    random_trans = np.array([[p[0], p[1], p[2]] \
+      for p in self.data['CD']._random_trans], dtype=float)
+    n_rot = self.data['CD']._n_rot
+    random_rotT = self.data['CD']._random_rotT[:n_rot]
+
+    # Center the seeds at their center of mass.
+    # A rigid pose is then the rotated seed plus a random translation,
+    # which places the center of mass within the binding site.
+    masses = self.top.universe.masses().array
+    BC0_centered = np.array(BC0_confs)
+    BC0_centered -= np.dot(masses, BC0_centered)[:, np.newaxis, :] / \
+      np.sum(masses)
+
+    # Interaction grids, which are evaluated at unit strength
+    grid_terms = [term for term in scalables if (term != 'OBC') and \
+      (term in params_full.keys()) and \
+      (term in self.system._forceFields.keys())]
+    grids = [self.system._forceFields[term] for term in grid_terms]
+    scaling_factors = [grid.scaling_factors(self.top.universe).array \
+      for grid in grids]
+
+    # Occupancy map of the binding site.
+    # A translation is occupied if a typical repulsive atom at the center
+    # of mass would clash with the receptor.
+    from pose_scan import scan_poses
+    from estimators import bootstrap_EXP
+    M = self.data['CD']._max_n_trans
+    occupied = np.zeros(M, dtype=bool)
+    if 'LJr' in grid_terms:
+      sf_LJr = scaling_factors[grid_terms.index('LJr')]
+      sf_LJr = np.median(np.abs(sf_LJr[sf_LJr != 0])) \
+        if np.any(sf_LJr != 0) else 0.
+      E_probe = np.zeros((1, 1, M))
+      scan_poses(np.zeros((1, 1, 3)), np.eye(3)[np.newaxis], random_trans, \
+        0, M, [grids[grid_terms.index('LJr')]], [np.array([sf_LJr])], \
+        [E_probe])
+      occupied = E_probe[0, 0] / (R * params_o['T']) > 10.
+    M_occ = np.sum(occupied)
+    self.log.tee("  %d of %d random translations are occupied"%(M_occ, M))
+
+    def proposal(defensive):
+      # A defensive mixture of uniform translations and free translations
+      if (M_occ == 0) or (M_occ == M):
+        return np.ones(M) / M
+      q = np.ones(M) * defensive / M
+      q[~occupied] += (1. - defensive) / (M - M_occ)
+      return q
 
     # Get interaction energies.
-    # Loop over configurations, random rotations, and random translations
-    E = {}
-    for term in (['MM', 'site'] + scalables):
-      # Large array creation may cause MemoryError
-      E[term] = np.zeros((self.args.params['CD']['seeds_per_state'], \
-        self.data['CD']._max_n_rot,self.data['CD']._n_trans))
+    # Translations are drawn in batches from the proposal, with replacement.
+    # The proposal is adapted after every batch, and translations are
+    # weighted by the uniform density over the mixture of proposals.
+    # Grid energies of all configurations, random rotations, and
+    # translations are stored in one block, which grows as
+    # translations are added. The molecular mechanics and implicit solvent
+    # energies do not depend on the pose. Because translations are
+    # within the binding site, the site energy is zero.
+    nseeds = self.args.params['CD']['seeds_per_state']
+    capacity = self.data['CD']._n_trans
+    # Large array creation may cause MemoryError
+    E_grids = np.zeros((len(grids), nseeds, n_rot, capacity))
+    trans_inds = np.zeros(capacity, dtype=int)
     self.log.tee("  allocated memory for interaction energies")
 
-    from AlGDock.system import term_map
-
+    defensive = 0.1
+    q_sum = np.zeros(M)
     converged = False
     n_trans_o = 0
     n_trans_n = self.data['CD']._n_trans
     while not converged:
-      for c in range(self.args.params['CD']['seeds_per_state']):
-        E['MM'][c, :, :] = BC0_Es_MM[c]
-        if BC0_Es_OBC != []:
-          E['OBC'][c, :, :] = BC0_Es_OBC[c]
-        for i_rot in range(self._n_rot):
-          conf_rot = Configuration(self.top.universe,\
-            np.dot(BC0_confs[c], self._random_rotT[i_rot,:,:]))
-          for i_trans in range(n_trans_o, n_trans_n):
-            self.top.universe.setConfiguration(conf_rot)
-            self.top.universe.translateTo(
-              self.data['CD']._random_trans[i_trans])
-            eT = self.top.universe.energyTerms()
-            for (key, value) in eT.iteritems():
-              if key != 'electrostatic':  # For some reason, MMTK double-counts electrostatic energies
-                E[term_map[key]][c, i_rot, i_trans] += value
-      E_c = {}
-      for term in E.keys():
-        # Large array creation may cause MemoryError
-        E_c[term] = np.ravel(E[term][:, :self._n_rot, :n_trans_n])
+      q = proposal(defensive)
+      q_sum += (n_trans_n - n_trans_o) * q
+      trans_inds[n_trans_o:n_trans_n] = \
+        np.random.choice(M, n_trans_n - n_trans_o, p=q)
+      scan_poses(BC0_centered, random_rotT, \
+        random_trans[trans_inds[:n_trans_n]], \
+        n_trans_o, n_trans_n, grids, scaling_factors, \
+        [E_grids[g] for g in range(len(grids))])
+      w_trans = n_trans_n / (M * q_sum[trans_inds[:n_trans_n]])
+      weights = np.tile(w_trans, nseeds * n_rot)
+      E = {}
+      E['MM'] = np.repeat(BC0_Es_MM, n_rot * n_trans_n)
+      E['site'] = np.zeros(nseeds * n_rot * n_trans_n)
+      for term in scalables:
+        if term in grid_terms:
+          E[term] = np.ravel(E_grids[grid_terms.index(term), :, :, :n_trans_n])
+        elif (term == 'OBC') and (BC0_Es_OBC != []):
+          E[term] = np.repeat(BC0_Es_OBC, n_rot * n_trans_n)
+        else:
+          E[term] = np.zeros(nseeds * n_rot * n_trans_n)
       self.log.tee("  allocated memory for %d translations" % n_trans_n)
-      (u_kln,N_k) = self._u_kln([E_c],\
-        [params_o,self._next_CD_state(E=E_c, params_o=params_o, decoupling=False)])
+      (u_kln,N_k) = self._u_kln([E],\
+        [params_o,self._next_CD_state(E=E, params_o=params_o, \
+          decoupling=False, weights=weights)])
       du = u_kln[0, 1, :] - u_kln[0, 0, :]
-      bootstrap_reps = 50
-      f_grid0 = np.zeros(bootstrap_reps)
-      for b in range(bootstrap_reps):
-        du_b = du[np.random.randint(0, len(du), len(du))]
-        f_grid0[b] = -np.log(np.exp(-du_b + min(du_b)).mean()) + min(du_b)
+      f_grid0 = bootstrap_EXP(du, weights, reps=50)
       f_grid0_std = f_grid0.std()
       converged = f_grid0_std < 0.1
       if not converged:
@@ -873,35 +949,59 @@ class Initialization():
                  f_grid0.mean(),f_grid0_std))
         if n_trans_n == self.data['CD']._max_n_trans:
           break
+        # Adapt the defensive fraction so that the proposal probability of
+        # occupied translations matches their share of the Boltzmann factor
+        if (M_occ > 0) and (M_occ < M):
+          f = weights * np.exp(-du + min(du))
+          f_occ = np.sum(f[np.tile(occupied[trans_inds[:n_trans_n]], \
+            nseeds * n_rot)]) / np.sum(f)
+          defensive = min(max(f_occ * M / M_occ, 0.05), 1.)
         n_trans_o = n_trans_n
         n_trans_n = min(n_trans_n + 25, self.data['CD']._max_n_trans)
-        for term in (['MM', 'site'] + scalables):
+        if n_trans_n > capacity:
+          # Double the capacity so that energies are rarely copied
+          capacity = min(2 * capacity, self.data['CD']._max_n_trans)
           # Large array creation may cause MemoryError
-          E[term] = np.dstack((E[term], \
-            np.zeros((self.args.params['CD']['seeds_per_state'],\
-              self.data['CD']._max_n_rot,25))))
+          E_grids_n = np.zeros((len(grids), nseeds, n_rot, capacity))
+          E_grids_n[:, :, :, :n_trans_o] = E_grids[:, :, :, :n_trans_o]
+          E_grids = E_grids_n
+          trans_inds = np.concatenate((trans_inds[:n_trans_o], \
+            np.zeros(capacity - n_trans_o, dtype=int)))
 
     if self.data['CD']._n_trans != n_trans_n:
       self.data['CD']._n_trans = n_trans_n
+    self._random_trans_inds = trans_inds[:n_trans_n]
 
     self.log.tee("  %d ligand configurations "%len(BC0_Es_MM) + \
              "were randomly docked into the binding site using "+ \
-             "%d translations and %d rotations "%(n_trans_n,self._n_rot))
+             "%d translations and %d rotations "%(n_trans_n,n_rot))
+    self.log.tee("  the effective sample size of translations is %.1f"%(\
+             np.sum(w_trans)**2 / np.sum(w_trans**2)))
     self.log.tee("  the predicted free energy difference between the" + \
              " first and second CD states is " + \
              "%.5g (%.5g)"%(f_grid0.mean(),f_grid0_std))
 
-    self.log.recordStart('ravel')
-    for term in E.keys():
-      E[term] = np.ravel(E[term][:, :self._n_rot, :self.data['CD']._n_trans])
-    self.log.tee("  raveled energy terms in " + \
-      HMStime(self.log.timeSince('ravel')))
+    return (BC0_confs, E, weights)
 
-    return (BC0_confs, E)
+  def _random_CD_pose(self, conf, i_rot, i_trans):
+    """
+    Returns a configuration randomly placed by _random_CD
 
-  def _next_CD_state(self, E=None, params_o=None, pow=None, decoupling=False):
+    The configuration is rotated about its center of mass,
+    which is then moved to the i_trans-th translation drawn by _random_CD.
+    """
+    masses = self.top.universe.masses().array
+    centered = conf - np.dot(masses, conf) / np.sum(masses)
+    trans = self.data['CD']._random_trans[self._random_trans_inds[i_trans]]
+    return np.dot(centered, self.data['CD']._random_rotT[i_rot, :, :]) + \
+      np.array([trans[0], trans[1], trans[2]])
+
+  def _next_CD_state(self, E=None, params_o=None, pow=None, decoupling=False, \
+      weights=None):
     """
     Determines the parameters for the next CD state
+
+    weights are importance weights of the configurations in E, if any.
     """
 
     if E is None:
@@ -912,7 +1012,7 @@ class Initialization():
 
     if self.args.params['CD']['protocol'] == 'Adaptive':
       # Change grid scaling and temperature simultaneously
-      tL_tensor = self._tL_tensor(E, params_o)
+      tL_tensor = self._tL_tensor(E, params_o, weights=weights)
       crossed = params_o['crossed']
       # Calculate the change in the progress variable, capping at 0.05
       if pow is None:
@@ -232,8 +232,7 @@ class LigandPreparation():
                                                                  (rep + 1)))
 
     # Then ramp the energy to the starting temperature
-    from AlGDock.Integrators.HamiltonianMonteCarlo.HamiltonianMonteCarlo \
-      import HamiltonianMonteCarloIntegrator
+    from HMC import HamiltonianMonteCarloIntegrator  # @UnresolvedImport
     sampler = HamiltonianMonteCarloIntegrator(self.top.universe)
 
     e_o = self.top.universe.energy()
@@ -0,0 +1,156 @@
+# Reduced potential energies of configurations in thermodynamic states
+#
+# The energy in each thermodynamic state is a linear combination of
+# energy terms. Energy terms of all configurations are arranged into a
+# (nterms, N) matrix and the coefficients of the states, divided by RT,
+# into a (L, nterms) matrix, so that reduced energies are
+# matrix products. For u_kln, there is one product per sampled state,
+# which keeps the blocks of the product in cache.
+
+import numpy as np
+
+from AlGDock.BindingPMF import R
+from AlGDock.BindingPMF import scalables
+
+restraint_terms = ['k_angular_ext', 'k_spatial_ext', 'k_angular_int']
+
+
+def coefficients(protocol, noBeta=False):
+  """Returns the energy terms and coefficients of thermodynamic states
+
+  The 'MM' and 'site' terms are included in every state
+  if they are included in the first state.
+
+  Parameters
+  ----------
+  protocol : list of dict
+    Thermodynamic states
+  noBeta : bool
+    If True, the coefficients will not be divided by RT
+
+  Returns
+  -------
+  terms : list of str
+    Energy terms with coefficients
+  C : np.array
+    Coefficients, with shape (L, len(terms))
+  """
+  L = len(protocol)
+  terms = []
+  for term in ['MM', 'site']:
+    if (term in protocol[0].keys()) and (protocol[0][term]):
+      terms.append(term)
+  nbase = len(terms)
+  for term in scalables + restraint_terms:
+    if np.any([term in protocol[l].keys() for l in range(L)]):
+      terms.append(term)
+  if len(terms) == 0:
+    raise Exception('The thermodynamic states include no energy terms')
+
+  C = np.zeros((L, len(terms)))
+  C[:, :nbase] = 1.
+  for l in range(L):
+    for t in range(nbase, len(terms)):
+      if terms[t] in protocol[l].keys():
+        C[l, t] = protocol[l][terms[t]]
+  if not noBeta:
+    C /= (R * np.array([protocol[l]['T'] for l in range(L)]))[:, np.newaxis]
+  return (terms, C)
+
+
+def energy_matrix(eTs, terms):
+  """Arranges energy terms into a matrix
+
+  Parameters
+  ----------
+  eTs : dict, list of dict, or list of list of dict of np.array
+    Energy terms, as described in u_kln
+  terms : list of str
+    Energy terms to include
+
+  Returns
+  -------
+  E : np.array
+    Energy terms of all configurations, with shape (len(terms), N).
+    For lists, configurations are ordered by state and then cycle.
+  N_k : np.array
+    Number of configurations from each state
+  """
+  if isinstance(eTs, dict):
+    dicts = [eTs]
+    N_k = np.ones(len(eTs[terms[0]]), dtype=int)
+  elif isinstance(eTs[0], dict):
+    dicts = eTs
+    N_k = np.array([len(eT[terms[0]]) for eT in eTs], dtype=int)
+  else:
+    dicts = [eT for eTs_k in eTs for eT in eTs_k]
+    N_k = np.array([np.sum([len(eT[terms[0]]) for eT in eTs_k], dtype=int) \
+      for eTs_k in eTs], dtype=int)
+  E = np.zeros((len(terms), np.sum(N_k)))
+  for t in range(len(terms)):
+    if len(dicts) == 1:
+      E[t] = dicts[0][terms[t]]
+    elif len(dicts) > 1:
+      E[t] = np.concatenate([eT[terms[t]] for eT in dicts])
+  return (E, N_k)
+
+
+def u_kn(eTs, protocol, noBeta=False):
+  """Computes reduced energies of all configurations in all states
+
+  Parameters
+  ----------
+  eTs : dict, list of dict, or list of list of dict of np.array
+    Energy terms, as described in u_kln
+  protocol : list of dict
+    Thermodynamic states
+  noBeta : bool
+    If True, the energy will not be divided by RT
+
+  Returns
+  -------
+  u_kn : np.array
+    Reduced energies, with shape (L, N).
+    Configurations are ordered as in energy_matrix.
+  N_k : np.array
+    Number of configurations from each state
+  """
+  (terms, C) = coefficients(protocol, noBeta)
+  (E, N_k) = energy_matrix(eTs, terms)
+  return (np.dot(C, E), N_k)
+
+
+def u_kln(eTs, protocol, noBeta=False):
+  """
+  Computes a reduced potential energy matrix.  k is the sampled state.  l is the state for which energies are evaluated.
+
+  Input:
+  eT is a
+    -dictionary (of mapped energy terms) of numpy arrays (over states)
+    -list (over states) of dictionaries (of mapped energy terms) of numpy arrays (over configurations), or a
+    -list (over states) of lists (over cycles) of dictionaries (of mapped energy terms) of numpy arrays (over configurations)
+  protocol is a list of thermodynamic states
+  noBeta means that the energy will not be divided by RT
+
+  Output: u_kln or (u_kln, N_k)
+  u_kln is the matrix (as a numpy array).
+    For a dictionary, it is indexed by state l and configuration k.
+  N_k is an array of sample sizes
+  """
+  (terms, C) = coefficients(protocol, noBeta)
+  (E, N_k) = energy_matrix(eTs, terms)
+  K = len(N_k)
+  L = len(protocol)
+  if isinstance(eTs, dict):
+    u_kln_ = np.dot(C, E)
+  else:
+    u_kln_ = np.zeros([K, L, N_k.max() if K > 0 else 0])
+    start = 0
+    for k in range(K):
+      u_kln_[k, :, :N_k[k]] = np.dot(C, E[:, start:start + N_k[k]])
+      start += N_k[k]
+
+  if (K == 1) and (L == 1):
+    return u_kln_.ravel()
+  else:
+    return (u_kln_, N_k)
@@ -9,12 +9,8 @@ import MMTK
 import MMTK.Units
 from MMTK.ParticleProperties import Configuration
 
-from AlGDock.BindingPMF import R
 from AlGDock.BindingPMF import scalables
 
-import multiprocessing
-from multiprocessing import Process
-
 class ReplicaExchange():
   """Runs replica exchange
 
@@ -73,138 +69,6 @@ class ReplicaExchange():
     if not process in ['CD', 'BC']:
       raise Exception('Process must be CD or BC')
 
-
-# GMC
-
-    def gMC_initial_setup():
-      """
-      Initialize BAT converter object.
-      Decide which internal coord to crossover. Here, only the soft torsions will be crossovered.
-      Produce a list of replica (state) index pairs to be swaped. Only Neighbor pairs will be swaped.
-      Assume that self.top.universe, self.top.molecule and K (number of states) exist
-      as global variables when the function is called.
-      """
-      from AlGDock.rigid_bodies import identifier
-      import itertools
-      BAT_converter = identifier(self.top.universe, self.top.molecule)
-      BAT = BAT_converter.BAT(extended=True)
-      # this assumes that the torsional angles are stored in the tail of BAT
-      softTorsionId = [
-        i + len(BAT) - BAT_converter.ntorsions
-        for i in BAT_converter._softTorsionInd
-      ]
-      torsions_to_crossover = []
-      for i in range(1, len(softTorsionId)):
-        combinations = itertools.combinations(softTorsionId, i)
-        for c in combinations:
-          torsions_to_crossover.append(list(c))
-      #
-      BAT_converter.BAT_to_crossover = torsions_to_crossover
-      if len(BAT_converter.BAT_to_crossover) == 0:
-        self.log.tee('  GMC No BAT to crossover')
-      state_indices = range(K)
-      state_indices_to_swap = zip( state_indices[0::2], state_indices[1::2] ) + \
-                      zip( state_indices[1::2], state_indices[2::2] )
-      #
-      return BAT_converter, state_indices_to_swap
-
-    #
-    def do_gMC(nr_attempts, BAT_converter, state_indices_to_swap,
-               torsion_threshold):
-      """
-      Assume self.top.universe, confs, protocol, state_inds, inv_state_inds exist as global variables
-      when the function is called.
-      If at least one of the torsions in the combination chosen for an crossover attempt
-      changes more than torsion_threshold, the crossover will be attempted.
-      The function will update confs.
-      It returns the number of attempts and the number of accepted moves.
-      """
-      if nr_attempts < 0:
-        raise Exception('Number of attempts must be nonnegative!')
-      if torsion_threshold < 0.:
-        raise Exception('Torsion threshold must be nonnegative!')
-      #
-      if len(BAT_converter.BAT_to_crossover) == 0:
-        return 0., 0.
-      #
-      from random import randrange
-      # get reduced energies and BAT for all configurations in confs
-      BATs = []
-      energies = np.zeros(K, dtype=float)
-      for c_ind in range(K):
-        s_ind = state_inds[c_ind]
-        self.top.universe.setConfiguration(
-          Configuration(self.top.universe, confs[c_ind]))
-        BATs.append(np.array(BAT_converter.BAT(extended=True), dtype=float))
-        self.system.setParams(protocol[s_ind])
-        reduced_e = self.top.universe.energy() / (R * protocol[s_ind]['T'])
-        energies[c_ind] = reduced_e
-      #
-      nr_sets_of_torsions = len(BAT_converter.BAT_to_crossover)
-      #
-      attempt_count, acc_count = 0, 0
-      sweep_count = 0
-      while True:
-        sweep_count += 1
-        if (sweep_count * K) > (1000 * nr_attempts):
-          self.log.tee(
-            '  GMC Sweep too many times, but few attempted. Consider reducing torsion_threshold.'
-          )
-          return attempt_count, acc_count
-        #
-        for state_pair in state_indices_to_swap:
-          conf_ind_k0 = inv_state_inds[state_pair[0]]
-          conf_ind_k1 = inv_state_inds[state_pair[1]]
-          # check if it should attempt for this pair of states
-          ran_set_torsions = BAT_converter.BAT_to_crossover[randrange(
-            nr_sets_of_torsions)]
-          do_crossover = np.any(
-            np.abs(BATs[conf_ind_k0][ran_set_torsions] -
-                   BATs[conf_ind_k1][ran_set_torsions]) >= torsion_threshold)
-          if do_crossover:
-            attempt_count += 1
-            # BAT and reduced energies before crossover
-            BAT_k0_be = copy.deepcopy(BATs[conf_ind_k0])
-            BAT_k1_be = copy.deepcopy(BATs[conf_ind_k1])
-            e_k0_be = energies[conf_ind_k0]
-            e_k1_be = energies[conf_ind_k1]
-            # BAT after crossover
-            BAT_k0_af = copy.deepcopy(BAT_k0_be)
-            BAT_k1_af = copy.deepcopy(BAT_k1_be)
-            for index in ran_set_torsions:
-              tmp = BAT_k0_af[index]
-              BAT_k0_af[index] = BAT_k1_af[index]
-              BAT_k1_af[index] = tmp
-            # Cartesian coord and reduced energies after crossover.
-            BAT_converter.Cartesian(BAT_k0_af)
-            self.system.setParams(protocol[state_pair[0]])
-            e_k0_af = self.top.universe.energy() / (
-              R * protocol[state_pair[0]]['T'])
-            conf_k0_af = copy.deepcopy(self.top.universe.configuration().array)
-            #
-            BAT_converter.Cartesian(BAT_k1_af)
-            self.system.setParams(protocol[state_pair[1]])
-            e_k1_af = self.top.universe.energy() / (
-              R * protocol[state_pair[1]]['T'])
-            conf_k1_af = copy.deepcopy(self.top.universe.configuration().array)
-            #
-            de = (e_k0_be - e_k0_af) + (e_k1_be - e_k1_af)
-            # update confs, energies, BATS
-            if (de > 0) or (np.random.uniform() < np.exp(de)):
-              acc_count += 1
-              confs[conf_ind_k0] = conf_k0_af
-              confs[conf_ind_k1] = conf_k1_af
-              #
-              energies[conf_ind_k0] = e_k0_af
-              energies[conf_ind_k1] = e_k1_af
-              #
-              BATs[conf_ind_k0] = BAT_k0_af
-              BATs[conf_ind_k1] = BAT_k1_af
-            #
-            if attempt_count == nr_attempts:
-              return attempt_count, acc_count
-
-    #
     self.log.set_lock(process)
 
     confs = self.data[process].confs['replicas']
@@ -250,22 +114,18 @@ class ReplicaExchange():
 
     self.log.recordStart('repX cycle')
 
-    if self.args.cores > 1:
-      # Multiprocessing setup
-      m = multiprocessing.Manager()
-      task_queue = m.Queue()
-      done_queue = m.Queue()
-
     # GMC
-    do_gMC = self.args.params[process]['GMC_attempts'] > 0
-    if do_gMC:
+    use_gMC = self.args.params[process]['GMC_attempts'] > 0
+    if use_gMC:
       self.log.tee('  Using GMC for %s' % process)
-      nr_gMC_attempts = K * self.args.params[process]['GMC_attempts']
       torsion_threshold = self.args.params[process]['GMC_tors_threshold']
-      gMC_attempt_count = 0
-      gMC_acc_count = 0
-      time_gMC = 0.0
-      BAT_converter, state_indices_to_swap = gMC_initial_setup()
+      from AlGDock.torsion_crossover import TorsionCrossover
+      crossover = TorsionCrossover(self.top, self.system, self.log)
+      # Only neighboring pairs of states are crossed over
+      state_indices = range(K)
+      state_indices_to_swap = \
+        zip(state_indices[0::2], state_indices[1::2]) + \
+        zip(state_indices[1::2], state_indices[2::2])
 
     # MC move statistics
     acc = {}
@@ -277,79 +137,151 @@ class ReplicaExchange():
     self.log.timings['repX'] = 0.
 
     mean_energies = []
+    sweep_energies = []
+
+    # Energy terms of the current configuration of each replica
+    E = {}
+    for term in terms:
+      E[term] = np.zeros(K, dtype=float)
+    E = self.system.energyTerms(confs, E, process=process)
 
-    # Do replica exchange
     state_inds = range(K)
     inv_state_inds = range(K)
-    nsweeps = self.args.params[process]['sweeps_per_cycle']
-    nsnaps = nsweeps / self.args.params[process]['snaps_per_cycle']
-    for sweep in range(nsweeps):
-      E = {}
-      for term in terms:
-        E[term] = np.zeros(K, dtype=float)
-      # Sample within each state
-      if self.args.cores > 1:
-        for k in range(K):
-          task_queue.put((confs[k], process, protocol[state_inds[k]], False, k))
-        for p in range(self.args.cores):
-          task_queue.put('STOP')
-        processes = [multiprocessing.Process(target=self.iterator.iteration_worker, \
-            args=(task_queue, done_queue)) for p in range(self.args.cores)]
-        for p in processes:
-          p.start()
-        for p in processes:
-          p.join()
-        unordered_results = [done_queue.get() for k in range(K)]
-        results = sorted(unordered_results, key=lambda d: d['reference'])
-        for p in processes:
-          p.terminate()
-      else:
-        # Single process code
-        results = [self.iterator.iteration(confs[k], process, \
-            protocol[state_inds[k]], False, k) for k in range(K)]
 
-      # GMC
-      if do_gMC:
-        time_start_gMC = time.time()
-        att_count, acc_count = do_gMC(nr_gMC_attempts, BAT_converter,
-                                      state_indices_to_swap, torsion_threshold)
-        gMC_attempt_count += att_count
-        gMC_acc_count += acc_count
-        time_gMC = +(time.time() - time_start_gMC)
-
-      # Store energies
-      for k in range(K):
-        confs[k] = results[k]['confs']
-      mean_energies.append(np.mean([results[k]['Etot'] for k in range(K)]))
-      E = self.system.energyTerms(confs, E, process=process)
-
-      # Store MC move statistics
-      for k in range(K):
+    def record(replicas, results, E_new):
+      """
+      Stores configurations, energy terms, and MC move statistics
+      from iterations of the replicas
+      """
+      for i in range(len(replicas)):
+        k = replicas[i]
+        confs[k] = results[i]['confs']
+        sweep_energies.append(results[i]['Etot'])
+        for term in E_new.keys():
+          E[term][k] = E_new[term][i]
         for move_type in ['ExternalMC', 'SmartDarting', 'Sampler']:
           key = 'acc_' + move_type
-          if key in results[k].keys():
-            acc[move_type][state_inds[k]] += results[k][key]
-            att[move_type][state_inds[k]] += results[k]['att_' + move_type]
-            self.log.timings[move_type] += results[k]['time_' + move_type]
+          if key in results[i].keys():
+            acc[move_type][state_inds[k]] += results[i][key]
+            att[move_type][state_inds[k]] += results[i]['att_' + move_type]
+            self.log.timings[move_type] += results[i]['time_' + move_type]
 
+    def exchange(replicas):
+      """
+      Performs GMC and replica exchange between the states of the replicas.
+      Other replicas may be running, so their states are left alone.
+      """
+      n = len(replicas)
+      if n < 2:
+        return
+      in_group = set(replicas)
+      # GMC
+      if use_gMC:
+        pairs = [(s0, s1) for (s0, s1) in state_indices_to_swap \
+          if (inv_state_inds[s0] in in_group) and \
+             (inv_state_inds[s1] in in_group)]
+        if len(pairs) > 0:
+          time_start_gMC = time.time()
+          (att_count, acc_count, changed) = crossover(confs, \
+            state_inds, inv_state_inds, protocol, pairs, \
+            n * self.args.params[process]['GMC_attempts'], torsion_threshold)
+          gMC_counts[0] += att_count
+          gMC_counts[1] += acc_count
+          gMC_counts[2] += (time.time() - time_start_gMC)
+          if len(changed) > 0:
+            E_new = self.system.energyTerms([confs[k] for k in changed], \
+              process=process)
+            for term in E_new.keys():
+              E[term][changed] = E_new[term]
+
+      # Replica exchange within the group, with states renumbered locally
+      repX_start_time = time.time()
+      states = sorted([state_inds[k] for k in replicas])
+      local = dict([(states[i], i) for i in range(n)])
+      local_state_inds = [local[state_inds[k]] for k in replicas]
+      local_inv_state_inds = [0] * n
+      for i in range(n):
+        local_inv_state_inds[local_state_inds[i]] = i
+      local_pairs = [(local[s0], local[s1]) for (s0, s1) in pairs_to_swap \
+        if (s0 in local) and (s1 in local)]
       # Calculate u_ij (i is the replica, and j is the configuration),
       #    a list of arrays
-      (u_ij, N_k) = self._u_kln(E, [protocol[state_inds[c]] for c in range(K)])
-      # Do the replica exchange
-      repX_start_time = time.time()
-      (state_inds, inv_state_inds) = \
-        attempt_swaps(state_inds, inv_state_inds, u_ij, pairs_to_swap, \
-          self.args.params[process]['attempts_per_sweep'])
+      E_group = dict([(term, E[term][replicas]) for term in E.keys()])
+      (u_ij, N_k) = self._u_kln(E_group, \
+        [protocol[state_inds[k]] for k in replicas])
+      (local_state_inds, local_inv_state_inds) = \
+        attempt_swaps(local_state_inds, local_inv_state_inds, u_ij, \
+          local_pairs, self.args.params[process]['attempts_per_sweep'], \
+          self.args.params[process]['swap_scheme'])
+      for i in range(n):
+        state_inds[replicas[i]] = states[local_state_inds[i]]
+        inv_state_inds[states[local_state_inds[i]]] = replicas[i]
       self.log.timings['repX'] += (time.time() - repX_start_time)
 
-      # Store data in local variables
-      if (sweep + 1) % self.args.params[process]['snaps_per_cycle'] == 0:
+    def end_sweep(sweep):
+      """
+      Stores data in local variables after K iterations
+      """
+      mean_energies.append(np.mean(sweep_energies))
+      del sweep_energies[:]
+      if sweep % self.args.params[process]['snaps_per_cycle'] == 0:
         storage['confs'].append(list(confs))
         storage['state_inds'].append(list(state_inds))
         storage['energies'].append(copy.deepcopy(E))
 
+    # Do replica exchange
+    # GMC attempts, accepted moves, and time
+    gMC_counts = [0, 0, 0.]
+    nsweeps = self.args.params[process]['sweeps_per_cycle']
+    nsnaps = nsweeps / self.args.params[process]['snaps_per_cycle']
+    if self.args.cores > 1:
+      # Replicas are run asynchronously by a persistent pool of workers.
+      # When a worker is free, the replicas waiting to run exchange states
+      # and are resubmitted. Unless no replicas are running,
+      # at least two must be waiting so that they can exchange.
+      # A sweep is counted after K iterations.
+      from AlGDock.replica_pool import ReplicaPool
+      pool = ReplicaPool(self.iterator, self.system, self.args.cores, \
+        process, protocol, K, confs[0].shape[0], E.keys())
+      iterations = np.zeros(K, dtype=int)
+      nbatches = 2 * self.args.cores
+      waiting = range(K)
+      ncompleted = 0
+      while ncompleted < K * nsweeps:
+        if (len(waiting) > 0) and ((pool.ntasks == 0) or \
+            ((pool.ntasks < self.args.cores) and (len(waiting) > 1))):
+          exchange(waiting)
+          # Each task runs a batch of replicas together
+          for batch in np.array_split(waiting, min(len(waiting), nbatches)):
+            batch = [int(k) for k in batch]
+            pool.submit(batch, [confs[k] for k in batch], \
+              [state_inds[k] for k in batch])
+          waiting = []
+        (results, E_new) = pool.get()
+        replicas = [r['reference'] for r in results]
+        record(replicas, results, E_new)
+        for k in replicas:
+          iterations[k] += 1
+          ncompleted += 1
+          if ncompleted % K == 0:
+            end_sweep(ncompleted / K)
+          if iterations[k] < nsweeps:
+            waiting.append(k)
+      pool.close()
+    else:
+      # Single process code
+      for sweep in range(nsweeps):
+        results = self.iterator.iteration_chains(confs, process, \
+            [protocol[state_inds[k]] for k in range(K)], False, range(K))
+        E_new = self.system.energyTerms([r['confs'] for r in results], \
+          process=process)
+        record(range(K), results, E_new)
+        exchange(range(K))
+        end_sweep(sweep + 1)
+
     # GMC
-    if do_gMC:
+    if use_gMC:
+      (gMC_attempt_count, gMC_acc_count, time_gMC) = gMC_counts
       self.log.tee('  {0}/{1} crossover attempts ({2:.3g}) accepted in {3}'.format(\
         gMC_acc_count, gMC_attempt_count, \
         float(gMC_acc_count)/float(gMC_attempt_count) \
@@ -371,7 +303,8 @@ class ReplicaExchange():
     self.log.tee(MC_report)
 
     # Adapt HamiltonianMonteCarlo parameters
-    if self.args.params[process]['sampler'] == 'HMC':
+    if self.args.params[process]['sampler'] in \
+        ['HMC', 'RESPA', 'TorsionalHMC']:
       acc_rates = np.array(acc['Sampler'], dtype=np.float) / att['Sampler']
       for k in range(K):
         acc_rate = acc_rates[k]
@@ -430,7 +363,7 @@ class ReplicaExchange():
     if self.args.params[process]['darts_per_sweep'] > 0:
       self.system.setParams(self.data[process].protocol[-1])
       new_confs = [np.copy(conf) \
-        for conf in data[process].confs['samples'][k][-1]]
+        for conf in self.data[process].confs['samples'][k][-1]]
       self.iterator.addSmartDartingConfigurations(new_confs, process,
                                                   self.log, self.data)
 
@@ -0,0 +1,168 @@
+# A persistent pool of processes for replica exchange
+#
+# Workers are forked once per replica exchange cycle, after the grids
+# and samplers have been loaded, so they inherit the universe, force fields,
+# and Smart Darting configurations of the parent and keep them resident
+# between tasks.
+# Each task is a group of replicas. Along with the iteration results,
+# workers return the energy terms of the final configurations,
+# which is all that is needed to evaluate the energy in every state.
+#
+# The configuration, state index, total energy, and energy terms of each
+# replica are stored in a slot of a shared memory arena,
+# which is mapped into every worker when it is forked.
+# Workers read and write the slots of their replicas in place,
+# so only replica indices and MC move statistics pass through the queues.
+# A slot is only written by the parent while its replica is waiting,
+# and by a worker while its replica is running.
+
+import multiprocessing
+import traceback
+
+import numpy as np
+
+
+class ReplicaPool:
+  """Persistent worker processes that perform replica exchange iterations
+
+  Attributes
+  ----------
+  iterator : AlGDock.simulation_iterator.SimulationIterator
+    Performs iterations
+  system : AlGDock.system.System
+    Simulation system, which calculates energy terms
+  process : str
+    Process, either 'BC' or 'CD'
+  protocol : list of dict
+    Thermodynamic states
+  terms : list of str
+    Energy terms that are stored for each replica
+  confs : np.array
+    Shared configuration of each replica, with shape (K, natoms, 3)
+  state_inds : np.array
+    Shared state index of each replica
+  Etot : np.array
+    Shared total energy of each replica
+  E : np.array
+    Shared energy terms of each replica, with shape (K, len(terms))
+  ntasks : int
+    The number of submitted tasks that have not been collected
+  """
+  def __init__(self, iterator, system, cores, process, protocol, \
+      K, natoms, terms):
+    """Allocates the shared memory arena and starts the worker processes
+
+    Parameters
+    ----------
+    iterator : AlGDock.simulation_iterator.SimulationIterator
+      Performs iterations
+    system : AlGDock.system.System
+      Simulation system
+    cores : int
+      Number of worker processes
+    process : str
+      Process, either 'BC' or 'CD'
+    protocol : list of dict
+      Thermodynamic states
+    K : int
+      Number of replicas
+    natoms : int
+      Number of atoms in each configuration
+    terms : list of str
+      Energy terms to store
+    """
+    self.iterator = iterator
+    self.system = system
+    self.process = process
+    self.protocol = protocol
+    self.terms = list(terms)
+    self.ntasks = 0
+
+    def shared(typecode, shape):
+      raw = multiprocessing.RawArray(typecode, int(np.prod(shape)))
+      return np.ctypeslib.as_array(raw).reshape(shape)
+
+    self.confs = shared('d', (K, natoms, 3))
+    self.state_inds = shared('i', (K, ))
+    self.Etot = shared('d', (K, ))
+    self.E = shared('d', (K, len(self.terms)))
+
+    self._task_queue = multiprocessing.Queue()
+    self._done_queue = multiprocessing.Queue()
+    self._processes = [multiprocessing.Process(target=self._worker) \
+      for p in range(cores)]
+    for p in self._processes:
+      p.daemon = True
+      p.start()
+
+  def _worker(self):
+    """Executes tasks until it receives 'STOP'
+    """
+    for references in iter(self._task_queue.get, 'STOP'):
+      try:
+        results = self.iterator.iteration_chains(\
+          [self.confs[k] for k in references], self.process, \
+          [self.protocol[self.state_inds[k]] for k in references], \
+          False, references)
+        E = self.system.energyTerms([r['confs'] for r in results], \
+          process=self.process)
+        stats = []
+        for i in range(len(references)):
+          k = references[i]
+          self.confs[k] = results[i].pop('confs')
+          self.Etot[k] = results[i].pop('Etot')
+          for t in range(len(self.terms)):
+            if self.terms[t] in E.keys():
+              self.E[k, t] = E[self.terms[t]][i]
+          stats.append(results[i])
+        self._done_queue.put(stats)
+      except Exception:
+        self._done_queue.put(traceback.format_exc())
+
+  def submit(self, references, seeds, state_inds):
+    """Queues iterations for a group of replicas
+
+    Parameters
+    ----------
+    references : list of int
+      Index of each replica
+    seeds : list of np.array
+      Starting configuration for each replica
+    state_inds : list of int
+      Thermodynamic state of each replica
+    """
+    for i in range(len(references)):
+      self.confs[references[i]] = seeds[i]
+      self.state_inds[references[i]] = state_inds[i]
+    self._task_queue.put(list(references))
+    self.ntasks += 1
+
+  def get(self):
+    """Waits for a task to complete
+
+    Returns
+    -------
+    results : list of dict
+      Results for each replica, as returned by iteration
+    E : dict of np.array
+      Energy terms of the final configuration of each replica
+    """
+    output = self._done_queue.get()
+    self.ntasks -= 1
+    if isinstance(output, str):
+      raise Exception('Replica exchange worker failed:\n' + output)
+    references = [r['reference'] for r in output]
+    for r in output:
+      r['confs'] = np.copy(self.confs[r['reference']])
+      r['Etot'] = self.Etot[r['reference']]
+    E = dict([(self.terms[t], self.E[references, t]) \
+      for t in range(len(self.terms))])
+    return (output, E)
+
+  def close(self):
+    """Stops the worker processes
+    """
+    for p in self._processes:
+      self._task_queue.put('STOP')
+    for p in self._processes:
+      p.join()
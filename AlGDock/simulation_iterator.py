@@ -5,6 +5,8 @@ import numpy as np
 
 import time
 
+from AlGDock.coordinates import set_coordinates
+
 
 class SimulationIterator:
   """SimulationIterators take a molecular configuration and generate a new one.
@@ -54,12 +56,20 @@ class SimulationIterator:
 
     for p in ['BC', 'CD']:
       if self.args.params[p]['sampler'] == 'HMC':
-        from AlGDock.Integrators.HamiltonianMonteCarlo.HamiltonianMonteCarlo \
-          import HamiltonianMonteCarloIntegrator
+        # Uses cython class
+        from HMC import HamiltonianMonteCarloIntegrator  # @UnresolvedImport
         self._samplers[p] = HamiltonianMonteCarloIntegrator(self.top.universe)
       elif self.args.params[p]['sampler'] == 'NUTS':
         from NUTS import NUTSIntegrator  # @UnresolvedImport
         self._samplers[p] = NUTSIntegrator(self.top.universe)
+      elif self.args.params[p]['sampler'] == 'RESPA':
+        from AlGDock.Integrators.RESPA.RESPA import RESPAIntegrator
+        self._samplers[p] = RESPAIntegrator(self.top.universe)
+      elif self.args.params[p]['sampler'] == 'TorsionalHMC':
+        from AlGDock.Integrators.TorsionalHMC.TorsionalHMC \
+          import TorsionalHMCIntegrator
+        self._samplers[p] = TorsionalHMCIntegrator(\
+          self.top.universe, self.top.molecule)
       elif self.args.params[p]['sampler'] == 'VV':
         from AlGDock.Integrators.VelocityVerlet.VelocityVerlet \
           import VelocityVerletIntegrator
@@ -84,6 +94,135 @@ class SimulationIterator:
     self.top.universe.setConfiguration(Configuration(self.top.universe, seed))
 
     self.system.setParams(params_k)
+    (delta_t, steps_per_trial, steps, ndarts, random_seed) = \
+      self._settings(seed, process, params_k, initialize, reference)
+
+    results = {}
+
+    # Execute external MCMC moves
+    self._ExternalMC(process, params_k, results)
+
+    # Execute dynamics sampler
+    time_start_sampler = time.time()
+    sampler_options = {}
+    if self.args.params[process]['sampler'] == 'NUTS':
+      sampler_options['metric'] = self.args.params[process]['metric']
+      if 'inv_metric' in params_k.keys():
+        sampler_options['inv_metric'] = params_k['inv_metric']
+    elif self.args.params[process]['sampler'] == 'RESPA':
+      sampler_options['inner_steps'] = self.args.params[process]['inner_steps']
+      sampler_options['evaluators'] = self.system.groupEvaluators()
+    dat = self._samplers[process](\
+      steps=steps, steps_per_trial=steps_per_trial, \
+      T=params_k['T'], delta_t=delta_t, \
+      normalize=(process=='BC'), adapt=initialize, random_seed=random_seed, \
+      **sampler_options)
+    results['acc_Sampler'] = dat[2]
+    results['att_Sampler'] = dat[3]
+    results['delta_t'] = dat[4]
+    if initialize and ('metric' in sampler_options.keys()) and \
+        (sampler_options['metric'] != 'mass'):
+      results['inv_metric'] = dat[5]
+    results['time_Sampler'] = (time.time() - time_start_sampler)
+    (conf, Etot) = (dat[0][-1], dat[1][-1])
+
+    # Execute smart darting
+    dat = self._SmartDarting(process, params_k, ndarts, random_seed, results)
+    if dat is not None:
+      (conf, Etot) = (dat[0][-1], dat[1][-1])
+
+    # Store and return results
+    results['confs'] = np.copy(conf)
+    results['Etot'] = Etot
+    results['reference'] = reference
+
+    return results
+
+  def iteration_chains(self, seeds, process, params, \
+      initialize=False, references=None):
+    """Performs an iteration for several thermodynamic states
+
+    With the HMC sampler, the dynamics of all the states are
+    run in lockstep by a single multiple chain integrator.
+    Otherwise, iterations are performed one state at a time.
+
+    Parameters
+    ----------
+    seeds : list of np.array
+      Starting configuration for each state
+    process : str
+      Process, either 'BC' or 'CD'
+    params : list of dict of float
+      Parameters describing each thermodynamic state
+    references : list of int
+      Reference for each state, which is stored in the results
+
+    Returns
+    -------
+    results : list of dict
+      Results for each state, as returned by iteration
+    """
+    K = len(seeds)
+    if references is None:
+      references = range(K)
+    if self.args.params[process]['sampler'] != 'HMC':
+      return [self.iteration(seeds[k], process, params[k], \
+        initialize, references[k]) for k in range(K)]
+
+    if not '_MultiChainHMC' in self._samplers.keys():
+      from AlGDock.Integrators.HamiltonianMonteCarlo.MultiChainHMC \
+        import MultiChainHMCIntegrator
+      self._samplers['_MultiChainHMC'] = \
+        MultiChainHMCIntegrator(self.top.universe)
+
+    results = [{} for k in range(K)]
+    settings = []
+    confs = []
+    evaluators = []
+    for k in range(K):
+      set_coordinates(self.top.universe, seeds[k])
+      evaluators.append(self.system.evaluator(params[k]))
+      settings.append(\
+        self._settings(seeds[k], process, params[k], initialize, references[k]))
+      # Execute external MCMC moves
+      self._ExternalMC(process, params[k], results[k])
+      confs.append(np.copy(self.top.universe.configuration().array))
+
+    # Execute dynamics sampler for all states
+    time_start_sampler = time.time()
+    dat = self._samplers['_MultiChainHMC'](confs, evaluators, \
+      T=[params[k]['T'] for k in range(K)], \
+      delta_t=[settings[k][0] for k in range(K)], \
+      steps=settings[0][2], \
+      steps_per_trial=[settings[k][1] for k in range(K)], \
+      normalize=(process=='BC'), random_seed=settings[0][4])
+    time_sampler = (time.time() - time_start_sampler)/K
+
+    for k in range(K):
+      results[k]['acc_Sampler'] = dat[2][k]
+      results[k]['att_Sampler'] = dat[3][k]
+      results[k]['delta_t'] = dat[4][k]
+      results[k]['time_Sampler'] = time_sampler
+      (conf, Etot) = (dat[0][k], dat[1][k])
+
+      # Execute smart darting
+      set_coordinates(self.top.universe, conf)
+      self.system.setParams(params[k])
+      dat_k = self._SmartDarting(process, params[k], \
+        settings[k][3], settings[k][4], results[k])
+      if dat_k is not None:
+        (conf, Etot) = (dat_k[0][-1], dat_k[1][-1])
+
+      # Store results
+      results[k]['confs'] = np.copy(conf)
+      results[k]['Etot'] = Etot
+      results[k]['reference'] = references[k]
+
+    return results
+
+  def _settings(self, seed, process, params_k, initialize, reference):
+    """Returns the time step, steps per trial, steps, darts, and random seed
+    """
     if 'delta_t' in params_k.keys():
       delta_t = params_k['delta_t']
     else:
@@ -106,29 +245,25 @@ class SimulationIterator:
     else:
       random_seed += int(time.time() * 1000)
 
-    results = {}
+    return (delta_t, steps_per_trial, steps, ndarts, random_seed)
 
-    # Execute external MCMC moves
+  def _ExternalMC(self, process, params_k, results):
+    """Executes external MCMC moves, if appropriate for the state
+    """
     if (process == 'CD') and (self.args.params['CD']['MCMC_moves']>0) \
         and (params_k['alpha'] < 0.1) and (self.args.params['CD']['pose']==-1):
       time_start_ExternalMC = time.time()
-      dat = self._samplers['ExternalMC'](ntrials=5, T=params_k['T'])
+      dat = self._samplers['ExternalMC'](ntrials=5, T=params_k['T'], \
+        screen=self.system.screeningGrids(params_k), ntries=8)
       results['acc_ExternalMC'] = dat[2]
       results['att_ExternalMC'] = dat[3]
       results['time_ExternalMC'] = (time.time() - time_start_ExternalMC)
 
-    # Execute dynamics sampler
-    time_start_sampler = time.time()
-    dat = self._samplers[process](\
-      steps=steps, steps_per_trial=steps_per_trial, \
-      T=params_k['T'], delta_t=delta_t, \
-      normalize=(process=='BC'), adapt=initialize, random_seed=random_seed)
-    results['acc_Sampler'] = dat[2]
-    results['att_Sampler'] = dat[3]
-    results['delta_t'] = dat[4]
-    results['time_Sampler'] = (time.time() - time_start_sampler)
+  def _SmartDarting(self, process, params_k, ndarts, random_seed, results):
+    """Executes smart darting, if appropriate for the state
 
-    # Execute smart darting
+    Returns the output of the smart darting sampler, or None
+    """
     if (ndarts > 0) and not ((process == 'CD') and (params_k['alpha'] < 0.1)):
       time_start_SmartDarting = time.time()
       dat = self._samplers[process+'_SmartDarting'](\
@@ -136,13 +271,8 @@ class SimulationIterator:
       results['acc_SmartDarting'] = dat[2]
       results['att_SmartDarting'] = dat[3]
       results['time_SmartDarting'] = (time.time() - time_start_SmartDarting)
-
-    # Store and return results
-    results['confs'] = np.copy(dat[0][-1])
-    results['Etot'] = dat[1][-1]
-    results['reference'] = reference
-
-    return results
+      return dat
+    return None
 
   def iteration_worker(self, input, output):
     """Executes an iteration from a multiprocessing queue
@@ -191,10 +321,9 @@ class SimulationIterator:
       Location for minimized configurations
     """
     if self.args.params[process]['darts_per_seed'] > 0:
-      confs_SmartDarting = [np.copy(conf) \
-        for conf in data[process].confs['samples'][k][-1]]
+      # Existing targets are not minimized again
       outstr = self._samplers[process+'_SmartDarting'].set_confs(\
-        new_confs + data[process].confs['SmartDarting'])
+        new_confs, append=True)
       data[process].confs['SmartDarting'] = \
         self._samplers[process+'_SmartDarting'].confs
       log.tee(outstr)
@@ -10,6 +10,7 @@ from MMTK.ForceFields import ForceField
 from AlGDock.BindingPMF import scalables
 from AlGDock.BindingPMF import R
 from AlGDock.BindingPMF import HMStime
+from AlGDock.coordinates import energy_terms
 
 term_map = {
   'cosine dihedral angle': 'MM',
@@ -111,7 +112,7 @@ class System:
 
     # Reuse evaluators that have been stored
     evaluator_key = ','.join(['%s:%s'%(k,params[k]) \
-      for k in sorted(params.keys())])
+      for k in sorted(params.keys()) if k!='inv_metric'])
     if evaluator_key in self._evaluators.keys():
       self.top.universe._evaluator[(None,None,None)] = \
         self._evaluators[evaluator_key]
@@ -275,9 +276,58 @@ class System:
     eval = ForceField.EnergyEvaluator(\
       self.top.universe, self.top.universe._forcefield, None, None, None, None)
     eval.key = evaluator_key
+    # For multiple time step integrators, the intramolecular force field
+    # is fast and the binding site, grid, OBC, and restraint terms are slow
+    gaff = self._forceFields['gaff']
+    eval.ff_groups = ([ff for ff in fflist if ff is gaff], \
+                      [ff for ff in fflist if ff is not gaff])
+    # Group evaluators are only needed by the RESPA sampler. They are built
+    # now because the grid strengths are fixed when an evaluator is created
+    if 'RESPA' in [self.args.params[p]['sampler'] for p in ['BC', 'CD']]:
+      group_evaluators = []
+      for ff_group in eval.ff_groups:
+        if len(ff_group) == 0:
+          group_evaluators.append(None)
+          continue
+        compoundFF = ff_group[0]
+        for ff in ff_group[1:]:
+          compoundFF += ff
+        group_evaluators.append(ForceField.EnergyEvaluator(\
+          self.top.universe, compoundFF, None, None, None, None))
+      eval.group_evaluators = tuple(group_evaluators)
     self.top.universe._evaluator[(None, None, None)] = eval
     self._evaluators[evaluator_key] = eval
 
+  def evaluator(self, params):
+    """Returns the energy evaluator for params
+
+    The universe is left with this evaluator.
+    """
+    self.setParams(params)
+    return self.top.universe._evaluator[(None, None, None)]
+
+  def screeningGrids(self, params):
+    """Returns the repulsive grid force fields that are active for params
+
+    These grids are cheap to evaluate for many configurations at once,
+    so they are used to prescreen rigid body moves.
+    """
+    return [self._forceFields[key] for key in ['sLJr', 'LJr'] \
+      if (key in params.keys()) and (params[key] > 0) \
+        and (key in self._forceFields.keys())]
+
+  def groupEvaluators(self):
+    """Returns evaluators for the fast and slow terms of the force field
+
+    The fast group is the intramolecular force field (gaff).
+    The slow group contains all other terms.
+    An evaluator is None if its group is empty.
+    Evaluators are built and stored with the evaluator
+    for the full force field in setParams when a process uses RESPA.
+    """
+    eval = self.top.universe._evaluator[(None, None, None)]
+    return eval.group_evaluators
+
   def energyTerms(self, confs, E=None, process='CD'):
     """Calculates energy terms for a series of configurations
 
@@ -324,9 +374,7 @@ class System:
         E['k_angular_ext'] = np.zeros(len(confs), dtype=float)
         E['k_spatial_ext'] = np.zeros(len(confs), dtype=float)
     for c in range(len(confs)):
-      self.top.universe.setConfiguration(
-        Configuration(self.top.universe, confs[c]))
-      eT = self.top.universe.energyTerms()
+      eT = energy_terms(self.top.universe, confs[c])
       for (key, value) in eT.iteritems():
         if key == 'electrostatic':
           pass  # For some reason, MMTK double-counts electrostatic energies
@@ -0,0 +1,39 @@
+# Compares the EXP and BAR estimators against pymbar
+# on a random sample of reduced work
+
+import numpy as np
+import pymbar
+
+from estimators import EXP, BAR, bootstrap_EXP, bootstrap_BAR
+
+w_F = np.random.randn(5000) * 2. + 3.
+w_R = np.random.randn(3000) * 2. - 1.
+
+min_w_F = min(w_F)
+f_EXP = -np.log(np.mean(np.exp(-w_F + min_w_F))) + min_w_F
+f_pymbar_EXP = pymbar.EXP(w_F)[0]
+f_pymbar_BAR = pymbar.BAR(w_F, w_R, relative_tolerance=1.0E-10, \
+  verbose=False, compute_uncertainty=False)
+
+print 'EXP: %f, pymbar: %f' % (EXP(w_F), f_pymbar_EXP)
+print 'BAR: %f, pymbar: %f' % (BAR(w_F, w_R), f_pymbar_BAR)
+if abs(EXP(w_F) - f_EXP) > 1.0E-8 or abs(EXP(w_F) - f_pymbar_EXP) > 1.0E-8:
+  raise Exception('EXP differs from pymbar')
+if abs(BAR(w_F, w_R) - f_pymbar_BAR) > 1.0E-6:
+  raise Exception('BAR differs from pymbar')
+
+# Samples with infinite work, e.g. from clashing poses, contribute nothing
+w_F_inf = np.append(w_F, np.inf)
+w_R_inf = np.append(w_R, np.inf)
+f_EXP_inf = -np.log(np.mean(np.exp(-w_F_inf + min_w_F))) + min_w_F
+print 'EXP with infinite work: %f, reference: %f' % \
+  (EXP(w_F_inf), f_EXP_inf)
+if abs(EXP(w_F_inf) - f_EXP_inf) > 1.0E-8:
+  raise Exception('EXP is incorrect with infinite work')
+if not np.isfinite(BAR(w_F_inf, w_R_inf)):
+  raise Exception('BAR is not finite with infinite work')
+for scheme in ['multinomial', 'poisson']:
+  if not np.all(np.isfinite(bootstrap_EXP(w_F_inf, scheme=scheme))):
+    raise Exception('Bootstrap EXP is not finite with infinite work')
+  if not np.all(np.isfinite(bootstrap_BAR(w_F_inf, w_R_inf, scheme=scheme))):
+    raise Exception('Bootstrap BAR is not finite with infinite work')
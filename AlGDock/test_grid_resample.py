@@ -0,0 +1,46 @@
+# Compares Grid.resample against Grid.truncate on dx grids.
+# When the new grid is on the lattice of the finest level,
+# resampling should reproduce truncation.
+
+import os
+import shutil
+import tempfile
+
+import numpy as np
+import AlGDock.IO
+
+IO_Grid = AlGDock.IO.Grid()
+dir = tempfile.mkdtemp()
+FN = lambda name: os.path.join(dir, name)
+
+# A focus level offset from the origin by a whole number of points
+# and a coarse level that contains it
+spacing = 0.5 * np.ones(3)
+counts = np.array([10, 9, 8])
+focus = {'origin':-2 * spacing, 'spacing':spacing, \
+  'counts':np.array([13, 12, 11])}
+focus['vals'] = np.random.randn(np.prod(focus['counts']))
+full = {'origin':-4 * spacing, 'spacing':2 * spacing, \
+  'counts':np.array([8, 8, 8])}
+full['vals'] = np.random.randn(np.prod(full['counts']))
+IO_Grid.write(FN('focus.dx'), focus)
+IO_Grid.write(FN('full.dx'), full)
+
+IO_Grid.truncate(FN('focus.dx'), FN('truncated.dx'), counts, \
+  multiplier=0.596)
+truncated = IO_Grid.read(FN('truncated.dx'))
+
+for order in [1, 3]:
+  # A small chunk size so that the grid is written in several chunks
+  IO_Grid.resample([FN('focus.dx'), FN('full.dx')], FN('resampled.dx'), \
+    counts, spacing, multiplier=0.596, order=order, chunk_size=30)
+  resampled = IO_Grid.read(FN('resampled.dx'))
+  for key in ['origin', 'spacing', 'counts']:
+    if not np.allclose(resampled[key], truncated[key]):
+      raise Exception('Resampled %s differs from truncation' % key)
+  error = np.max(np.abs(resampled['vals'] - truncated['vals']))
+  print 'Order %d: maximum difference from truncation is %g' % (order, error)
+  if error > 1.0E-5:
+    raise Exception('Resampled values differ from truncation')
+
+shutil.rmtree(dir)
@@ -0,0 +1,225 @@
+# Generalized Monte Carlo (GMC) moves that cross over soft torsions
+# between the configurations in pairs of thermodynamic states
+#
+# Pairs of states are divided into rounds in which no state appears twice,
+# so that the crossovers within a round are independent.
+# For every pair in a round, a random nonempty and incomplete subset of
+# the soft torsions is chosen. If any of these torsions differs by at least
+# a threshold, the subset is crossed over. This proposal is symmetric,
+# so it is accepted with the Metropolis criterion on the reduced energies.
+# All the proposals of a round are converted to Cartesian coordinates
+# together by the native BAT converter. Their energies are evaluated
+# with an evaluator for each state, without resetting the parameters of
+# the universe for every configuration.
+
+import numpy as np
+
+from AlGDock.BindingPMF import R
+
+
+class TorsionCrossover:
+  """Crosses over soft torsions between replicas
+
+  Attributes
+  ----------
+  top : AlGDock.topology.Topology
+    Topology of the ligand
+  system : AlGDock.system.System
+    Simulation system
+  log : AlGDock.logger.Logger
+    Simulation log
+  converter : BAT.converter
+    Converts between Cartesian and extended Bond-Angle-Torsion coordinates
+  torsions : np.array
+    Indices of soft torsions in the extended BAT array
+  """
+  def __init__(self, top, system, log):
+    """Initializes the class
+
+    Parameters
+    ----------
+    top : AlGDock.topology.Topology
+      Topology of the ligand
+    system : AlGDock.system.System
+      Simulation system
+    log : AlGDock.logger.Logger
+      Simulation log
+    """
+    from AlGDock.rigid_bodies import identifier
+    from BAT import converter
+
+    self.top = top
+    self.system = system
+    self.log = log
+
+    id = identifier(self.top.universe, self.top.molecule)
+    self.converter = converter(self.top.universe, self.top.molecule, \
+      initial_atom=id.initial_atom)
+    # In the extended BAT array, torsion i is at index 6 + 3*i + 5
+    self.torsions = np.array([6 + 3*i + 5 for i in id._softTorsionInd], \
+      dtype=int)
+    if len(self.torsions) < 2:
+      self.log.tee('  GMC No BAT to crossover')
+
+    self._natoms = self.top.universe.numberOfAtoms()
+    self._nBAT = 3 * self._natoms
+    self._buffers = {}
+
+  def _buffer(self, name, shape):
+    """Returns a preallocated array with at least shape[0] rows
+    """
+    if (not name in self._buffers.keys()) or \
+        (self._buffers[name].shape[0] < shape[0]):
+      self._buffers[name] = np.zeros(shape)
+    return self._buffers[name][:shape[0]]
+
+  def _energies(self, X, states, evaluators, RT, u):
+    """Stores the reduced energy of each configuration in its state in u
+    """
+    x = self.top.universe.configuration().array
+    for i in range(len(states)):
+      x[:] = X[i]
+      u[i] = evaluators[states[i]]() / RT[states[i]]
+
+  def _crossover_masks(self, npairs):
+    """Returns which BAT coordinates to cross over for each pair
+
+    Subsets of soft torsions are drawn uniformly from those that include
+    at least one, but not all, of the soft torsions.
+    """
+    ntorsions = len(self.torsions)
+    bits = np.random.random((npairs, ntorsions)) < 0.5
+    redraw = np.nonzero(np.all(bits, 1) | np.logical_not(np.any(bits, 1)))[0]
+    while len(redraw) > 0:
+      bits[redraw] = np.random.random((len(redraw), ntorsions)) < 0.5
+      redraw = redraw[np.all(bits[redraw], 1) | \
+        np.logical_not(np.any(bits[redraw], 1))]
+    masks = np.zeros((npairs, self._nBAT), dtype=bool)
+    masks[:, self.torsions] = bits
+    return masks
+
+  def __call__(self, confs, state_inds, inv_state_inds, protocol, \
+      pairs, nattempts, torsion_threshold):
+    """Attempts torsion crossovers between pairs of states
+
+    Parameters
+    ----------
+    confs : list of np.array
+      The configuration of each replica, which is updated
+    state_inds : list of int
+      The state of each replica
+    inv_state_inds : list of int
+      The replica in each state
+    protocol : list of dict
+      Thermodynamic states
+    pairs : list of (int, int)
+      Pairs of states
+    nattempts : int
+      Number of crossovers to attempt
+    torsion_threshold : float
+      A crossover is only attempted if at least one of the chosen torsions
+      differs by at least torsion_threshold
+
+    Returns
+    -------
+    attempt_count : int
+      Number of attempted crossovers
+    acc_count : int
+      Number of accepted crossovers
+    changed : list of int
+      Replicas with new configurations
+    """
+    if nattempts < 0:
+      raise Exception('Number of attempts must be nonnegative!')
+    if torsion_threshold < 0.:
+      raise Exception('Torsion threshold must be nonnegative!')
+    if (len(self.torsions) < 2) or (len(pairs) == 0) or (nattempts == 0):
+      return (0, 0, [])
+
+    # Replicas in the pairs, and their local indices
+    replicas = sorted(set([inv_state_inds[s] for pair in pairs \
+      for s in pair]))
+    local = dict([(replicas[i], i) for i in range(len(replicas))])
+    n = len(replicas)
+    states = np.array([state_inds[c] for c in replicas], dtype=int)
+
+    # Divide the pairs into rounds in which no replica appears twice
+    rounds = []
+    for (s0, s1) in pairs:
+      (i0, i1) = (local[inv_state_inds[s0]], local[inv_state_inds[s1]])
+      for r in rounds:
+        if not ((i0 in r[2]) or (i1 in r[2])):
+          break
+      else:
+        r = ([], [], set())
+        rounds.append(r)
+      r[0].append(i0)
+      r[1].append(i1)
+      r[2].update([i0, i1])
+    rounds = [(np.array(r[0]), np.array(r[1])) for r in rounds]
+    max_round = max([len(r[0]) for r in rounds])
+
+    # Current configurations, BAT coordinates, and reduced energies
+    X = self._buffer('X', (n, self._natoms, 3))
+    for i in range(n):
+      X[i] = confs[replicas[i]]
+    BATs = self.converter.BAT_many(X, True)
+    evaluators = {}
+    RT = {}
+    for s in set(states):
+      evaluators[s] = self.system.evaluator(protocol[s])
+      RT[s] = R * protocol[s]['T']
+    u = self._buffer('u', (n, ))
+    self._energies(X, states, evaluators, RT, u)
+
+    P = self._buffer('P', (2 * max_round, self._nBAT))
+    X_P = self._buffer('X_P', (2 * max_round, self._natoms, 3))
+    u_P = self._buffer('u_P', (2 * max_round, ))
+
+    attempt_count = 0
+    acc_count = 0
+    changed = np.zeros(n, dtype=bool)
+    sweep_count = 0
+    while attempt_count < nattempts:
+      sweep_count += 1
+      if (sweep_count * len(pairs)) > (1000 * nattempts):
+        self.log.tee(
+          '  GMC Sweep too many times, but few attempted. Consider reducing torsion_threshold.'
+        )
+        break
+      for (a, b) in rounds:
+        masks = self._crossover_masks(len(a))
+        attempt = np.any(masks & \
+          (np.abs(BATs[a] - BATs[b]) >= torsion_threshold), 1)
+        attempt = np.nonzero(attempt)[0][:nattempts - attempt_count]
+        m = len(attempt)
+        if m == 0:
+          continue
+        attempt_count += m
+        (a, b, masks) = (a[attempt], b[attempt], masks[attempt])
+
+        # Cross over the torsions and evaluate the new energies
+        P[:m] = np.where(masks, BATs[b], BATs[a])
+        P[m:2 * m] = np.where(masks, BATs[a], BATs[b])
+        self.converter.Cartesian_many(P[:2 * m], out=X_P[:2 * m])
+        self._energies(X_P[:2 * m], np.concatenate((states[a], states[b])), \
+          evaluators, RT, u_P)
+
+        de = (u[a] + u[b]) - (u_P[:m] + u_P[m:2 * m])
+        with np.errstate(over='ignore', invalid='ignore'):
+          accept = (de > 0) | (np.random.random(m) < np.exp(de))
+        acc = np.nonzero(accept)[0]
+        if len(acc) > 0:
+          acc_count += len(acc)
+          for (ind, offset) in [(a, 0), (b, m)]:
+            X[ind[acc]] = X_P[acc + offset]
+            BATs[ind[acc]] = P[acc + offset]
+            u[ind[acc]] = u_P[acc + offset]
+            changed[ind[acc]] = True
+        if attempt_count == nattempts:
+          break
+
+    for i in np.nonzero(changed)[0]:
+      confs[replicas[i]] = np.copy(X[i])
+    return (attempt_count, acc_count, \
+      [replicas[i] for i in np.nonzero(changed)[0]])
@@ -0,0 +1,48 @@
+# Runs a round of GMC torsion crossovers between two BC states of the example
+
+import AlGDock.BindingPMF
+import numpy as np
+
+self = AlGDock.BindingPMF.BPMF(\
+  dir_dock='dock', dir_cool='cool',\
+  ligand_database='prmtopcrd/ligand.db', \
+  forcefield='prmtopcrd/gaff2.dat', \
+  ligand_prmtop='prmtopcrd/ligand.prmtop', \
+  ligand_inpcrd='prmtopcrd/ligand.trans.inpcrd', \
+  ligand_mol2='prmtopcrd/ligand.mol2', \
+  ligand_rb='prmtopcrd/ligand.rb', \
+  receptor_prmtop='prmtopcrd/receptor.prmtop', \
+  receptor_inpcrd='prmtopcrd/receptor.trans.inpcrd', \
+  receptor_fixed_atoms='prmtopcrd/receptor.pdb', \
+  complex_prmtop='prmtopcrd/complex.prmtop', \
+  complex_inpcrd='prmtopcrd/complex.trans.inpcrd', \
+  complex_fixed_atoms='prmtopcrd/complex.pdb', \
+  dir_grid='grids', \
+  cores=1, \
+  random_seed=-1)
+
+from AlGDock.torsion_crossover import TorsionCrossover
+crossover = TorsionCrossover(self.top, self.system, self.log)
+
+# Two configurations that differ in their soft torsions
+conf = np.copy(self.top.universe.configuration().array)
+BAT = crossover.converter.BAT(conf, extended=True)
+BAT[crossover.torsions] += np.random.uniform(-np.pi, np.pi, \
+  len(crossover.torsions))
+confs = [conf, np.array(crossover.converter.Cartesian(BAT))]
+
+protocol = [self.system.paramsFromAlpha(alpha, 'BC') for alpha in [0., 1.]]
+(att, acc, changed) = crossover(confs, [0, 1], [0, 1], protocol, \
+  [(0, 1)], 10, 0.)
+print 'Attempted %d and accepted %d crossovers' % (att, acc)
+print 'Changed replicas:', changed
+
+x = self.top.universe.configuration().array
+for c in range(len(confs)):
+  x[:] = confs[c]
+  E = self.system.evaluator(protocol[c])()
+  print 'Energy of replica %d: %f' % (c, E)
+  if not np.isfinite(E):
+    raise Exception('Energy of replica %d is not finite' % c)
+if att == 0:
+  raise Exception('No crossovers were attempted')
@@ -7,27 +7,33 @@ from libc.math cimport sqrt
 from libc.math cimport acos
 from libc.math cimport atan2
 
-cdef inline dotp(double[:] v1, double[:] v2)
-cdef inline norm2(double[:] v)
-cdef inline normalize(np.ndarray[np.double_t] v1)
-cdef inline cross(double[:] v1, double[:] v2)
-cdef inline distance(double[:] p1, double[:] p2)
-cdef inline angle(np.ndarray[np.double_t] p1, np.ndarray[np.double_t] p2, \
-    np.ndarray[np.double_t] p3)
-cdef dihedral(np.ndarray[np.double_t] p1, np.ndarray[np.double_t] p2, \
-    np.ndarray[np.double_t] p3, np.ndarray[np.double_t] p4)
-cdef rotate123(np.ndarray[np.double_t] p1, \
-    np.ndarray[np.double_t] p2, np.ndarray[np.double_t] p3, \
-    np.ndarray[np.double_t] origin, \
-    double phi, double theta, double omega)
+cdef void extended_kernel(const double* p1, const double* p2, \
+    const double* p3, double* coords) nogil
+cdef void BAT_kernel(const double* XYZ, double* bat, int offset, \
+    int ntorsions, const int* rootInd, const int* torsionInd, \
+    const int* firstTorsionTInd) nogil
+cdef void root_kernel(const double* bat, int offset, \
+    double* p1, double* p2, double* p3) nogil
+cdef void Cartesian_kernel(const double* bat, double* XYZ, int offset, \
+    int ntorsions, const int* rootInd, const int* torsionInd, \
+    const int* firstTorsionTInd) nogil
+cdef void update_kernel(const double* bat, double* XYZ, int natoms, \
+    int offset, const int* rootInd, const int* torsionInd, \
+    const int* firstTorsionTInd, const int* changed, int nchanged, \
+    bint external, const int* subtreeInd, const int* subtreeAtoms, \
+    const int* closureInd, const int* closureTors, \
+    const int* rigid) nogil
 
 cdef class converter:
 
   cdef object molecule
   cdef readonly int natoms, ntorsions
   cdef np.ndarray rootInd, _torsionIndL, _firstTorsionTInd
+  cdef int[::1] _rootInd_v, _torsionInd_v, _firstTorsionTInd_v
+  cdef int[::1] _subtreeInd_v, _subtreeAtoms_v, \
+    _closureInd_v, _closureTors_v, _rigid_v
 
-  cpdef BAT(self, double[:,:] XYZ, bool extended)
-  cpdef extended_coordinates(self, np.ndarray[np.double_t] p1, np.ndarray[np.double_t] p2, np.ndarray[np.double_t] p3)
-  cpdef Cartesian(self, double[:] BAT)
-
+  cpdef BAT(self, XYZ, bool extended)
+  cpdef extended_coordinates(self, p1, p2, p3)
+  cpdef Cartesian(self, BAT)
+  cpdef Cartesian_update(self, XYZ, BAT, changed)
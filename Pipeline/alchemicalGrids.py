@@ -12,13 +12,16 @@ at points on a grid.
 import os, time, gzip
 import numpy as np
 
+# Increment when changes to this module change the grids
+grid_version = 1
+
 class gridCalculation:
   def __init__(self, \
     prmtop_FN='apo.prmtop', inpcrd_FN=None, pqr_FN=None, \
     header_FN=None, site_FN=None, \
     PB_FN=None, ele_FN=None, LJa_FN=None, LJr_FN=None, \
-    spacing=None, counts=None, PB_spacing=None,
-    calcType='All'):
+    spacing=None, counts=None, PB_spacing=None, PB_interpolation=None,
+    calcType='All', grid_cache=None):
   
     ### Parse parameters
     self.FNs = {\
@@ -87,6 +90,8 @@ class gridCalculation:
     # PB spacing
     if PB_spacing is None:
       PB_spacing = 0.5
+    if PB_interpolation is None:
+      PB_interpolation = 'trilinear'
 
     spacing = np.array(spacing)
     counts = np.array(counts)
@@ -111,24 +116,59 @@ class gridCalculation:
     print 'Grid spacing            :\t', spacing
     print 'Grid counts             :\t', counts
     print 'PB Grid spacing         :\t', PB_spacing
+    print 'PB Grid interpolation   :\t', PB_interpolation
+    if grid_cache is not None:
+      print 'Grid cache              :\t' + grid_cache
     print
 
+    # Load grids that have already been calculated for this receptor
+    if grid_cache is not None:
+      from AlGDock.grid_cache import GridCache
+      self.cache = GridCache(grid_cache)
+      pqr_FNs = [self.FNs['pqr']] if os.path.isfile(self.FNs['pqr']) else []
+      self.cache_keys = {'PB':self.cache.key('alchemicalGrids.PB_grid', \
+        grid_version, self.crd, [self.FNs['prmtop']] + pqr_FNs, \
+        PB_spacing*np.ones(3), counts, PB_interpolation=PB_interpolation)}
+      for key in ['LJa','LJr']:
+        self.cache_keys[key] = self.cache.key('alchemicalGrids.direct_grids', \
+          grid_version, self.crd, [self.FNs['prmtop']], spacing, counts, \
+          term=key)
+      for key in ['PB','LJa','LJr']:
+        if (not os.path.isfile(self.FNs[key])) and \
+            self.cache.fetch(self.cache_keys[key], self.FNs[key]):
+          print 'Loaded %s grid from cache'%key
+    else:
+      self.cache = None
+
     if not os.path.isfile(self.FNs['PB']):
       if calcType in ['All','PB']:
         print 'Calculating Poisson-Boltzmann grid'
-        self.PB_grid(PB_spacing*counts, PB_spacing)
+        self.PB_grid(PB_spacing*counts, PB_spacing, PB_interpolation)
+        self._store_in_cache(['PB'])
     else:
       print 'Poisson-Boltzmann grid already calculated'
     
-    if not (os.path.isfile(self.FNs['ele']) and \
-            os.path.isfile(self.FNs['LJa']) and \
+    # direct_grids does not calculate the ele grid by default
+    if not (os.path.isfile(self.FNs['LJa']) and \
             os.path.isfile(self.FNs['LJr'])):
       if calcType in ['All','Direct']:
         print 'Calculating direct alchemical grids'
         self.direct_grids(spacing, counts)
+        self._store_in_cache(['LJa','LJr'])
     else:
       print 'Direct alchemical grids already calculated'
 
+  def _store_in_cache(self, keys):
+    """
+    Stores calculated grids in the grid cache
+    """
+    if self.cache is None:
+      return
+    for key in keys:
+      if os.path.isfile(self.FNs[key]) and \
+          not self.cache.has(self.cache_keys[key]):
+        self.cache.store_file(self.cache_keys[key], self.FNs[key])
+
   def direct_grids(self, spacing, counts, no_ele=True):
     """
     Calculates direct grids (Lennard Jones and electrostatic)
@@ -247,11 +287,12 @@ class gridCalculation:
     IO_Grid.write(self.FNs['LJa'], \
       {'origin':np.array([0., 0., 0.]), 'spacing':spacing, 'counts':counts, 'vals':grid['LJa'].flatten()})
 
-  def PB_grid(self, edge_length, PB_spacing):
+  def PB_grid(self, edge_length, PB_spacing, PB_interpolation='trilinear'):
     """
     Calculates a Poisson-Boltzmann grid using APBS
     
     edge_length is a 3 X 1 numpy array
+    PB_interpolation is 'trilinear' or 'cubic'
     """
     import inspect
     import _external_paths
@@ -345,6 +386,7 @@ ELEC mg-manual # large grid centered at center of range
   srfm smol # Smoothed dielectric and ion-accessibility coefficients
   swin 0.3
   temp 300.0
+  write pot dx apbs_full
 END
 ELEC mg-manual # focus grid around ligand binding site
   bcfl focus # multiple debye-huckel boundary condition
@@ -368,7 +410,9 @@ END'''.format(self.FNs['pqr'], \
     apbsF.close()
 
     # Execute APBS
-    if not (os.path.isfile('apbs_focus.dx') or os.path.isfile(self.FNs['PB'])):
+    if not ((os.path.isfile('apbs_focus.dx') and \
+             os.path.isfile('apbs_full.dx')) or \
+            os.path.isfile(self.FNs['PB'])):
       try:
         command_paths = _external_paths.findPaths(['apbs'])
         os.system(command_paths['apbs'] + ' apbs.in > apbs.out')
@@ -376,7 +420,8 @@ END'''.format(self.FNs['pqr'], \
         print 'APBS failure!'
         return
         
-    # Truncate the grid and convert to kcal/mol
+    # Resample the focus and full grids onto the final grid and
+    # convert to kcal/mol
     # APBS reports electrostatic grid potential energies in kBT e_c^{-1}
     # The others are in kcal/mol e_c^{-1}
     # At 300 K, 1 kBT ~ 0.596 kcal/mol
@@ -384,11 +429,13 @@ END'''.format(self.FNs['pqr'], \
       import AlGDock.IO
       IO_Grid = AlGDock.IO.Grid()
       print final_dims
-      IO_Grid.truncate('apbs_focus.dx', self.FNs['PB'], \
-        final_dims, multiplier=0.596)
+      IO_Grid.resample(['apbs_focus.dx','apbs_full.dx'], self.FNs['PB'], \
+        final_dims, final_spacing*np.ones(3), multiplier=0.596, \
+        order={'trilinear':1, 'cubic':3}[PB_interpolation])
 
     # Remove intermediate files
-    toClear = ['io.mc', 'apbs.in', 'apbs.out','apbs_focus.dx']
+    toClear = ['io.mc', 'apbs.in', 'apbs.out', \
+      'apbs_focus.dx', 'apbs_full.dx']
     if added_pqr:
       toClear += [self.FNs['pqr']]
     for FN in toClear:
@@ -424,8 +471,12 @@ if __name__ == '__main__':
       help='Number of point in each direction (overrides header)')
     parser.add_argument('--PB_spacing', type=float, \
       help='PB Grid spacing (equal in all dimensions)')
+    parser.add_argument('--PB_interpolation', choices=['trilinear','cubic'], \
+      help='Interpolation of APBS grids onto the PB grid')
     parser.add_argument('--calcType', choices=['All','PB','Direct'],
       help='Type of calculation to perform')
+    parser.add_argument('--grid_cache', \
+      help='Directory of previously calculated grids (optional)')
     args = parser.parse_args()
   except:
     import optparse
@@ -444,8 +495,12 @@ if __name__ == '__main__':
     parser.add_option('--counts', nargs=3, type="float", help='Grid dimensions')
     parser.add_option('--PB_spacing', type="float", \
       help='PB Grid spacing (equal in all dimensions)')
+    parser.add_option('--PB_interpolation', choices=['trilinear','cubic'], \
+      help='Interpolation of APBS grids onto the PB grid')
     parser.add_argument('--calcType', choices=['All','PB','Direct'],
       help='Type of calculation to perform')
+    parser.add_option('--grid_cache', \
+      help='Directory of previously calculated grids (optional)')
     (args,options) = parser.parse_args()
 
   calc = gridCalculation(**vars(args))
@@ -2,6 +2,10 @@ import os, time
 import numpy as np
 
 from desolvationGrid_util import *
+
+# Increment when changes to this module or desolvationGrid_util
+# change the grids
+grid_version = 1
 # Most of the heavy lifting is done by these Cython routines
 # from desolvationGrid_util:
 # enumerate_SAS_points
@@ -9,6 +13,11 @@ from desolvationGrid_util import *
 # increment_inside_sphere
 # decrement_inside_sphere
 # fraction_r4inv_low_dielectric
+# r4inv_stencil
+# fraction_r4inv_low_dielectric_stencil
+# pack_low_dielectric
+# r4inv_stencil_rows
+# fraction_r4inv_low_dielectric_packed
 # calc_desolvationGrid
 
 def goldenSectionSpiral(n):
@@ -112,6 +121,34 @@ class desolvationGridCalculation:
     kwargs['spacing'] = spacing
     self.kwargs = kwargs
 
+  def _cache(self):
+    """
+    Returns the grid cache and the key for the desolvation grid,
+    or (None, None) if there is no cache
+    """
+    if self.kwargs.get('grid_cache') is None:
+      return (None, None)
+    from AlGDock.grid_cache import GridCache
+    cache = GridCache(self.kwargs['grid_cache'])
+    key = cache.key('desolvationGrid', grid_version, self.crd, \
+      [self.FNs['prmtop']], self.kwargs['spacing'], self.kwargs['counts'], \
+      probe_radius=float(self.kwargs['probe_radius']), \
+      ligand_atom_radius=float(self.kwargs['ligand_atom_radius']), \
+      SAS_points=int(self.kwargs['SAS_points']), \
+      integration_cutoff=float(self.kwargs['integration_cutoff']))
+    return (cache, key)
+
+  def fetch_from_cache(self):
+    """
+    Writes the desolvation grid from the grid cache, if it is there.
+    Returns True if the grid was in the cache.
+    """
+    (cache, key) = self._cache()
+    if (cache is not None) and cache.fetch(key, self.FNs['grid']):
+      print 'Loaded desolvation grid from cache'
+      return True
+    return False
+
   def calc_receptor_SAS_points(self):
     print 'Finding receptor SAS points'
     startTime = time.time()
@@ -127,7 +164,7 @@ class desolvationGridCalculation:
     startTime = time.time()
     
     self.receptor_MS_grid = np.ones(shape=tuple(self.kwargs['counts']), \
-      dtype=np.int)
+      dtype=np.uint8)
     # Tentatively assign the grid inside the SAS to low dielectric
     for atom_index in range(len(self.SAS_r)):
       set_inside_sphere_to(self.receptor_MS_grid, self.kwargs['spacing'], \
@@ -174,6 +211,14 @@ class desolvationGridCalculation:
       'counts':self.kwargs['counts'], \
       'vals':self.desolvationGrid.flatten()})
 
+    (cache, key) = self._cache()
+    if cache is not None:
+      cache.store(key, \
+        {'origin':np.array([0., 0., 0.]), \
+         'spacing':self.kwargs['spacing'], \
+         'counts':self.kwargs['counts'], \
+         'vals':self.desolvationGrid.flatten()})
+
     endTime = time.time()
     print ' in %3.2f s'%(endTime-startTime)
 
@@ -205,10 +250,13 @@ if __name__ == '__main__':
     help='Grid spacing (overrides header)')
   parser.add_argument('--counts', nargs=3, type=int, \
     help='Number of point in each direction (overrides header)')
+  parser.add_argument('--grid_cache', \
+    help='Directory of previously calculated grids (optional)')
   parser.add_argument('-f')
   args = parser.parse_args()
   
   self = desolvationGridCalculation(**vars(args))
-  self.calc_receptor_SAS_points()
-  self.calc_receptor_MS()
-  self.calc_desolvationGrid()
+  if not self.fetch_from_cache():
+    self.calc_receptor_SAS_points()
+    self.calc_receptor_MS()
+    self.calc_desolvationGrid()
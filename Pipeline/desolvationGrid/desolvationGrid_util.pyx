@@ -6,9 +6,21 @@
 import cython
 import numpy as np
 cimport numpy as np
+from libc.math cimport sqrt, ceil, floor
 
 ctypedef np.int_t int_t
 ctypedef np.float_t float_t
+# The molecular surface (MS) grid counts the number of SAS points marking
+# each grid point. Counts saturate at MS_max. A saturated count is not
+# decremented, so a grid point with many marks stays high dielectric.
+ctypedef np.uint8_t MS_t
+DEF MS_max = 255
+# Bit-packed grids store 64 grid points along the last axis in each word
+ctypedef np.uint64_t word_t
+
+cdef extern from *:
+  int __builtin_popcountll(unsigned long long) nogil
+  int __builtin_ctzll(unsigned long long) nogil
 
 # This is the original python code for enumerate_SAS_points
 # def enumerate_SAS_points(to_surround, to_avoid, \
@@ -87,27 +99,62 @@ cpdef enumerate_SAS_points(float_t[:,:] to_surround, float_t[:,:] to_avoid, \
 #         if (dx2 + dy2 + dz2) < r2:
 #           grid[i,j,k]=val
 
+# Finds the range [k_lo, k_hi) of grid points (i,j,k) in [k_min, k_max)
+# that are inside a sphere, given dx2dy2 for the (i,j) row.
+# The range is estimated from the chord length and the endpoints are then
+# checked with the same inequality as the original loop over k.
+@cython.cdivision(True)
+cdef inline void sphere_row_range(float_t dx2dy2, float_t point_z, \
+    float_t spacing_z, float_t r2, int_t k_min, int_t k_max, \
+    int_t* k_lo, int_t* k_hi):
+  cdef float_t half_chord, dz
+  half_chord = sqrt(r2 - dx2dy2)
+  k_lo[0] = max(<int_t>ceil((point_z - half_chord)/spacing_z), k_min)
+  k_hi[0] = min(<int_t>floor((point_z + half_chord)/spacing_z)+1, k_max)
+  if k_lo[0] >= k_hi[0]:
+    k_hi[0] = k_lo[0]
+    return
+  dz = point_z-k_lo[0]*spacing_z
+  while (k_lo[0] < k_hi[0]) and not ((dx2dy2 + dz*dz) < r2):
+    k_lo[0] += 1
+    dz = point_z-k_lo[0]*spacing_z
+  dz = point_z-(k_lo[0]-1)*spacing_z
+  while (k_lo[0] > k_min) and ((dx2dy2 + dz*dz) < r2):
+    k_lo[0] -= 1
+    dz = point_z-(k_lo[0]-1)*spacing_z
+  dz = point_z-(k_hi[0]-1)*spacing_z
+  while (k_hi[0] > k_lo[0]) and not ((dx2dy2 + dz*dz) < r2):
+    k_hi[0] -= 1
+    dz = point_z-(k_hi[0]-1)*spacing_z
+  dz = point_z-k_hi[0]*spacing_z
+  while (k_hi[0] < k_max) and ((dx2dy2 + dz*dz) < r2):
+    k_hi[0] += 1
+    dz = point_z-k_hi[0]*spacing_z
+
 # The following three functions are the same except that
 # one sets the grid value,
 # one increments the grid value, and
-# one decrements the grid value
+# one decrements the grid value.
+# Each (i,j) row of grid points inside the sphere is a contiguous range of k,
+# which is updated without testing each point.
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
 cpdef set_inside_sphere_to(\
-    int_t[:,:,:] grid, \
+    MS_t[:,:,::1] grid, \
     float_t[:] spacing, \
     int_t[:] counts, \
     float_t point_x, \
     float_t point_y, \
     float_t point_z, \
     float_t r, \
-    int_t val):
+    MS_t val):
 
-  cdef int_t i, j, k
+  cdef int_t i, j, k, k_lo, k_hi
   cdef int_t i_min, i_max, j_min, j_max, k_min, k_max
-  cdef float_t dx, dy, dz, dx2, dy2, dz2, dx2dy2, r2
-  
+  cdef float_t dx, dy, dx2, dy2, dx2dy2, r2
+  cdef MS_t* row
+
   i_min = max(int((point_x-r)/spacing[0]),0)
   i_max = min(int((point_x+r)/spacing[0])+1,counts[0])
   j_min = max(int((point_y-r)/spacing[1]),0)
@@ -126,12 +173,12 @@ cpdef set_inside_sphere_to(\
       dy2 = dy*dy
       dx2dy2 = dx2 + dy2
       if dx2dy2 < r2:
-        k = k_min
-        while k<k_max:
-          dz  = point_z-k*spacing[2]
-          dz2 = dz*dz
-          if (dx2dy2 + dz2) < r2:
-            grid[i,j,k]=val
+        sphere_row_range(dx2dy2, point_z, spacing[2], r2, k_min, k_max, \
+          &k_lo, &k_hi)
+        row = &grid[i,j,0]
+        k = k_lo
+        while k<k_hi:
+          row[k] = val
           k += 1
       j += 1
     i += 1
@@ -140,7 +187,7 @@ cpdef set_inside_sphere_to(\
 @cython.wraparound(False)
 @cython.cdivision(True)
 cpdef increment_inside_sphere(\
-    int_t[:,:,:] grid, \
+    MS_t[:,:,::1] grid, \
     float_t[:] spacing, \
     int_t[:] counts, \
     float_t point_x, \
@@ -148,10 +195,11 @@ cpdef increment_inside_sphere(\
     float_t point_z, \
     float_t r):
 
-  cdef int_t i, j, k
+  cdef int_t i, j, k, k_lo, k_hi
   cdef int_t i_min, i_max, j_min, j_max, k_min, k_max
-  cdef float_t dx, dy, dz, dx2, dy2, dz2, dx2dy2, r2
-  
+  cdef float_t dx, dy, dx2, dy2, dx2dy2, r2
+  cdef MS_t* row
+
   i_min = max(int((point_x-r)/spacing[0]),0)
   i_max = min(int((point_x+r)/spacing[0])+1,counts[0])
   j_min = max(int((point_y-r)/spacing[1]),0)
@@ -170,12 +218,12 @@ cpdef increment_inside_sphere(\
       dy2 = dy*dy
       dx2dy2 = dx2 + dy2
       if dx2dy2 < r2:
-        k = k_min
-        while k<k_max:
-          dz  = point_z-k*spacing[2]
-          dz2 = dz*dz
-          if (dx2dy2 + dz2) < r2:
-            grid[i,j,k]+=1
+        sphere_row_range(dx2dy2, point_z, spacing[2], r2, k_min, k_max, \
+          &k_lo, &k_hi)
+        row = &grid[i,j,0]
+        k = k_lo
+        while k<k_hi:
+          row[k] += (row[k] != MS_max)
           k += 1
       j += 1
     i += 1
@@ -184,7 +232,7 @@ cpdef increment_inside_sphere(\
 @cython.wraparound(False)
 @cython.cdivision(True)
 cpdef decrement_inside_sphere(\
-    int_t[:,:,:] grid, \
+    MS_t[:,:,::1] grid, \
     float_t[:] spacing, \
     int_t[:] counts, \
     float_t point_x, \
@@ -192,10 +240,11 @@ cpdef decrement_inside_sphere(\
     float_t point_z, \
     float_t r):
 
-  cdef int_t i, j, k
+  cdef int_t i, j, k, k_lo, k_hi
   cdef int_t i_min, i_max, j_min, j_max, k_min, k_max
-  cdef float_t dx, dy, dz, dx2, dy2, dz2, dx2dy2, r2
-  
+  cdef float_t dx, dy, dx2, dy2, dx2dy2, r2
+  cdef MS_t* row
+
   i_min = max(int((point_x-r)/spacing[0]),0)
   i_max = min(int((point_x+r)/spacing[0])+1,counts[0])
   j_min = max(int((point_y-r)/spacing[1]),0)
@@ -214,12 +263,12 @@ cpdef decrement_inside_sphere(\
       dy2 = dy*dy
       dx2dy2 = dx2 + dy2
       if dx2dy2 < r2:
-        k = k_min
-        while k<k_max:
-          dz  = point_z-k*spacing[2]
-          dz2 = dz*dz
-          if (dx2dy2 + dz2) < r2:
-            grid[i,j,k]-=1
+        sphere_row_range(dx2dy2, point_z, spacing[2], r2, k_min, k_max, \
+          &k_lo, &k_hi)
+        row = &grid[i,j,0]
+        k = k_lo
+        while k<k_hi:
+          row[k] -= (row[k] != 0) and (row[k] != MS_max)
           k += 1
       j += 1
     i += 1
@@ -232,7 +281,7 @@ cpdef decrement_inside_sphere(\
 @cython.wraparound(False)
 @cython.cdivision(True)
 cpdef fraction_r4inv_low_dielectric(\
-    int_t[:,:,:] grid, \
+    MS_t[:,:,:] grid, \
     float_t[:] spacing, \
     int_t[:] counts, \
     float_t point_x, \
@@ -283,10 +332,233 @@ cpdef fraction_r4inv_low_dielectric(\
     i += 1
   return I_low_dielectric/I_total
 
+# On a uniform grid, the grid points between r_min and r_max of a grid point
+# and their r**(-4) weights are the same for every grid point.
+# This precomputes them as a stencil of offsets and weights.
+# Offsets are in C order, so that a gather over the flat offsets
+# walks forward through a C-contiguous grid with the given counts.
+# Returns a tuple of
+#   the (di,dj,dk) offsets,
+#   the flat offsets,
+#   the weights,
+#   the sum of the weights, and
+#   the largest offset in each direction.
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
-cpdef calc_desolvationGrid(int_t[:,:,:] receptor_MS_grid, \
+cpdef r4inv_stencil(\
+    float_t[:] spacing, \
+    int_t[:] counts, \
+    float_t r_min, \
+    float_t r_max):
+  cdef int_t di, dj, dk, di_max, dj_max, dk_max
+  cdef float_t dx, dy, dz, dx2dy2, r2, r_min2, r_max2
+
+  di_max = int(r_max/spacing[0])+1
+  dj_max = int(r_max/spacing[1])+1
+  dk_max = int(r_max/spacing[2])+1
+
+  r_min2 = r_min*r_min
+  r_max2 = r_max*r_max
+  offsets = []
+  weights = []
+  di = -di_max
+  while di<=di_max:
+    dx = di*spacing[0]
+    dj = -dj_max
+    while dj<=dj_max:
+      dy = dj*spacing[1]
+      dx2dy2 = dx*dx + dy*dy
+      if dx2dy2 < r_max2:
+        dk = -dk_max
+        while dk<=dk_max:
+          dz = dk*spacing[2]
+          r2 = dx2dy2 + dz*dz
+          if (r2 < r_max2) and (r2 > r_min2):
+            offsets.append((di,dj,dk))
+            weights.append(1/(r2*r2))
+          dk += 1
+      dj += 1
+    di += 1
+
+  offsets = np.array(offsets, dtype=np.int).reshape((-1,3))
+  weights = np.array(weights, dtype=np.float)
+  flat_offsets = np.ascontiguousarray(\
+    offsets[:,0]*counts[1]*counts[2] + offsets[:,1]*counts[2] + offsets[:,2])
+  reach = np.max(np.abs(offsets), 0) if len(offsets)>0 \
+    else np.zeros(3, dtype=np.int)
+  return (offsets, flat_offsets, weights, np.sum(weights), reach)
+
+# Same as fraction_r4inv_low_dielectric,
+# but for the grid point (i,j,k) using a stencil from r4inv_stencil.
+# Away from the grid boundary, the integral over all points is the
+# sum of the stencil weights.
+# Near the boundary, only stencil points on the grid are included.
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cpdef fraction_r4inv_low_dielectric_stencil(\
+    MS_t[:,:,::1] grid, \
+    int_t[:] counts, \
+    int_t i, \
+    int_t j, \
+    int_t k, \
+    int_t[:,:] offsets, \
+    int_t[::1] flat_offsets, \
+    float_t[::1] weights, \
+    float_t I_stencil, \
+    int_t[:] reach):
+  cdef int_t n, nstencil, ii, jj, kk
+  cdef MS_t* center
+  cdef float_t I_low_dielectric, I_total
+
+  nstencil = weights.shape[0]
+  I_low_dielectric = 0.
+
+  if (i>=reach[0]) and (i+reach[0]<counts[0]) and \
+     (j>=reach[1]) and (j+reach[1]<counts[1]) and \
+     (k>=reach[2]) and (k+reach[2]<counts[2]):
+    center = &grid[i,j,k]
+    n = 0
+    while n<nstencil:
+      if center[flat_offsets[n]]<1:
+        I_low_dielectric += weights[n]
+      n += 1
+    return I_low_dielectric/I_stencil
+
+  I_total = 0.
+  n = 0
+  while n<nstencil:
+    ii = i + offsets[n,0]
+    jj = j + offsets[n,1]
+    kk = k + offsets[n,2]
+    if (ii>=0) and (ii<counts[0]) and \
+       (jj>=0) and (jj<counts[1]) and \
+       (kk>=0) and (kk<counts[2]):
+      if grid[ii,jj,kk]<1:
+        I_low_dielectric += weights[n]
+      I_total += weights[n]
+    n += 1
+  return I_low_dielectric/I_total
+
+# Packs the low dielectric (count < 1) points of an MS grid into bits.
+# Bit (k%64) of word k/64 in row (i,j) is set if grid[i,j,k] is low dielectric.
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cpdef pack_low_dielectric(MS_t[:,:,::1] grid):
+  cdef int_t i, j, k, n0, n1, n2
+  cdef np.ndarray[word_t, ndim=3] packed
+
+  n0 = grid.shape[0]
+  n1 = grid.shape[1]
+  n2 = grid.shape[2]
+  packed = np.zeros(shape=(n0, n1, (n2+63)/64), dtype=np.uint64)
+  i = 0
+  while i<n0:
+    j = 0
+    while j<n1:
+      k = 0
+      while k<n2:
+        if grid[i,j,k]<1:
+          packed[i,j,k>>6] |= (<word_t>1) << (k&63)
+        k += 1
+      j += 1
+    i += 1
+  return packed
+
+# Groups a stencil from r4inv_stencil into rows of consecutive dk
+# with the same (di,dj).
+# Returns a tuple of
+#   the (di,dj,dk_lo,dk_hi) of each row, where dk_hi is exclusive,
+#   the index of the first stencil point in each row, and
+#   the cumulative sum of the weights, starting with 0.
+cpdef r4inv_stencil_rows(int_t[:,:] offsets, float_t[:] weights):
+  cdef int_t n, nstencil
+
+  nstencil = offsets.shape[0]
+  rows = []
+  row_start = []
+  n = 0
+  while n<nstencil:
+    if (n==0) or (offsets[n,0]!=offsets[n-1,0]) or \
+        (offsets[n,1]!=offsets[n-1,1]) or (offsets[n,2]!=offsets[n-1,2]+1):
+      rows.append([offsets[n,0], offsets[n,1], offsets[n,2], offsets[n,2]+1])
+      row_start.append(n)
+    else:
+      rows[-1][3] += 1
+    n += 1
+  return (np.array(rows, dtype=np.int).reshape((-1,4)), \
+    np.array(row_start, dtype=np.int), \
+    np.concatenate([[0.], np.cumsum(weights)]))
+
+# Same as fraction_r4inv_low_dielectric_stencil,
+# but on a grid from pack_low_dielectric and stencil rows from
+# r4inv_stencil_rows.
+# Each 64-point word of a row is masked to the stencil.
+# Words with no low dielectric points are skipped and
+# words that are all low dielectric use the cumulative weights.
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cpdef fraction_r4inv_low_dielectric_packed(\
+    word_t[:,:,::1] packed, \
+    int_t[:] counts, \
+    int_t i, \
+    int_t j, \
+    int_t k, \
+    int_t[:,::1] rows, \
+    int_t[::1] row_start, \
+    float_t[::1] cumulative_weights, \
+    float_t[::1] weights):
+  cdef int_t r, nrows, ii, jj, kk_lo, kk_hi, n0, w, w_max, lo, hi, b
+  cdef word_t bits, mask
+  cdef word_t* words
+  cdef float_t I_low_dielectric, I_total
+
+  nrows = rows.shape[0]
+  I_low_dielectric = 0.
+  I_total = 0.
+  r = 0
+  while r<nrows:
+    ii = i + rows[r,0]
+    jj = j + rows[r,1]
+    kk_lo = max(k + rows[r,2], 0)
+    kk_hi = min(k + rows[r,3], counts[2])
+    if (ii>=0) and (ii<counts[0]) and (jj>=0) and (jj<counts[1]) and \
+        (kk_lo<kk_hi):
+      # Index of the stencil point at kk_lo
+      n0 = row_start[r] + kk_lo - (k + rows[r,2])
+      I_total += cumulative_weights[n0+kk_hi-kk_lo] - cumulative_weights[n0]
+      words = &packed[ii,jj,0]
+      w = kk_lo>>6
+      w_max = (kk_hi-1)>>6
+      while w<=w_max:
+        lo = max(kk_lo, w<<6)
+        hi = min(kk_hi, (w+1)<<6)
+        if hi-(w<<6)==64:
+          mask = ~(<word_t>0)
+        else:
+          mask = ((<word_t>1) << (hi-(w<<6))) - 1
+        mask &= ~(((<word_t>1) << (lo-(w<<6))) - 1)
+        bits = words[w] & mask
+        if bits!=0:
+          if __builtin_popcountll(bits)==hi-lo:
+            I_low_dielectric += cumulative_weights[n0+hi-kk_lo] - \
+              cumulative_weights[n0+lo-kk_lo]
+          else:
+            while bits!=0:
+              b = __builtin_ctzll(bits)
+              I_low_dielectric += weights[n0+(w<<6)+b-kk_lo]
+              bits &= bits-1
+        w += 1
+    r += 1
+  return I_low_dielectric/I_total
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cpdef calc_desolvationGrid(MS_t[:,:,::1] receptor_MS_grid, \
     float_t[:] spacing, int_t[:] counts, \
     float_t[:,:] receptor_SAS_points, \
     float_t[:,:] receptor_coordinates, \
@@ -311,8 +583,18 @@ cpdef calc_desolvationGrid(int_t[:,:,:] receptor_MS_grid, \
   cdef int_t nreceptor_atoms, nsphere_points, n_newly_inaccessible_SAS_points
   cdef float_t SAS_point_x, SAS_point_y, SAS_point_z
   cdef float_t dx, dy, dz
-  cdef np.ndarray[int_t, ndim=3] grid_c
-    
+  cdef np.ndarray[MS_t, ndim=3] grid_c
+
+  # Integration stencil
+  cdef np.ndarray[int_t, ndim=2] stencil_offsets
+  cdef np.ndarray[int_t, ndim=1] stencil_flat_offsets, stencil_reach
+  cdef np.ndarray[float_t, ndim=1] stencil_weights
+  cdef float_t I_stencil
+  cdef np.ndarray[int_t, ndim=2] stencil_rows
+  cdef np.ndarray[int_t, ndim=1] stencil_row_start
+  cdef np.ndarray[float_t, ndim=1] stencil_cumulative_weights
+  cdef np.ndarray[word_t, ndim=3] receptor_low_dielectric
+
   nreceptor_SAS_points = receptor_SAS_points.shape[0]
   nreceptor_atoms = len(LJ_r2)
   nsphere_points = len(SAS_sphere_pts)
@@ -323,6 +605,13 @@ cpdef calc_desolvationGrid(int_t[:,:,:] receptor_MS_grid, \
   clash_filter_r = ligand_atom_radius + probe_radius + LJ_r_max
   
   desolvationGrid = np.zeros(shape=tuple(counts), dtype=np.float)
+
+  (stencil_offsets, stencil_flat_offsets, stencil_weights, \
+    I_stencil, stencil_reach) = r4inv_stencil(spacing, counts, \
+    ligand_atom_radius, integration_cutoff)
+  (stencil_rows, stencil_row_start, stencil_cumulative_weights) = \
+    r4inv_stencil_rows(stencil_offsets, stencil_weights)
+  receptor_low_dielectric = pack_low_dielectric(receptor_MS_grid)
   
   for i in xrange(counts[0]):
     grid_point_x = i*spacing[0]
@@ -370,10 +659,10 @@ cpdef calc_desolvationGrid(int_t[:,:,:] receptor_MS_grid, \
         if n_newly_inaccessible_SAS_points==0:
           # If there are no newly inaccessible SAS points, 
           # perform the numerical integrals over the receptor MS grid.
-          desolvationGrid[i,j,k] = fraction_r4inv_low_dielectric(\
-              receptor_MS_grid, spacing, counts, \
-              grid_point_x, grid_point_y, grid_point_z, \
-              ligand_atom_radius, integration_cutoff)
+          desolvationGrid[i,j,k] = fraction_r4inv_low_dielectric_packed(\
+              receptor_low_dielectric, counts, i, j, k, \
+              stencil_rows, stencil_row_start, \
+              stencil_cumulative_weights, stencil_weights)
         else:
           rec_z_min = grid_point_z - clash_filter_r
           rec_z_max = grid_point_z + clash_filter_r
@@ -422,8 +711,9 @@ cpdef calc_desolvationGrid(int_t[:,:,:] receptor_MS_grid, \
             grid_point_x, grid_point_y, grid_point_z, \
             ligand_atom_radius, 0)
 
-          desolvationGrid[i,j,k] = fraction_r4inv_low_dielectric(grid_c, \
-            spacing, counts, grid_point_x, grid_point_y, grid_point_z, \
-            ligand_atom_radius, integration_cutoff)
+          desolvationGrid[i,j,k] = fraction_r4inv_low_dielectric_stencil(\
+            grid_c, counts, i, j, k, \
+            stencil_offsets, stencil_flat_offsets, stencil_weights, \
+            I_stencil, stencil_reach)
 
   return desolvationGrid
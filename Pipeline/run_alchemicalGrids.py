@@ -17,6 +17,8 @@ parser.add_argument('--spacing', nargs=3, type=float, \
   default = [0.25, 0.25, 0.25],
   help='Grid spacing (overrides header)')
 parser.add_argument('--counts', nargs=3, type=int, help='Number of point in each direction (overrides header)')
+parser.add_argument('--grid_cache', default=None, \
+  help='Directory of previously calculated grids, shared between receptors')
 parser.add_argument('--max_jobs', default=None, type=int)
 parser.add_argument('--dry', action='store_true', default=False, \
   help='Does not actually submit the job to the queue')
@@ -53,9 +55,11 @@ for prmtop_FN in prmtopFNs:
     ' --pqr_FN {3}.pqr --PB_FN {3}.PB.nc --ele_FN {3}.ele.{4}.nc' + \
     ' --LJa_FN {3}.LJa.{4}.nc --LJr_FN {3}.LJr.{4}.nc' + \
     ' --spacing {5[0]} {5[1]} {5[2]}' + \
-    {True:'', False:' --counts {6[0]} {6[1]} {6[2]}'}[args.counts is None]
+    {True:'', False:' --counts {6[0]} {6[1]} {6[2]}'}[args.counts is None] + \
+    {True:'', False:' --grid_cache {7}'}[args.grid_cache is None]
   command = command.format(dirs['script'], prmtop_FN, inpcrd_FN, prefix, \
-    int(args.spacing[0]*100), args.spacing, args.counts)
+    int(args.spacing[0]*100), args.spacing, args.counts, \
+    None if args.grid_cache is None else os.path.abspath(args.grid_cache))
   print command
 
   print 'Submitting: ' + command
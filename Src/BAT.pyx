@@ -13,98 +13,334 @@ from libc.math cimport sqrt
 from libc.math cimport acos
 from libc.math cimport atan2
 
+from cython.parallel cimport prange
+
 import MMTK
 
 ### Vector functions
-@cython.boundscheck(False)
-@cython.wraparound(False)
-@cython.cdivision(True)
-cdef inline dotp(double[:] v1, double[:] v2):
+# These kernels operate on raw pointers to 3-vectors
+# and do not create Python objects, so they can run without the GIL.
+cdef inline double dotp(const double* v1, const double* v2) nogil:
   return (v1[0]*v2[0] + v1[1]*v2[1] + v1[2]*v2[2])
 
-@cython.boundscheck(False)
-@cython.wraparound(False)
+cdef inline void subtract(const double* v1, const double* v2, \
+    double* out) nogil:
+  out[0] = v1[0] - v2[0]
+  out[1] = v1[1] - v2[1]
+  out[2] = v1[2] - v2[2]
+
+cdef inline void cross(const double* v1, const double* v2, \
+    double* out) nogil:
+  out[0] = v1[1]*v2[2]-v1[2]*v2[1]
+  out[1] = v1[2]*v2[0]-v1[0]*v2[2]
+  out[2] = v1[0]*v2[1]-v1[1]*v2[0]
+
+@cython.cdivision(True)
+cdef inline double normalize(double* v) nogil:
+  # Normalizes v in place and returns its original length
+  cdef double norm = sqrt(dotp(v,v))
+  v[0] /= norm
+  v[1] /= norm
+  v[2] /= norm
+  return norm
+
+cdef inline double clip(double x) nogil:
+  return -1. if x < -1. else (1. if x > 1. else x)
+
+### Conversion kernels
 @cython.cdivision(True)
-cdef inline norm2(double[:] v):
-  return (v[0]*v[0] + v[1]*v[1] + v[2]*v[2])
+cdef void extended_kernel(const double* p1, const double* p2, \
+    const double* p3, double* coords) nogil:
+  # The rotation axis is a normalized vector pointing from atom 0 to 1
+  # It is described in two degrees of freedom by the polar angle and azimuth
+  cdef double e[3]
+  cdef double v[3]
+  subtract(p2, p1, e)
+  normalize(e)
+  cdef double phi = atan2(e[1],e[0]) # Polar angle
+  cdef double theta = acos(clip(e[2])) # Azimuthal angle
+  # Rotation of atom 2 to the z axis
+  cdef double cp = cos(phi)
+  cdef double sp = sin(phi)
+  cdef double ct = cos(theta)
+  cdef double st = sin(theta)
+  subtract(p3, p1, v)
+  # Angle about the rotation axis
+  cdef double omega = atan2(-sp*v[0] + cp*v[1], \
+    cp*ct*v[0] + ct*sp*v[1] - st*v[2])
+  coords[0] = p1[0]
+  coords[1] = p1[1]
+  coords[2] = p1[2]
+  coords[3] = phi
+  coords[4] = theta
+  coords[5] = omega
 
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
-cdef inline normalize(np.ndarray[np.double_t] v1):
-  return v1/sqrt(norm2(v1))
+cdef void BAT_kernel(const double* XYZ, double* bat, int offset, \
+    int ntorsions, const int* rootInd, const int* torsionInd, \
+    const int* firstTorsionTInd) nogil:
+  # Converts one configuration, XYZ[natoms*3], to bat[natoms*3-6+offset]
+  cdef const double *p1
+  cdef const double *p2
+  cdef const double *p3
+  cdef const double *p4
+  cdef double v1[3]
+  cdef double v2[3]
+  cdef double v3[3]
+  cdef double a[3]
+  cdef double b[3]
+  cdef double ba[3]
+  cdef double c, s, norm_v1_2, norm_v2_2
+  cdef int n, batInd
+
+  p1 = XYZ + 3*rootInd[0]
+  p2 = XYZ + 3*rootInd[1]
+  p3 = XYZ + 3*rootInd[2]
+  if offset == 6:
+    extended_kernel(p1, p2, p3, bat)
+  subtract(p2, p1, v1)
+  subtract(p2, p3, v2)
+  norm_v1_2 = dotp(v1,v1)
+  norm_v2_2 = dotp(v2,v2)
+  bat[offset] = sqrt(norm_v1_2)
+  bat[offset+1] = sqrt(norm_v2_2)
+  bat[offset+2] = acos(clip(dotp(v1,v2)/sqrt(norm_v1_2*norm_v2_2)))
+
+  for n in range(ntorsions):
+    p1 = XYZ + 3*torsionInd[4*n]
+    p2 = XYZ + 3*torsionInd[4*n+1]
+    p3 = XYZ + 3*torsionInd[4*n+2]
+    p4 = XYZ + 3*torsionInd[4*n+3]
+
+    subtract(p2, p1, v1)
+    subtract(p2, p3, v2)
+    subtract(p3, p4, v3)
+    cross(v1, v2, a)
+    normalize(a)
+    cross(v3, v2, b)
+    normalize(b)
+    c = dotp(a,b)
+    norm_v1_2 = dotp(v1,v1)
+    norm_v2_2 = dotp(v2,v2)
+    cross(b, a, ba)
+    s = dotp(ba,v2)/sqrt(norm_v2_2)
+
+    batInd = offset+3*n+3
+    bat[batInd] = sqrt(norm_v1_2)
+    bat[batInd+1] = acos(clip(dotp(v1,v2)/sqrt(norm_v1_2*norm_v2_2)))
+    bat[batInd+2] = atan2(s,c)
+    if firstTorsionTInd[n] != n:
+      bat[batInd+2] -= bat[offset+5+3*firstTorsionTInd[n]]
 
-@cython.boundscheck(False)
-@cython.wraparound(False)
 @cython.cdivision(True)
-cdef inline cross(double[:] v1, double[:] v2):
-  return np.array([v1[1]*v2[2]-v1[2]*v2[1], \
-    v1[2]*v2[0]-v1[0]*v2[2], \
-    v1[0]*v2[1]-v1[1]*v2[0]])
+cdef inline void place_atom(const double* p2, const double* p3, \
+    const double* p4, double bond, double angle, double torsion, \
+    double* p1) nogil:
+  # Places p1 at a distance bond from p2, with an angle to p3
+  # and a torsion to p4
+  cdef double n23[3]
+  cdef double v34[3]
+  cdef double w[3]
+  cdef double u[3]
+  cdef double v21[3]
+  cdef double t[3]
+  cdef double s, c, d
+  cdef int i
+  subtract(p3, p2, n23)
+  normalize(n23)
+  subtract(p4, p3, v34)
+  cross(v34, n23, w)
+  normalize(w)
+  cross(w, n23, u)
+  s = sin(angle)
+  c = cos(angle)
+  for i in range(3):
+    v21[i] = (bond*c)*n23[i] - (bond*s)*u[i]
+  # Rotate about the p2-p3 axis by the torsion angle
+  s = sin(torsion)
+  c = cos(torsion)
+  cross(n23, v21, t)
+  d = dotp(n23, v21)*(1.0-c)
+  for i in range(3):
+    p1[i] = p2[i] - t[i]*s + d*n23[i] + v21[i]*c
+
+cdef inline double torsion_angle(const double* bat, int offset, int n, \
+    const int* firstTorsionTInd) nogil:
+  # The torsion angle, converted from a phase angle if necessary
+  if firstTorsionTInd[n] == n:
+    return bat[offset+3*n+5]
+  return bat[offset+3*n+5] + bat[offset+5+3*firstTorsionTInd[n]]
 
-### BAT coordinate measurement
-@cython.boundscheck(False)
-@cython.wraparound(False)
 @cython.cdivision(True)
-cdef inline distance(double[:] p1, double[:] p2):
-  cdef double d2, delta_c
-  cdef int c
-  for c in range(3):
-    delta_c = p2[c] - p1[c]
-    d2 += delta_c*delta_c
-  return sqrt(d2)
+cdef void root_kernel(const double* bat, int offset, \
+    double* p1, double* p2, double* p3) nogil:
+  # Places the first three atoms
+  cdef double q2[3]
+  cdef double q3[3]
+  cdef double cp, sp, ct, st, co, so, x, y
+  cdef int i
+
+  p1[0] = 0.
+  p1[1] = 0.
+  p1[2] = 0.
+  p2[0] = 0.
+  p2[1] = 0.
+  p2[2] = bat[offset]
+  p3[0] = bat[offset+1]*sin(bat[offset+2])
+  p3[1] = 0.
+  p3[2] = bat[offset]-bat[offset+1]*cos(bat[offset+2])
+
+  # If appropriate, rotate and translate the first three atoms
+  if offset == 6:
+    # Rotate the third atom about the z axis by omega
+    co = cos(bat[5])
+    so = sin(bat[5])
+    x = co*p3[0] - so*p3[1]
+    y = so*p3[0] + co*p3[1]
+    p3[0] = x
+    p3[1] = y
+    # Rotate the second two atoms to point in the right direction
+    cp = cos(bat[3])
+    sp = sin(bat[3])
+    ct = cos(bat[4])
+    st = sin(bat[4])
+    q2[0] = cp*st*p2[2]
+    q2[1] = sp*st*p2[2]
+    q2[2] = ct*p2[2]
+    q3[0] = cp*ct*p3[0] - sp*p3[1] + cp*st*p3[2]
+    q3[1] = ct*sp*p3[0] + cp*p3[1] + sp*st*p3[2]
+    q3[2] = -st*p3[0] + ct*p3[2]
+    # Translate the first three atoms by the origin
+    for i in range(3):
+      p1[i] = bat[i]
+      p2[i] = q2[i] + bat[i]
+      p3[i] = q3[i] + bat[i]
 
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
-cdef inline angle(np.ndarray[np.double_t] p1, np.ndarray[np.double_t] p2, \
-    np.ndarray[np.double_t] p3):
-  cdef np.ndarray[np.double_t] v1 = p2 - p1
-  cdef np.ndarray[np.double_t] v2 = p2 - p3
-  return acos(max(-1.,min(1.,dotp(v1,v2)/\
-    sqrt(norm2(v1)*norm2(v2)))))
+cdef void Cartesian_kernel(const double* bat, double* XYZ, int offset, \
+    int ntorsions, const int* rootInd, const int* torsionInd, \
+    const int* firstTorsionTInd) nogil:
+  # Converts one configuration, bat[natoms*3-6+offset], to XYZ[natoms*3]
+  cdef int n
+  root_kernel(bat, offset, \
+    XYZ + 3*rootInd[0], XYZ + 3*rootInd[1], XYZ + 3*rootInd[2])
+  for n in range(ntorsions):
+    place_atom(XYZ + 3*torsionInd[4*n+1], XYZ + 3*torsionInd[4*n+2], \
+      XYZ + 3*torsionInd[4*n+3], bat[offset+3*n+3], bat[offset+3*n+4], \
+      torsion_angle(bat, offset, n, firstTorsionTInd), \
+      XYZ + 3*torsionInd[4*n])
 
-@cython.boundscheck(False)
-@cython.wraparound(False)
 @cython.cdivision(True)
-cdef dihedral(np.ndarray[np.double_t] p1, np.ndarray[np.double_t] p2, \
-    np.ndarray[np.double_t] p3, np.ndarray[np.double_t] p4):
-  cdef np.ndarray[np.double_t] v1, v2, v3, a, b
-  cdef double c, s
-  v1 = p2 - p1
-  v2 = p2 - p3
-  v3 = p3 - p4
-  a = normalize(cross(v1,v2))
-  b = normalize(cross(v3,v2))
-  c = dotp(a,b)
-  s = dotp(cross(b,a),normalize(v2))
-  return atan2(s,c)
+cdef inline double dihedral(const double* p1, const double* p2, \
+    const double* p3, const double* p4) nogil:
+  cdef double v1[3]
+  cdef double v2[3]
+  cdef double v3[3]
+  cdef double a[3]
+  cdef double b[3]
+  cdef double ba[3]
+  subtract(p2, p1, v1)
+  subtract(p2, p3, v2)
+  subtract(p3, p4, v3)
+  cross(v1, v2, a)
+  normalize(a)
+  cross(v3, v2, b)
+  normalize(b)
+  cross(b, a, ba)
+  return atan2(dotp(ba,v2)/sqrt(dotp(v2,v2)), dotp(a,b))
+
+cdef inline void frame(const double* p1, const double* p2, \
+    const double* p3, double* e) nogil:
+  # Orthonormal axes e[0:3], e[3:6], and e[6:9] defined by three atoms
+  cdef double v[3]
+  cdef double d
+  cdef int i
+  subtract(p2, p1, e)
+  normalize(e)
+  subtract(p3, p1, v)
+  d = dotp(e, v)
+  for i in range(3):
+    e[3+i] = v[i] - d*e[i]
+  normalize(e+3)
+  cross(e, e+3, e+6)
 
 @cython.boundscheck(False)
 @cython.wraparound(False)
 @cython.cdivision(True)
-cdef rotate123(np.ndarray[np.double_t] p1, \
-    np.ndarray[np.double_t] p2, np.ndarray[np.double_t] p3, \
-    np.ndarray[np.double_t] origin, \
-    double phi, double theta, double omega):
-  # Rotate the third atom by the appropriate value
-  cdef double co = cos(omega)
-  cdef double so = sin(omega)
-  cdef np.ndarray[np.double_t, ndim=2] Romega = np.array([[co, -so, 0],[so, co, 0], [0, 0, 1]])
-  p3 = Romega.dot(p3)
-  # Rotate the second two atoms to point in the right direction
-  cdef double cp = cos(phi)
-  cdef double sp = sin(phi)
-  cdef double ct = cos(theta)
-  cdef double st = sin(theta)
-  cdef np.ndarray[np.double_t, ndim=2] Re = np.array([[cp*ct,-sp,cp*st],[ct*sp,cp,sp*st],[-st,0,ct]])
-  p2 = Re.dot(p2)
-  p3 = Re.dot(p3)
-  # Translate the first three atoms by the origin
-  p1 += origin
-  p2 += origin
-  p3 += origin
-  return (p1,p2,p3)
+cdef void update_kernel(const double* bat, double* XYZ, int natoms, \
+    int offset, const int* rootInd, const int* torsionInd, \
+    const int* firstTorsionTInd, const int* changed, int nchanged, \
+    bint external, const int* subtreeInd, const int* subtreeAtoms, \
+    const int* closureInd, const int* closureTors, \
+    const int* rigid) nogil:
+  # Updates XYZ[natoms*3] for new values of the torsions in changed,
+  # which is in increasing order, and of the external coordinates
+  cdef double k[3]
+  cdef double o[3]
+  cdef double v[3]
+  cdef double kv[3]
+  cdef double e_o[9]
+  cdef double e_n[9]
+  cdef double r[9]
+  cdef double *p2
+  cdef double *p3
+  cdef double *x
+  cdef double delta, s, c, d
+  cdef int i, j, m, n, a
+
+  for j in range(nchanged):
+    n = changed[j]
+    delta = torsion_angle(bat, offset, n, firstTorsionTInd) - \
+      dihedral(XYZ + 3*torsionInd[4*n], XYZ + 3*torsionInd[4*n+1], \
+               XYZ + 3*torsionInd[4*n+2], XYZ + 3*torsionInd[4*n+3])
+    if delta == 0.:
+      continue
+    if rigid[n]:
+      # Rotate the subtree about the bond axis.
+      # Increasing the torsion is a rotation by -delta about p3-p2.
+      p2 = XYZ + 3*torsionInd[4*n+1]
+      p3 = XYZ + 3*torsionInd[4*n+2]
+      subtract(p3, p2, k)
+      normalize(k)
+      for i in range(3):
+        o[i] = p2[i]
+      s = -sin(delta)
+      c = cos(delta)
+      for a in range(subtreeInd[n], subtreeInd[n+1]):
+        x = XYZ + 3*subtreeAtoms[a]
+        subtract(x, o, v)
+        cross(k, v, kv)
+        d = dotp(k, v)*(1.0-c)
+        for i in range(3):
+          x[i] = o[i] + v[i]*c + kv[i]*s + k[i]*d
+    else:
+      # Rebuild atoms that depend on the torsion
+      for a in range(closureInd[n], closureInd[n+1]):
+        m = closureTors[a]
+        place_atom(XYZ + 3*torsionInd[4*m+1], XYZ + 3*torsionInd[4*m+2], \
+          XYZ + 3*torsionInd[4*m+3], bat[offset+3*m+3], bat[offset+3*m+4], \
+          torsion_angle(bat, offset, m, firstTorsionTInd), \
+          XYZ + 3*torsionInd[4*m])
+
+  if external:
+    # Move the molecule from the current to the new frame of the first atoms
+    frame(XYZ + 3*rootInd[0], XYZ + 3*rootInd[1], XYZ + 3*rootInd[2], e_o)
+    for i in range(3):
+      o[i] = XYZ[3*rootInd[0]+i]
+    root_kernel(bat, offset, r, r+3, r+6)
+    frame(r, r+3, r+6, e_n)
+    for a in range(natoms):
+      x = XYZ + 3*a
+      subtract(x, o, v)
+      d = dotp(e_o, v)
+      s = dotp(e_o+3, v)
+      c = dotp(e_o+6, v)
+      for i in range(3):
+        x[i] = r[i] + d*e_n[i] + s*e_n[3+i] + c*e_n[6+i]
 
 # Main converter class
 cdef class converter:
@@ -115,6 +351,7 @@ cdef class converter:
   # These attributes are already declared in the pxd file
   # cdef readonly int natoms, ntorsions
   # cdef np.ndarray rootInd, _torsionIndL, _firstTorsionTInd
+  # cdef int[::1] _rootInd_v, _torsionInd_v, _firstTorsionTInd_v
 
   def __init__(self, universe, molecule, initial_atom=None):
     self.molecule = molecule
@@ -189,171 +426,198 @@ cdef class converter:
       for n in range(len(prior_atoms))], dtype=int)
     self.ntorsions = self.natoms-3
 
+    # Contiguous C integer copies of the indices for the conversion kernels
+    self._rootInd_v = np.ascontiguousarray(self.rootInd, dtype=np.intc)
+    self._torsionInd_v = np.ascontiguousarray(\
+      self._torsionIndL.reshape(-1), dtype=np.intc)
+    self._firstTorsionTInd_v = np.ascontiguousarray(\
+      self._firstTorsionTInd, dtype=np.intc)
+
+    # Dependency tree for incremental reconstruction.
+    # The subtree of torsion n contains the atom it places and the atoms
+    # placed by later torsions that refer to an atom in the subtree.
+    # If every reference atom of the subtree is in the subtree or on the
+    # bond axis of n, changing torsion n rotates the subtree rigidly.
+    # Otherwise, e.g. in rings, its atoms are rebuilt one at a time.
+    subtreeInd = [0]
+    subtreeAtoms = []
+    closureInd = [0]
+    closureTors = []
+    rigid = []
+    for n in range(self.ntorsions):
+      (a1, a2, a3, a4) = self._torsionIndL[n]
+      subtree = set([a1])
+      closure = [n]
+      is_rigid = True
+      for m in range(n+1, self.ntorsions):
+        refs = self._torsionIndL[m][1:]
+        if len([r for r in refs if r in subtree])>0:
+          if len([r for r in refs \
+              if (r not in subtree) and (r!=a2) and (r!=a3)])>0:
+            is_rigid = False
+          subtree.add(self._torsionIndL[m][0])
+          closure.append(m)
+      subtreeAtoms += sorted(subtree)
+      subtreeInd.append(len(subtreeAtoms))
+      closureTors += closure
+      closureInd.append(len(closureTors))
+      rigid.append(1 if is_rigid else 0)
+    self._subtreeInd_v = np.array(subtreeInd, dtype=np.intc)
+    self._subtreeAtoms_v = np.array(subtreeAtoms, dtype=np.intc)
+    self._closureInd_v = np.array(closureInd, dtype=np.intc)
+    self._closureTors_v = np.array(closureTors, dtype=np.intc)
+    self._rigid_v = np.array(rigid, dtype=np.intc)
+
   def getFirstTorsionInds(self, extended):
     offset = 6 if extended else 0
     torsionInds = np.array(range(offset+5,self.natoms*3,3))
     primaryTorsions = sorted(list(set(self._firstTorsionTInd)))
     return list(torsionInds[primaryTorsions])
 
-  @cython.boundscheck(False)
-  @cython.wraparound(False)
-  @cython.cdivision(True)
-  cpdef BAT(self, double[:,:] XYZ, bool extended):
+  cpdef BAT(self, XYZ, bool extended):
     """
     Conversion from Cartesian to Bond-Angle-Torsion coordinates
     :param extended: whether to include external coordinates or not
-    :param Cartesian: Cartesian coordinates. If None, then the molecules' coordinates will be used
+    :param XYZ: Cartesian coordinates, an (natoms, 3) array
     """
     cdef int offset = 6 if extended else 0
-    cdef np.ndarray[np.double_t] bat
-    cdef np.ndarray[np.double_t] p1, p2, p3, p4
-    cdef int a1, a2, a3, a4, n, i, batInd
-
-    cdef np.ndarray[np.double_t] v1, v2, v3, a, b
-    cdef double c, s, norm_v1_2, norm_v2_2
-
-    bat = np.zeros((self.natoms*3-6+offset,))
-    p1 = np.zeros((3,))
-    p2 = np.zeros((3,))
-    p3 = np.zeros((3,))
-    p4 = np.zeros((3,))
-
-    # Memory Views
-    cpdef double[:] bat_v = bat
-    cdef double[:] p1_v = p1
-    cdef double[:] p2_v = p2
-    cdef double[:] p3_v = p3
-    cdef double[:] p4_v = p4
-
-    for i in range(3):
-      p1_v[i] = XYZ[self.rootInd[0],i]
-      p2_v[i] = XYZ[self.rootInd[1],i]
-      p3_v[i] = XYZ[self.rootInd[2],i]
-
-    if extended:
-      bat[:offset] = self.extended_coordinates(p1,p2,p3)
-    bat_v[offset] = distance(p1,p2)
-    bat_v[offset+1] = distance(p2,p3)
-    bat_v[offset+2] = angle(p1,p2,p3)
-
-    for n in range(self._torsionIndL.shape[0]):
-      for i in range(3):
-        p1_v[i] = XYZ[self._torsionIndL[n,0],i]
-        p2_v[i] = XYZ[self._torsionIndL[n,1],i]
-        p3_v[i] = XYZ[self._torsionIndL[n,2],i]
-        p4_v[i] = XYZ[self._torsionIndL[n,3],i]
-
-      v1 = p2 - p1
-      v2 = p2 - p3
-      v3 = p3 - p4
-      a = normalize(cross(v1,v2))
-      b = normalize(cross(v3,v2))
-      c = dotp(a,b)
-      norm_v1_2 = norm2(v1)
-      norm_v2_2 = norm2(v2)
-      s = dotp(cross(b,a),v2/sqrt(norm_v2_2))
-
-      batInd = offset+3*n+3
-      bat_v[batInd] = sqrt(norm_v1_2)
-      bat_v[batInd+1] = acos(max(-1.,min(1.,dotp(v1,v2)/\
-        sqrt(norm_v1_2*norm_v2_2))))
-      bat_v[batInd+2] = atan2(s,c)
-      if self._firstTorsionTInd[n] != n:
-        bat_v[batInd+2] -= bat_v[offset+5+3*self._firstTorsionTInd[n]]
-
+    cdef double[:, ::1] XYZ_v = np.ascontiguousarray(XYZ, dtype=np.double)
+    cdef np.ndarray[np.double_t] bat = np.zeros((self.natoms*3-6+offset,))
+    cdef double[::1] bat_v = bat
+    BAT_kernel(&XYZ_v[0,0], &bat_v[0], offset, self.ntorsions, \
+      &self._rootInd_v[0], &self._torsionInd_v[0], \
+      &self._firstTorsionTInd_v[0])
     return bat
 
   @cython.boundscheck(False)
   @cython.wraparound(False)
-  @cython.cdivision(True)
-  cpdef extended_coordinates(self, np.ndarray[np.double_t] p1, \
-      np.ndarray[np.double_t] p2, np.ndarray[np.double_t] p3):
-    # The rotation axis is a normalized vector pointing from atom 0 to 1
-    # It is described in two degrees of freedom by the polar angle and azimuth
-    cdef np.ndarray[np.double_t] e = normalize(p2-p1)
-    cdef double phi = atan2(e[1],e[0]) # Polar angle
-    cdef double theta = acos(e[2]) # Azimuthal angle
-    # Rotation to the z axis
-    cdef double cp = cos(phi)
-    cdef double sp = sin(phi)
-    cdef double ct = cos(theta)
-    cdef double st = sin(theta)
-    cdef np.ndarray[np.double_t, ndim=2] Rz = np.array([[cp*ct,ct*sp,-st],[-sp,cp,0],[cp*st,sp*st,ct]])
-    cdef np.ndarray[np.double_t] pos2 = Rz.dot(np.array(p3-p1))
-    # Angle about the rotation axis
-    cdef double omega = atan2(pos2[1],pos2[0])
+  def BAT_many(self, XYZs, bool extended):
+    """
+    Conversion of many configurations
+    from Cartesian to Bond-Angle-Torsion coordinates
+    :param XYZs: Cartesian coordinates, an (nconfs, natoms, 3) array
+    :param extended: whether to include external coordinates or not
+    :returns: an (nconfs, nBAT) array
+    Configurations are converted in parallel when OpenMP is available.
+    """
+    cdef int offset = 6 if extended else 0
+    cdef double[:, :, ::1] XYZ_v = np.ascontiguousarray(\
+      np.reshape(XYZs, (-1, self.natoms, 3)), dtype=np.double)
+    cdef int nconfs = XYZ_v.shape[0]
+    cdef int nBAT = self.natoms*3-6+offset
+    cdef np.ndarray[np.double_t, ndim=2] bat = np.zeros((nconfs, nBAT))
+    cdef double[:, ::1] bat_v = bat
+    cdef int ntorsions = self.ntorsions
+    cdef int* rootInd = &self._rootInd_v[0]
+    cdef int* torsionInd = &self._torsionInd_v[0]
+    cdef int* firstTorsionTInd = &self._firstTorsionTInd_v[0]
+    cdef int c
+    if nconfs == 0:
+      return bat
+    for c in prange(nconfs, nogil=True, schedule='static'):
+      BAT_kernel(&XYZ_v[c,0,0], &bat_v[c,0], offset, ntorsions, \
+        rootInd, torsionInd, firstTorsionTInd)
+    return bat
+
+  cpdef extended_coordinates(self, p1, p2, p3):
+    cdef double[::1] p1_v = np.ascontiguousarray(p1, dtype=np.double)
+    cdef double[::1] p2_v = np.ascontiguousarray(p2, dtype=np.double)
+    cdef double[::1] p3_v = np.ascontiguousarray(p3, dtype=np.double)
     cdef np.ndarray[np.double_t] coords = np.zeros((6,))
-    coords[:3] = p1
-    coords[3] = phi
-    coords[4] = theta
-    coords[5] = omega
+    cdef double[::1] coords_v = coords
+    extended_kernel(&p1_v[0], &p2_v[0], &p3_v[0], &coords_v[0])
     return coords
 
-  @cython.boundscheck(False)
-  @cython.wraparound(False)
-  @cython.cdivision(True)
-  cpdef Cartesian(self, double[:] BAT):
+  cpdef Cartesian(self, BAT):
     """
-    Conversion from (internal or extended) Bond-Angle-Torsion 
+    Conversion from (internal or extended) Bond-Angle-Torsion
     to Cartesian coordinates
     """
-    cdef int offset, batInd, firstTorsionInd, i
-    cdef np.ndarray[np.double_t] p1, p2, p3, p4, n23, v21
-    cdef np.ndarray[np.double_t, ndim=2] XYZ
-    cdef double s, c, bond, angle, torsion
-
-    offset = 6 if BAT.shape[0]==(3*self.natoms) else 0
-
-    p1 = np.array([0.,0.,0.])
-    p2 = np.array([0.,0.,BAT[offset]])
-    p3 = np.array([BAT[offset+1]*sin(BAT[offset+2]), 0., \
-      BAT[offset]-BAT[offset+1]*cos(BAT[offset+2])])
-    p4 = np.array([0.,0.,0.])
-
-    # If appropriate, rotate and translate the first three atoms
-    if offset==6:
-      (p1,p2,p3) = rotate123(p1,p2,p3,np.array(BAT[:3]),BAT[3],BAT[4],BAT[5])
-
-    XYZ = np.zeros((self.natoms,3))
-
-    # Memoryviews for faster indexing
-    cdef double[:,:] XYZ_v = XYZ
-    cdef double[:] p1_v = p1
-    cdef double[:] p2_v = p2
-    cdef double[:] p3_v = p3
-    cdef double[:] p4_v = p4
-
-    for i in range(3):
-      XYZ_v[self.rootInd[0],i] = p1[i]
-      XYZ_v[self.rootInd[1],i] = p2[i]
-      XYZ_v[self.rootInd[2],i] = p3[i]
+    cdef double[::1] BAT_v = np.ascontiguousarray(BAT, dtype=np.double)
+    cdef int offset = 6 if BAT_v.shape[0]==(3*self.natoms) else 0
+    cdef np.ndarray[np.double_t, ndim=2] XYZ = np.zeros((self.natoms,3))
+    cdef double[:, ::1] XYZ_v = XYZ
+    Cartesian_kernel(&BAT_v[0], &XYZ_v[0,0], offset, self.ntorsions, \
+      &self._rootInd_v[0], &self._torsionInd_v[0], \
+      &self._firstTorsionTInd_v[0])
+    return XYZ
 
-    for n in range(self._torsionIndL.shape[0]):
-      for i in range(3):
-        p2_v[i] = XYZ_v[self._torsionIndL[n,1],i]
-        p3_v[i] = XYZ_v[self._torsionIndL[n,2],i]
-        p4_v[i] = XYZ_v[self._torsionIndL[n,3],i]
-
-      batInd = offset+3*n+3
-      bond = BAT[batInd]
-      angle = BAT[batInd+1]
-      if self._firstTorsionTInd[n]==n:
-        torsion = BAT[batInd+2]
+  @cython.boundscheck(False)
+  @cython.wraparound(False)
+  cpdef Cartesian_update(self, XYZ, BAT, changed):
+    """
+    Conversion from (internal or extended) Bond-Angle-Torsion
+    to Cartesian coordinates, given Cartesian coordinates XYZ
+    that only differ from BAT in the coordinates with indices in changed.
+    Only atoms that depend on changed torsions are moved, and
+    changed external coordinates are applied as a rigid transformation.
+    If bond lengths or angles change, all atoms are rebuilt.
+    Without external coordinates, XYZ keeps its position and orientation.
+    :returns: a new (natoms, 3) array
+    """
+    cdef double[::1] BAT_v = np.ascontiguousarray(BAT, dtype=np.double)
+    cdef int offset = 6 if BAT_v.shape[0]==(3*self.natoms) else 0
+    cdef np.ndarray[np.double_t, ndim=2] XYZ_n = \
+      np.array(XYZ, dtype=np.double, order='C')
+    cdef double[:, ::1] XYZ_v = XYZ_n
+    cdef int ind, n, ntorsions_changed
+    cdef bint external = False
+    cdef int[::1] direct = np.zeros(self.ntorsions, dtype=np.intc)
+    cdef int[::1] torsions_v = np.empty(self.ntorsions, dtype=np.intc)
+    for ind in changed:
+      if ind < offset:
+        external = True
+      elif ((ind-offset)%3 == 2) and (ind-offset > 2):
+        direct[(ind-offset-5)/3] = 1
       else:
-        firstTorsionInd = offset+5+3*self._firstTorsionTInd[n]
-        torsion = BAT[batInd+2] + BAT[firstTorsionInd]
-
-      n23 = normalize(p3-p2)
-
-      s = sin(angle)
-      c = cos(angle)
-      v21 = (bond*c)*n23 - (bond*s)*cross(normalize(cross(p4-p3,n23)),n23)
-
-      s = sin(torsion)
-      c = cos(torsion)
-      p1 = p2 - cross(n23,v21)*s + dotp(n23,v21)*n23*(1.0-c) + v21*c
-      XYZ[self._torsionIndL[n,0],:] = p1
+        return self.Cartesian(BAT)
+    # Changing a primary torsion also changes torsions with phase angles
+    ntorsions_changed = 0
+    for n in range(self.ntorsions):
+      if direct[n] or direct[self._firstTorsionTInd_v[n]]:
+        torsions_v[ntorsions_changed] = n
+        ntorsions_changed += 1
+    update_kernel(&BAT_v[0], &XYZ_v[0,0], self.natoms, offset, \
+      &self._rootInd_v[0], &self._torsionInd_v[0], \
+      &self._firstTorsionTInd_v[0], \
+      &torsions_v[0], ntorsions_changed, \
+      external, &self._subtreeInd_v[0], &self._subtreeAtoms_v[0], \
+      &self._closureInd_v[0], &self._closureTors_v[0], &self._rigid_v[0])
+    return XYZ_n
 
+  @cython.boundscheck(False)
+  @cython.wraparound(False)
+  def Cartesian_many(self, BATs, out=None):
+    """
+    Conversion of many configurations from (internal or extended)
+    Bond-Angle-Torsion to Cartesian coordinates
+    :param BATs: an (nconfs, nBAT) array
+    :param out: an optional C-contiguous (nconfs, natoms, 3) array
+      in which to store the result
+    :returns: an (nconfs, natoms, 3) array
+    Configurations are converted in parallel when OpenMP is available.
+    """
+    cdef double[:, ::1] BAT_v = np.ascontiguousarray(BATs, dtype=np.double)
+    cdef int nconfs = BAT_v.shape[0]
+    cdef int offset = 6 if BAT_v.shape[1]==(3*self.natoms) else 0
+    cdef np.ndarray[np.double_t, ndim=3] XYZ
+    if out is None:
+      XYZ = np.zeros((nconfs,self.natoms,3))
+    else:
+      if (out.shape[0] != nconfs) or (out.shape[1] != self.natoms):
+        raise Exception('The output array has the wrong shape')
+      XYZ = out
+    cdef double[:, :, ::1] XYZ_v = XYZ
+    cdef int ntorsions = self.ntorsions
+    cdef int* rootInd = &self._rootInd_v[0]
+    cdef int* torsionInd = &self._torsionInd_v[0]
+    cdef int* firstTorsionTInd = &self._firstTorsionTInd_v[0]
+    cdef int c
+    if nconfs == 0:
+      return XYZ
+    for c in prange(nconfs, nogil=True, schedule='static'):
+      Cartesian_kernel(&BAT_v[c,0], &XYZ_v[c,0,0], offset, ntorsions, \
+        rootInd, torsionInd, firstTorsionTInd)
     return XYZ
 
   def showMolecule(self, colorBy=None, label=False, dcdFN=None):
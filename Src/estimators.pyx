@@ -0,0 +1,349 @@
+#!/usr/bin/env python
+
+# Free energy estimators for samples of reduced work, w = u_1 - u_0
+#
+# Sums of exponentials are accumulated in a single pass with a running
+# maximum (streaming log-sum-exp), so they neither overflow nor require
+# shifted copies of the data. Samples may carry importance weights.
+#
+# Bootstrap replicates are never materialized. Every replicate has its
+# own counter-based random number generator, from which it draws either
+# multinomial resampling counts (n indices with replacement) or Poisson(1)
+# weights while it streams over the original arrays. The counts can be
+# regenerated from the seed, so BAR iterations see the same replicate
+# without storing it. Replicates are evaluated in parallel when OpenMP
+# is available.
+
+import cython
+
+import numpy as np
+cimport numpy as np
+
+from libc.math cimport exp, log, log1p, INFINITY, NAN
+from libc.stdint cimport uint64_t
+from cython.parallel cimport prange
+
+# Resampling schemes
+cdef enum:
+  NONE = 0
+  MULTINOMIAL = 1
+  POISSON = 2
+
+cdef inline uint64_t splitmix64(uint64_t* state) nogil:
+  cdef uint64_t z
+  state[0] += <uint64_t>0x9E3779B97F4A7C15
+  z = state[0]
+  z = (z ^ (z >> 30)) * <uint64_t>0xBF58476D1CE4E5B9
+  z = (z ^ (z >> 27)) * <uint64_t>0x94D049BB133111EB
+  return z ^ (z >> 31)
+
+cdef inline double uniform(uint64_t* state) nogil:
+  return (splitmix64(state) >> 11) * (1.0/9007199254740992.0)
+
+cdef inline int poisson1(uint64_t* state) nogil:
+  # Knuth's method for a Poisson random variable with unit mean
+  cdef double L = 0.36787944117144233
+  cdef double p = uniform(state)
+  cdef int k = 0
+  while p > L:
+    k += 1
+    p *= uniform(state)
+  return k
+
+cdef inline int random_index(uint64_t* state, int n) nogil:
+  cdef int j = <int>(uniform(state)*n)
+  return j if j < n else n - 1
+
+cdef struct lse_t:
+  double m # Running maximum
+  double s # Sum of c*exp(x - m)
+
+cdef inline void lse_init(lse_t* a) nogil:
+  a.m = -INFINITY
+  a.s = 0.
+
+cdef inline void lse_add(lse_t* a, double x, double c) nogil:
+  # Adds c*exp(x). Terms with x = -inf, e.g. from samples with infinite
+  # work, contribute nothing and would otherwise give NaN.
+  if (c == 0.) or (x == -INFINITY):
+    return
+  if x <= a.m:
+    a.s += c*exp(x - a.m)
+  else:
+    a.s = a.s*exp(a.m - x) + c
+    a.m = x
+
+cdef inline double lse_value(lse_t* a) nogil:
+  return a.m + log(a.s)
+
+cdef inline double softplus(double x) nogil:
+  # log(1 + exp(x))
+  if x > 0.:
+    return x + log1p(exp(-x))
+  return log1p(exp(x))
+
+cdef struct sample_t:
+  const double* w
+  const double* v # Importance weights, or NULL
+  int n
+  int scheme
+  uint64_t seed
+
+cdef inline double weight(const sample_t* d, int i) nogil:
+  return 1. if d.v == NULL else d.v[i]
+
+cdef void weighted_lse(const sample_t* d, double sign, double shift, \
+    int soft, lse_t* a, double* W) nogil:
+  # Streams over a (resampled) sample, accumulating the weighted
+  # log-sum-exp of x = sign*w + shift, or of -softplus(sign*w + shift)
+  # if soft, and the total weight W.
+  cdef uint64_t state = d.seed
+  cdef int i, j, k
+  cdef double c, x
+  lse_init(a)
+  W[0] = 0.
+  if d.scheme == MULTINOMIAL:
+    for i in range(d.n):
+      j = random_index(&state, d.n)
+      c = weight(d, j)
+      x = sign*d.w[j] + shift
+      lse_add(a, -softplus(x) if soft else x, c)
+      W[0] += c
+  else:
+    for i in range(d.n):
+      if d.scheme == POISSON:
+        k = poisson1(&state)
+        if k == 0:
+          continue
+        c = k*weight(d, i)
+      else:
+        c = weight(d, i)
+      x = sign*d.w[i] + shift
+      lse_add(a, -softplus(x) if soft else x, c)
+      W[0] += c
+
+cdef double EXP_sample(const sample_t* d) nogil:
+  cdef lse_t a
+  cdef double W
+  weighted_lse(d, -1., 0., 0, &a, &W)
+  if W == 0.:
+    return NAN
+  return -(lse_value(&a) - log(W))
+
+cdef double BAR_residual(const sample_t* F, const sample_t* R, \
+    double M, double df) nogil:
+  # Difference between the logarithms of the two sides of the
+  # BAR equation, which increases with df
+  cdef lse_t a, b
+  cdef double W
+  weighted_lse(F, 1., M - df, 1, &a, &W)
+  weighted_lse(R, 1., df - M, 1, &b, &W)
+  return lse_value(&a) - lse_value(&b)
+
+cdef double BAR_sample(const sample_t* F, const sample_t* R, \
+    double tol, int max_iter) nogil:
+  cdef lse_t a, b
+  cdef double nF, nR, M, lo, hi, mid, width, r_lo, r_hi, r_mid
+  cdef int it
+  # Sample sizes and exponential averages in both directions
+  weighted_lse(F, -1., 0., 0, &a, &nF)
+  weighted_lse(R, -1., 0., 0, &b, &nR)
+  if (nF == 0.) or (nR == 0.):
+    return NAN
+  M = log(nF/nR)
+  lo = -(lse_value(&a) - log(nF))
+  hi = lse_value(&b) - log(nR)
+  if lo > hi:
+    lo, hi = hi, lo
+  width = 1.
+  lo -= width
+  hi += width
+  # Bracket the root
+  r_lo = BAR_residual(F, R, M, lo)
+  r_hi = BAR_residual(F, R, M, hi)
+  it = 0
+  while ((r_lo > 0.) or (r_hi < 0.)) and (it < 64):
+    width *= 2.
+    if r_lo > 0.:
+      lo -= width
+      r_lo = BAR_residual(F, R, M, lo)
+    if r_hi < 0.:
+      hi += width
+      r_hi = BAR_residual(F, R, M, hi)
+    it += 1
+  if (r_lo > 0.) or (r_hi < 0.):
+    return NAN
+  # Bisection
+  for it in range(max_iter):
+    mid = 0.5*(lo + hi)
+    if (hi - lo) < tol:
+      break
+    r_mid = BAR_residual(F, R, M, mid)
+    if r_mid < 0.:
+      lo = mid
+    else:
+      hi = mid
+  return 0.5*(lo + hi)
+
+cdef inline void sample_init(sample_t* d, const double* w, const double* v, \
+    int n, int scheme, uint64_t seed) nogil:
+  d.w = w
+  d.v = v
+  d.n = n
+  d.scheme = scheme
+  d.seed = seed
+
+cdef double EXP_replicate(const double* w, const double* v, int n, \
+    int scheme, uint64_t seed) nogil:
+  cdef sample_t d
+  sample_init(&d, w, v, n, scheme, seed)
+  return EXP_sample(&d)
+
+cdef double BAR_replicate(const double* wF, int nF, const double* wR, int nR, \
+    int scheme, uint64_t seedF, uint64_t seedR, double tol, \
+    int max_iter) nogil:
+  cdef sample_t F, R
+  sample_init(&F, wF, NULL, nF, scheme, seedF)
+  sample_init(&R, wR, NULL, nR, scheme, seedR)
+  return BAR_sample(&F, &R, tol, max_iter)
+
+cdef inline uint64_t replicate_seed(uint64_t seed0, int b) nogil:
+  return seed0 + (<uint64_t>b)*<uint64_t>0xD1B54A32D192ED03
+
+cdef int parse_scheme(scheme) except -1:
+  if scheme == 'multinomial':
+    return MULTINOMIAL
+  elif scheme == 'poisson':
+    return POISSON
+  raise Exception('Unknown bootstrap scheme %s' % scheme)
+
+cdef uint64_t base_seed(seed):
+  if seed is None:
+    seed = np.random.randint(0, 2**31 - 1)
+  return <uint64_t>seed
+
+def _as_array(x, n=None):
+  x = np.ascontiguousarray(x, dtype=np.double).ravel()
+  if (n is not None) and (x.shape[0] != n):
+    raise Exception('Weights and samples have different lengths')
+  return x
+
+def EXP(w, weights=None):
+  """
+  Exponential averaging (free energy perturbation) estimate
+  :param w: reduced work of samples from the initial state
+  :param weights: importance weights of the samples
+  :return: -ln(<exp(-w)>), with the average weighted by weights
+  """
+  cdef double[::1] w_v = _as_array(w)
+  cdef double[::1] v_v
+  cdef const double* v = NULL
+  if w_v.shape[0] == 0:
+    raise Exception('No samples')
+  if weights is not None:
+    v_v = _as_array(weights, w_v.shape[0])
+    v = &v_v[0]
+  return EXP_replicate(&w_v[0], v, w_v.shape[0], NONE, 0)
+
+def BAR(w_F, w_R, weights_F=None, weights_R=None, tol=1.0E-8, max_iter=100):
+  """
+  Bennett acceptance ratio estimate
+  :param w_F: reduced work of samples from the initial state
+  :param w_R: reduced work of samples from the final state,
+    for the reverse transition
+  :param weights_F: importance weights of the forward samples
+  :param weights_R: importance weights of the reverse samples
+  :param tol: absolute tolerance of the free energy difference
+  :param max_iter: maximum number of bisection iterations
+  :return: the reduced free energy difference from the initial to the
+    final state
+  """
+  cdef double[::1] wF_v = _as_array(w_F)
+  cdef double[::1] wR_v = _as_array(w_R)
+  cdef double[::1] vF_v
+  cdef double[::1] vR_v
+  cdef sample_t F, R
+  if (wF_v.shape[0] == 0) or (wR_v.shape[0] == 0):
+    raise Exception('No samples')
+  sample_init(&F, &wF_v[0], NULL, wF_v.shape[0], NONE, 0)
+  sample_init(&R, &wR_v[0], NULL, wR_v.shape[0], NONE, 0)
+  if weights_F is not None:
+    vF_v = _as_array(weights_F, F.n)
+    F.v = &vF_v[0]
+  if weights_R is not None:
+    vR_v = _as_array(weights_R, R.n)
+    R.v = &vR_v[0]
+  df = BAR_sample(&F, &R, tol, max_iter)
+  if np.isnan(df):
+    raise Exception('BAR failed to bracket the free energy difference')
+  return df
+
+@cython.boundscheck(False)
+def bootstrap_EXP(w, weights=None, int reps=50, scheme='multinomial', \
+    seed=None):
+  """
+  Bootstrap replicates of the exponential averaging estimate
+  :param w: reduced work of samples from the initial state
+  :param weights: importance weights of the samples
+  :param reps: number of bootstrap replicates
+  :param scheme: 'multinomial' to resample with replacement or
+    'poisson' to weight samples by Poisson(1) counts
+  :param seed: base seed of the replicate random number generators
+  :return: an array with the estimate of each replicate
+  """
+  cdef double[::1] w_v = _as_array(w)
+  cdef double[::1] v_v
+  cdef const double* v = NULL
+  cdef int n = w_v.shape[0]
+  cdef int s = parse_scheme(scheme)
+  cdef uint64_t seed0 = base_seed(seed)
+  cdef double[::1] out_v
+  cdef int b
+  if n == 0:
+    raise Exception('No samples')
+  if weights is not None:
+    v_v = _as_array(weights, n)
+    v = &v_v[0]
+  out = np.zeros(reps)
+  if reps == 0:
+    return out
+  out_v = out
+  for b in prange(reps, nogil=True, schedule='dynamic'):
+    out_v[b] = EXP_replicate(&w_v[0], v, n, s, replicate_seed(seed0, b))
+  return out
+
+@cython.boundscheck(False)
+def bootstrap_BAR(w_F, w_R, int reps=50, scheme='multinomial', \
+    seed=None, double tol=1.0E-8, int max_iter=100):
+  """
+  Bootstrap replicates of the Bennett acceptance ratio estimate
+  :param w_F: reduced work of samples from the initial state
+  :param w_R: reduced work of samples from the final state
+  :param reps: number of bootstrap replicates
+  :param scheme: 'multinomial' or 'poisson', as in bootstrap_EXP.
+    Forward and reverse samples are resampled independently.
+  :param seed: base seed of the replicate random number generators
+  :param tol: absolute tolerance of the free energy difference
+  :param max_iter: maximum number of bisection iterations
+  :return: an array with the estimate of each replicate,
+    which is NaN if BAR fails for the replicate
+  """
+  cdef double[::1] wF_v = _as_array(w_F)
+  cdef double[::1] wR_v = _as_array(w_R)
+  cdef int nF = wF_v.shape[0]
+  cdef int nR = wR_v.shape[0]
+  cdef int s = parse_scheme(scheme)
+  cdef uint64_t seed0 = base_seed(seed)
+  cdef double[::1] out_v
+  cdef int b
+  if (nF == 0) or (nR == 0):
+    raise Exception('No samples')
+  out = np.zeros(reps)
+  if reps == 0:
+    return out
+  out_v = out
+  for b in prange(reps, nogil=True, schedule='dynamic'):
+    out_v[b] = BAR_replicate(&wF_v[0], nF, &wR_v[0], nR, s, \
+      replicate_seed(seed0, 2*b), replicate_seed(seed0, 2*b+1), \
+      tol, max_iter)
+  return out
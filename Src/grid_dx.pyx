@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+
+# Parses and formats the values section of dx grid files.
+# The file itself is read and written by AlGDock.IO.Grid, in chunks,
+# so that plain and gzipped files are handled the same way.
+
+import cython
+
+import numpy as np
+cimport numpy as np
+
+from libc.stdlib cimport strtod, malloc, free
+from libc.stdio cimport snprintf
+from libc.math cimport isnan
+from cpython.bytes cimport PyBytes_AS_STRING, PyBytes_GET_SIZE, \
+  PyBytes_FromStringAndSize
+
+ctypedef np.float_t float_t
+ctypedef np.int_t int_t
+
+cdef inline bint is_space(char c):
+  return (c==' ') or (c=='\n') or (c=='\t') or (c=='\r')
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+cpdef parse_dx_vals(bytes buf, float_t[::1] out, int_t n, bint final):
+  """
+  Parses whitespace-separated values from buf into out, starting at out[n],
+  until out is full or buf runs out.
+
+  Unless final is true, a value at the very end of buf may be incomplete,
+  so it is left for the next call.
+  Returns the new n and the number of bytes of buf that were consumed.
+  """
+  cdef char* start = PyBytes_AS_STRING(buf)
+  cdef char* buf_end = start + PyBytes_GET_SIZE(buf)
+  cdef char* p = start
+  cdef char* token_end
+  cdef char* parse_end
+  cdef int_t n_max = out.shape[0]
+
+  while n<n_max:
+    while (p<buf_end) and is_space(p[0]):
+      p += 1
+    if p==buf_end:
+      break
+    token_end = p
+    while (token_end<buf_end) and not is_space(token_end[0]):
+      token_end += 1
+    if (token_end==buf_end) and not final:
+      break
+    # bytes objects are null terminated, so strtod stops at buf_end
+    out[n] = strtod(p, &parse_end)
+    if parse_end!=token_end:
+      raise Exception('Could not parse dx value ' + \
+        PyBytes_FromStringAndSize(p, token_end-p))
+    p = token_end
+    n += 1
+  return (n, p - start)
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+cpdef bytes format_dx_vals(float_t[::1] vals):
+  """
+  Formats values as '%6e', three per line, like the original dx writer
+  """
+  cdef int_t n, nvals, width
+  cdef int_t max_width = 32
+  cdef char* text
+  cdef char* p
+  cdef bytes formatted
+
+  nvals = vals.shape[0]
+  text = <char*>malloc(nvals*max_width+1)
+  if text==NULL:
+    raise MemoryError()
+  p = text
+  try:
+    for n in range(nvals):
+      if isnan(vals[n]):
+        width = snprintf(p, max_width, "nan")
+      else:
+        width = snprintf(p, max_width, "%6e", vals[n])
+      p += width
+      if (n%3==2) or (n==nvals-1):
+        p[0] = '\n'
+      else:
+        p[0] = ' '
+      p += 1
+    formatted = PyBytes_FromStringAndSize(text, p-text)
+  finally:
+    free(text)
+  return formatted
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cpdef crop_vals(float_t[::1] vals, int_t n_start, int_t[:] counts_o, \
+    int_t[:] min_ijk, int_t[:] counts, float_t[::1] out):
+  """
+  Copies values that are inside a box into out.
+
+  vals holds the points with flat indices [n_start, n_start+len(vals))
+    of a grid with counts_o points per dimension.
+  The box starts at min_ijk and has counts points per dimension.
+  out is the flattened box.
+  """
+  cdef int_t n, nyz_o, i, j, k
+
+  nyz_o = counts_o[1]*counts_o[2]
+  for n in range(vals.shape[0]):
+    i = (n_start+n)/nyz_o - min_ijk[0]
+    j = ((n_start+n)%nyz_o)/counts_o[2] - min_ijk[1]
+    k = (n_start+n)%counts_o[2] - min_ijk[2]
+    if (i>=0) and (i<counts[0]) and \
+       (j>=0) and (j<counts[1]) and \
+       (k>=0) and (k<counts[2]):
+      out[(i*counts[1]+j)*counts[2]+k] = vals[n]
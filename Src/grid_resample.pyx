@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+
+# Resamples values on regular grids (e.g. from APBS) onto another regular grid.
+# Grids are given as a 3D array of values, an origin, and a spacing.
+
+import cython
+
+import numpy as np
+cimport numpy as np
+
+from libc.math cimport floor
+
+ctypedef np.float_t float_t
+ctypedef np.int_t int_t
+
+# Catmull-Rom spline through p[0], p[1], p[2], p[3] at x in [0,1] between
+# p[1] and p[2]
+@cython.cdivision(True)
+cdef inline float_t spline(float_t p0, float_t p1, float_t p2, float_t p3, \
+    float_t x):
+  return p1+.5*x*(-p0+p2+x*(2.*p0-5.*p1+4.*p2-p3+x*(-p0+3.*p1-3.*p2+p3)))
+
+# Interpolates a level at the points with flat indices
+# [n_start, n_start+len(out)) of the destination grid.
+# Points outside the level are skipped unless clamp is true,
+# in which case they take the value at the nearest point on the level.
+# If order is 3, Catmull-Rom interpolation is used where
+# the 4x4x4 neighborhood is on the level and
+# trilinear interpolation is used elsewhere.
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef interpolate_level(float_t[:,:,::1] vals, \
+    float_t[:] level_origin, float_t[:] level_spacing, \
+    float_t[:] origin, float_t[:] spacing, int_t[:] counts, \
+    int_t n_start, float_t[::1] out, int_t order, bint clamp):
+  cdef int_t n, n_end, nyz, i, j, k, d, a, b, i1, j1, k1
+  cdef int_t ind[3]
+  cdef int_t level_counts[3]
+  cdef float_t f[3]
+  cdef float_t t[3]
+  cdef float_t p[4]
+  cdef float_t q[4]
+  cdef float_t c00, c01, c10, c11, c0, c1
+  cdef bint inside
+
+  for d in range(3):
+    level_counts[d] = vals.shape[d]
+  nyz = counts[1]*counts[2]
+  n_end = n_start + out.shape[0]
+  n = n_start
+  while n<n_end:
+    i = n/nyz
+    j = (n%nyz)/counts[2]
+    k = n%counts[2]
+    f[0] = (origin[0] + i*spacing[0] - level_origin[0])/level_spacing[0]
+    f[1] = (origin[1] + j*spacing[1] - level_origin[1])/level_spacing[1]
+    f[2] = (origin[2] + k*spacing[2] - level_origin[2])/level_spacing[2]
+    inside = True
+    for d in range(3):
+      # Allow for roundoff at the edges of the level
+      if (f[d] < -1.0E-6) or (f[d] > level_counts[d]-1+1.0E-6):
+        inside = False
+      if f[d] < 0.:
+        f[d] = 0.
+      elif f[d] > level_counts[d]-1:
+        f[d] = level_counts[d]-1
+      if level_counts[d] > 1:
+        ind[d] = min(<int_t>floor(f[d]), level_counts[d]-2)
+      else:
+        ind[d] = 0
+      t[d] = f[d] - ind[d]
+    if (not inside) and (not clamp):
+      n += 1
+      continue
+
+    if (order==3) and \
+       (ind[0]>0) and (ind[0]+2<level_counts[0]) and \
+       (ind[1]>0) and (ind[1]+2<level_counts[1]) and \
+       (ind[2]>0) and (ind[2]+2<level_counts[2]):
+      for a in range(4):
+        for b in range(4):
+          q[b] = spline(\
+            vals[ind[0]+a-1,ind[1]+b-1,ind[2]-1], \
+            vals[ind[0]+a-1,ind[1]+b-1,ind[2]], \
+            vals[ind[0]+a-1,ind[1]+b-1,ind[2]+1], \
+            vals[ind[0]+a-1,ind[1]+b-1,ind[2]+2], t[2])
+        p[a] = spline(q[0], q[1], q[2], q[3], t[1])
+      out[n-n_start] = spline(p[0], p[1], p[2], p[3], t[0])
+    else:
+      # Trilinear interpolation, which also handles levels
+      # with a single point in a dimension
+      for d in range(3):
+        if level_counts[d]==1:
+          t[d] = 0.
+      i1 = min(ind[0]+1, level_counts[0]-1)
+      j1 = min(ind[1]+1, level_counts[1]-1)
+      k1 = min(ind[2]+1, level_counts[2]-1)
+      c00 = vals[ind[0],ind[1],ind[2]]*(1-t[2]) + vals[ind[0],ind[1],k1]*t[2]
+      c01 = vals[ind[0],j1,ind[2]]*(1-t[2]) + vals[ind[0],j1,k1]*t[2]
+      c10 = vals[i1,ind[1],ind[2]]*(1-t[2]) + vals[i1,ind[1],k1]*t[2]
+      c11 = vals[i1,j1,ind[2]]*(1-t[2]) + vals[i1,j1,k1]*t[2]
+      c0 = c00*(1-t[1]) + c01*t[1]
+      c1 = c10*(1-t[1]) + c11*t[1]
+      out[n-n_start] = c0*(1-t[0]) + c1*t[0]
+    n += 1
+
+cpdef resample(levels, origin, spacing, counts, \
+    int_t n_start, float_t[::1] out, int_t order=1):
+  """
+  Resamples focusing levels onto a regular grid
+
+  levels is a list of (vals, origin, spacing) tuples,
+    from the finest to the coarsest level.
+    vals is a 3D array.
+  origin, spacing, and counts describe the destination grid.
+  Values are written to out for the points with flat indices
+    [n_start, n_start+len(out)) of the destination grid,
+    which is also returned as a numpy array.
+  Each point takes the value from the finest level that contains it.
+    Points outside all levels take the nearest value on the coarsest level.
+  order is 1 for trilinear and 3 for Catmull-Rom interpolation.
+  """
+  cdef int_t l
+  if len(levels)==0:
+    raise Exception('No grid levels to resample')
+  if not order in [1,3]:
+    raise Exception('Interpolation order must be 1 or 3')
+  origin = np.array(origin, dtype=float)
+  spacing = np.array(spacing, dtype=float)
+  counts = np.array(counts, dtype=int)
+  # Fill from the coarsest to the finest level,
+  # so that finer levels overwrite coarser ones
+  for l in range(len(levels)-1,-1,-1):
+    (vals, level_origin, level_spacing) = levels[l]
+    interpolate_level(np.ascontiguousarray(vals, dtype=float), \
+      np.array(level_origin, dtype=float), \
+      np.array(level_spacing, dtype=float), \
+      origin, spacing, counts, n_start, out, order, l==len(levels)-1)
+  return np.asarray(out)
@@ -0,0 +1,189 @@
+#!/usr/bin/env python
+
+# Evaluates interaction grid energies of many rigid poses of ligand
+# configurations, as in the random placement of ligands into the binding site.
+#
+# Each configuration, centered at its center of mass, is rotated once
+# for every rotation. Translations are added to the rotated coordinates
+# as atoms are interpolated, so that poses are never stored.
+# Energies are those of the MMTK trilinear grid terms at unit strength,
+# including the harmonic restraint on atoms outside the grid.
+# Configurations and rotations are scanned in parallel when OpenMP is available.
+
+import cython
+
+import numpy as np
+cimport numpy as np
+
+from libc.math cimport pow
+from libc.stdlib cimport malloc, free
+from cython.parallel cimport prange, parallel
+
+# Spring constant for atoms outside the grid, in kJ/mol nm**2
+cdef double k_outside = 10000.
+
+cdef struct grid_t:
+  double spacing[3]
+  double hCorner[3]
+  int counts[3]
+  int nyz
+  const double* vals
+  const double* scaling_factor
+  double inv_power # Zero if the grid is not transformed
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+@cython.cdivision(True)
+cdef double grid_energy(const grid_t* g, const double* x, int natoms, \
+    const double* t) nogil:
+  # Energy of the coordinates x translated by t on grid g
+  cdef double E = 0.
+  cdef double p[3]
+  cdef double f[3]
+  cdef double a[3]
+  cdef double vm, vp, interpolated, dev, sf
+  cdef int ind, d, ix, iy, iz, i
+  cdef int nz = g.counts[2]
+  cdef int nyz = g.nyz
+  for ind in range(natoms):
+    # Atoms that do not interact with the grid are not restrained either
+    sf = g.scaling_factor[ind]
+    if sf == 0.:
+      continue
+    p[0] = x[3*ind] + t[0]
+    p[1] = x[3*ind+1] + t[1]
+    p[2] = x[3*ind+2] + t[2]
+    if (p[0]>0.) and (p[1]>0.) and (p[2]>0.) and \
+       (p[0]<g.hCorner[0]) and (p[1]<g.hCorner[1]) and (p[2]<g.hCorner[2]):
+      ix = <int>(p[0]/g.spacing[0])
+      iy = <int>(p[1]/g.spacing[1])
+      iz = <int>(p[2]/g.spacing[2])
+      f[0] = (p[0] - ix*g.spacing[0])/g.spacing[0]
+      f[1] = (p[1] - iy*g.spacing[1])/g.spacing[1]
+      f[2] = (p[2] - iz*g.spacing[2])/g.spacing[2]
+      for d in range(3):
+        a[d] = 1. - f[d]
+      i = ix*nyz + iy*nz + iz
+      vm = a[1]*(a[2]*g.vals[i] + f[2]*g.vals[i+1]) + \
+        f[1]*(a[2]*g.vals[i+nz] + f[2]*g.vals[i+nz+1])
+      i += nyz
+      vp = a[1]*(a[2]*g.vals[i] + f[2]*g.vals[i+1]) + \
+        f[1]*(a[2]*g.vals[i+nz] + f[2]*g.vals[i+nz+1])
+      interpolated = a[0]*vm + f[0]*vp
+      if g.inv_power == 4.:
+        interpolated = interpolated*interpolated
+        interpolated = interpolated*interpolated
+      elif g.inv_power != 0.:
+        interpolated = pow(interpolated, g.inv_power)
+      E += sf*interpolated
+    else:
+      for d in range(3):
+        if p[d] < 0.:
+          E += k_outside*p[d]*p[d]/2.
+        elif p[d] > g.hCorner[d]:
+          dev = p[d] - g.hCorner[d]
+          E += k_outside*dev*dev/2.
+  return E
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+def scan_poses(centered, rotT, trans, int t_start, int t_end, \
+    grids, scaling_factors, out):
+  """
+  Evaluates grid energies of rigid poses
+  :param centered: an (nconfs, natoms, 3) array of configurations
+    with their center of mass at the origin
+  :param rotT: an (nrot, 3, 3) array of transposed rotation matrices
+  :param trans: an (ntrans, 3) array of translations
+  :param t_start: the first translation to evaluate
+  :param t_end: one after the last translation to evaluate
+  :param grids: a list of InterpolationForceField objects
+    with trilinear interpolation and no energy threshold
+  :param scaling_factors: a list of the atomic scaling factors of each grid
+  :param out: a list with a C-contiguous (nconfs, nrot, >=t_end) array
+    for each grid. out[g][c,r,t] will be the energy on grid g at unit strength
+    of configuration c with rotation r and translation t.
+  """
+  cdef double[:, :, ::1] X_v = np.ascontiguousarray(centered, dtype=np.double)
+  cdef double[:, :, ::1] rotT_v = np.ascontiguousarray(rotT, dtype=np.double)
+  cdef double[:, ::1] trans_v = np.ascontiguousarray(trans, dtype=np.double)
+  cdef int nconfs = X_v.shape[0]
+  cdef int natoms = X_v.shape[1]
+  cdef int nrot = rotT_v.shape[0]
+  cdef int ngrids = len(grids)
+  if (nconfs == 0) or (nrot == 0) or (ngrids == 0) or (t_end <= t_start):
+    return
+  if (t_start < 0) or (t_end > trans_v.shape[0]):
+    raise Exception('Translation indices out of range')
+
+  # Set up the grids. The arrays are kept in a list so that
+  # pointers to their data remain valid.
+  keep = []
+  cdef grid_t* g = <grid_t*>malloc(ngrids*sizeof(grid_t))
+  cdef double** out_p = <double**>malloc(ngrids*sizeof(double*))
+  cdef double[::1] vals_v
+  cdef double[::1] sf_v
+  cdef double[:, :, ::1] out_v
+  cdef int gi, d
+  cdef int out_stride = -1
+  try:
+    for gi in range(ngrids):
+      ff = grids[gi]
+      if (ff.params['interpolation_type'] != 'Trilinear') or \
+          (ff.params['energy_thresh'] > 0):
+        raise Exception('Only trilinear grids without thresholds are supported')
+      vals_v = np.ascontiguousarray(\
+        np.ravel(ff.grid_data['vals']), dtype=np.double)
+      sf_v = np.ascontiguousarray(scaling_factors[gi], dtype=np.double)
+      out_v = out[gi]
+      if (out_v.shape[0] != nconfs) or (out_v.shape[1] != nrot) or \
+          (out_v.shape[2] < t_end) or (sf_v.shape[0] != natoms):
+        raise Exception('Array shapes are inconsistent')
+      if (out_stride != -1) and (out_stride != out_v.shape[2]):
+        raise Exception('Output arrays must have the same shape')
+      out_stride = out_v.shape[2]
+      keep.append((vals_v, sf_v, out_v))
+      for d in range(3):
+        g[gi].spacing[d] = ff.grid_data['spacing'][d]
+        g[gi].counts[d] = ff.grid_data['counts'][d]
+        g[gi].hCorner[d] = g[gi].spacing[d]*(g[gi].counts[d]-1)
+      g[gi].nyz = g[gi].counts[1]*g[gi].counts[2]
+      g[gi].vals = &vals_v[0]
+      g[gi].scaling_factor = &sf_v[0]
+      g[gi].inv_power = 0. if ff.params['inv_power'] is None \
+        else ff.params['inv_power']
+      out_p[gi] = &out_v[0,0,0]
+
+    scan_kernel(&X_v[0,0,0], nconfs, natoms, &rotT_v[0,0,0], nrot, \
+      &trans_v[0,0], t_start, t_end, g, ngrids, out_p, out_stride)
+  finally:
+    free(g)
+    free(out_p)
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+cdef void scan_kernel(const double* X, int nconfs, int natoms, \
+    const double* rotT, int nrot, const double* trans, int t_start, int t_end, \
+    const grid_t* g, int ngrids, double** out, int out_stride) nogil:
+  cdef int n, c, r, t, gi, ind, i, j
+  cdef double* x
+  cdef const double* R
+  cdef const double* y
+  cdef long offset
+  with parallel():
+    x = <double*>malloc(3*natoms*sizeof(double))
+    for n in prange(nconfs*nrot, schedule='dynamic'):
+      c = n/nrot
+      r = n%nrot
+      # Rotate the configuration
+      R = &rotT[9*r]
+      y = &X[3*natoms*c]
+      for ind in range(natoms):
+        for j in range(3):
+          x[3*ind+j] = y[3*ind]*R[j] + y[3*ind+1]*R[3+j] + y[3*ind+2]*R[6+j]
+      # Evaluate all translations
+      offset = (<long>n)*out_stride
+      for t in range(t_start, t_end):
+        for gi in range(ngrids):
+          out[gi][offset + t] = grid_energy(&g[gi], x, natoms, &trans[3*t])
+    free(x)
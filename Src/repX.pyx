@@ -4,23 +4,159 @@ import numpy as np
 cimport numpy as np
 import cython
 
-ctypedef np.float_t float_t
-ctypedef np.int_t int_t
+from libc.math cimport exp
+from libc.stdint cimport uint64_t
+
+### Random number generator
+# xoshiro256+, seeded from the numpy random number generator
+# so that swaps are reproducible with np.random.seed
+cdef struct rng_state:
+  uint64_t s[4]
+
+cdef inline uint64_t rotl(uint64_t x, int k) nogil:
+  return (x << k) | (x >> (64 - k))
+
+cdef inline double uniform(rng_state* r) nogil:
+  # Returns a random number in [0, 1)
+  cdef uint64_t result = r.s[0] + r.s[3]
+  cdef uint64_t t = r.s[1] << 17
+  r.s[2] ^= r.s[0]
+  r.s[3] ^= r.s[1]
+  r.s[1] ^= r.s[2]
+  r.s[0] ^= r.s[3]
+  r.s[2] ^= t
+  r.s[3] = rotl(r.s[3], 45)
+  return (result >> 11) * (1.0/9007199254740992.0)
+
+cdef void seed_rng(rng_state* r):
+  # The state is filled by splitmix64, which spreads the seed over all bits
+  cdef uint64_t z
+  cdef uint64_t x = <uint64_t>np.random.randint(1, 2**62)
+  cdef int i
+  for i in range(4):
+    x += <uint64_t>0x9E3779B97F4A7C15
+    z = x
+    z = (z ^ (z >> 30)) * <uint64_t>0xBF58476D1CE4E5B9
+    z = (z ^ (z >> 27)) * <uint64_t>0x94D049BB133111EB
+    r.s[i] = z ^ (z >> 31)
+
+### Swap kernels
+# U[s*K+c] is the reduced energy of configuration c in state s.
+# config_of[s] is the configuration in state s,
+# and state_of[c] is the state of configuration c.
+cdef inline double swap_ddu(const double* U, int K, \
+    const int* config_of, int t1, int t2) nogil:
+  # Negative change in reduced energy from swapping states t1 and t2
+  cdef int a = config_of[t1]
+  cdef int b = config_of[t2]
+  return U[t1*K+a] + U[t2*K+b] - U[t2*K+a] - U[t1*K+b]
+
+cdef inline void swap(int* config_of, int* state_of, \
+    int t1, int t2) nogil:
+  cdef int a = config_of[t1]
+  cdef int b = config_of[t2]
+  config_of[t1] = b
+  config_of[t2] = a
+  state_of[a] = t2
+  state_of[b] = t1
+
+@cython.boundscheck(False)
+@cython.wraparound(False)
+cdef int neighbor_swaps(const double* U, int K, \
+    int* config_of, int* state_of, const int* pairs, int npairs, \
+    int nattempts, rng_state* r) nogil:
+  # Metropolis swaps between listed pairs of states
+  cdef int attempt, p, t1, t2
+  cdef int nacc = 0
+  cdef double ddu
+  for attempt in range(nattempts):
+    for p in range(npairs):
+      t1 = pairs[2*p]
+      t2 = pairs[2*p+1]
+      ddu = swap_ddu(U, K, config_of, t1, t2)
+      if (ddu>0) or (uniform(r)<exp(ddu)):
+        swap(config_of, state_of, t1, t2)
+        nacc += 1
+  return nacc
 
 @cython.boundscheck(False)
+@cython.wraparound(False)
+cdef int gibbs_swaps(const double* U, int K, int* config_of, int* state_of, \
+    int nsweeps, rng_state* r) nogil:
+  # Heat bath swaps between all pairs of states.
+  # Each sweep updates every pair, so with many sweeps the permutation
+  # approaches a sample from its distribution (infinite swapping).
+  cdef int sweep, t1, t2
+  cdef int nacc = 0
+  cdef double ddu, e, p
+  for sweep in range(nsweeps):
+    for t1 in range(K-1):
+      for t2 in range(t1+1, K):
+        ddu = swap_ddu(U, K, config_of, t1, t2)
+        if ddu>0:
+          p = 1./(1.+exp(-ddu))
+        else:
+          e = exp(ddu)
+          p = e/(1.+e)
+        if uniform(r)<p:
+          swap(config_of, state_of, t1, t2)
+          nacc += 1
+  return nacc
+
 cpdef attempt_swaps(\
     state_inds, inv_state_inds, u_ij, \
-    pairs_to_swap, int nattempts):
-  cdef int attempt, t1, t2, a, b
-  cdef float ddu
-  for attempt in range(nattempts):
-    for (t1,t2) in pairs_to_swap:
-      a = inv_state_inds[t1]
-      b = inv_state_inds[t2]
-      ddu = -u_ij[a][b]-u_ij[b][a]+u_ij[a][a]+u_ij[b][b]
-      if (ddu>0) or (np.random.uniform()<np.exp(ddu)):
-        u_ij[a],u_ij[b] = u_ij[b],u_ij[a]
-        state_inds[a],state_inds[b] = state_inds[b],state_inds[a]
-        inv_state_inds[state_inds[a]],inv_state_inds[state_inds[b]] = \
-          inv_state_inds[state_inds[b]],inv_state_inds[state_inds[a]]
-  return state_inds, inv_state_inds
\ No newline at end of file
+    pairs_to_swap, int nattempts, scheme='neighbors'):
+  """
+  Attempts replica exchange swaps
+
+  Parameters
+  ----------
+  state_inds : list of int
+    The state of each configuration
+  inv_state_inds : list of int
+    The configuration in each state
+  u_ij : list of np.array
+    Reduced energies, where i is the replica and j is the configuration.
+    Replica i is in the state of configuration i.
+  pairs_to_swap : list of (int, int)
+    Pairs of states to swap with the 'neighbors' scheme
+  nattempts : int
+    Number of attempts for each pair with the 'neighbors' scheme,
+    or sweeps over all pairs with the 'infinite' scheme
+  scheme : str
+    'neighbors' for Metropolis swaps between pairs_to_swap or
+    'infinite' for heat bath swaps between all pairs of states
+
+  Returns
+  -------
+  state_inds : list of int
+  inv_state_inds : list of int
+  """
+  cdef int K = len(state_inds)
+  cdef int c, j
+  cdef double[:, ::1] u = np.ascontiguousarray(u_ij, dtype=np.double)
+  # Arrange the energies by state rather than replica
+  cdef double[:, ::1] U = np.empty((K, K))
+  cdef int[::1] state_of = np.array(state_inds, dtype=np.intc)
+  cdef int[::1] config_of = np.array(inv_state_inds, dtype=np.intc)
+  for c in range(K):
+    for j in range(K):
+      U[state_of[c],j] = u[c,j]
+
+  cdef int[::1] pairs
+  cdef int npairs
+  cdef rng_state r
+  seed_rng(&r)
+  if K > 1:
+    if scheme == 'neighbors':
+      npairs = len(pairs_to_swap)
+      if npairs > 0:
+        pairs = np.array(pairs_to_swap, dtype=np.intc).reshape(-1)
+        neighbor_swaps(&U[0,0], K, &config_of[0], &state_of[0], \
+          &pairs[0], npairs, nattempts, &r)
+    elif scheme == 'infinite':
+      gibbs_swaps(&U[0,0], K, &config_of[0], &state_of[0], nattempts, &r)
+    else:
+      raise Exception('Unrecognized swap scheme!')
+  return [int(state_of[c]) for c in range(K)], \
+    [int(config_of[c]) for c in range(K)]
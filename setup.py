@@ -122,7 +122,9 @@ paths = [os.path.join('AlGDock', 'ForceFields', 'Cylinder'),
          os.path.join('AlGDock', 'Integrators', 'ExternalMC'),
          os.path.join('AlGDock', 'Integrators', 'HamiltonianMonteCarlo'),
          os.path.join('AlGDock', 'Integrators', 'NUTS'),
+         os.path.join('AlGDock', 'Integrators', 'RESPA'),
          os.path.join('AlGDock', 'Integrators', 'SmartDarting'),
+         os.path.join('AlGDock', 'Integrators', 'TorsionalHMC'),
          os.path.join('AlGDock', 'Integrators', 'VelocityVerlet')]
 
 data_files = []
@@ -334,6 +336,12 @@ if sys.platform == 'odf1V4':
 
 high_opt.append('-g')
 
+# OpenMP options, for extension modules that convert many configurations
+openmp_modules = ['BAT', 'pose_scan', 'estimators']
+openmp_opt = []
+if sys.platform[:5] == 'linux' and 'gcc' in sysconfig['CC']:
+    openmp_opt = ['-fopenmp']
+
 #################################################################
 
 ext_module_name_and_path = [\
@@ -364,9 +372,14 @@ ext_module_name_and_path = [\
   ('MMTK_electric_field_z', \
     ['AlGDock/ForceFields/ElectricField/MMTK_electric_field_z.c']), \
   ('NUTS', ['AlGDock/Integrators/NUTS/NUTS.pyx']), \
+  ('HMC', ['AlGDock/Integrators/HamiltonianMonteCarlo/HMC.pyx']), \
   ('SmartDarting', ['AlGDock/Integrators/SmartDarting/SmartDarting.pyx']), \
   ('BAT', ['Src/BAT.pyx']),
-  ('repX', ['Src/repX.pyx'])]
+  ('repX', ['Src/repX.pyx']),
+  ('pose_scan', ['Src/pose_scan.pyx']),
+  ('estimators', ['Src/estimators.pyx']),
+  ('grid_resample', ['Src/grid_resample.pyx']),
+  ('grid_dx', ['Src/grid_dx.pyx'])]
 
 if False:
   # These extension modules are not used in the current code,
@@ -427,11 +440,15 @@ rigid receptor.
                    'AlGDock.Integrators.ExternalMC',
                    'AlGDock.Integrators.HamiltonianMonteCarlo',
                    'AlGDock.Integrators.NUTS',
+                   'AlGDock.Integrators.RESPA',
                    'AlGDock.Integrators.SmartDarting',
+                   'AlGDock.Integrators.TorsionalHMC',
                    'AlGDock.Integrators.VelocityVerlet'],
        ext_package = 'AlGDock.'+sys.platform,
        ext_modules = [Extension(name, path, \
-        extra_compile_args = compile_args + high_opt, \
+        extra_compile_args = compile_args + high_opt + \
+          (openmp_opt if name in openmp_modules else []), \
+        extra_link_args = (openmp_opt if name in openmp_modules else []), \
         include_dirs = include_dirs, \
         define_macros = \
           [('SERIAL', None), ('VIRIAL', None), ('MACROSCOPIC', None)] \